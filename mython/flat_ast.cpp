@@ -0,0 +1,762 @@
+#include "flat_ast.h"
+
+#include <algorithm>
+#include <array>
+#include <sstream>
+#include <stdexcept>
+#include <typeinfo>
+
+#if defined(__GNUC__)
+#define MYTHON_NOINLINE __attribute__((noinline))
+#else
+#define MYTHON_NOINLINE
+#endif
+
+using namespace std;
+
+namespace flat {
+
+using runtime::Closure;
+using runtime::Context;
+using runtime::ObjectHolder;
+
+namespace {
+
+const string ADD_METHOD = "__add__"s;
+const string INIT_METHOD = "__init__"s;
+const string SELF_NAME = "self"s;
+
+ObjectHolder MakeBool(bool value) {
+    return ObjectHolder::Own(runtime::Bool(value));
+}
+
+ObjectHolder Concatenate(string_view lhs, string_view rhs) {
+    string result;
+    result.reserve(lhs.size() + rhs.size());
+    result.append(lhs).append(rhs);
+    return ObjectHolder::Own(runtime::String(std::move(result)));
+}
+
+// Арифметическая операция kind над двумя числами
+int Calculate(NodeKind kind, int lhs, int rhs) {
+    switch (kind) {
+    case NodeKind::Add:
+        return lhs + rhs;
+    case NodeKind::Sub:
+        return lhs - rhs;
+    case NodeKind::Mult:
+        return lhs * rhs;
+    default:
+        if (rhs == 0) {
+            throw runtime_error("Not valid div"s);
+        }
+        return lhs / rhs;
+    }
+}
+
+// Сравнение kind двух чисел либо двух строк
+template <typename Value>
+bool Compare(NodeKind kind, const Value& lhs, const Value& rhs) {
+    switch (kind) {
+    case NodeKind::Less:
+        return lhs < rhs;
+    case NodeKind::Greater:
+        return lhs > rhs;
+    case NodeKind::Equal:
+        return lhs == rhs;
+    case NodeKind::NotEqual:
+        return lhs != rhs;
+    case NodeKind::LessOrEqual:
+        return lhs <= rhs;
+    default:
+        return lhs >= rhs;
+    }
+}
+
+// Объект, тип которого доказан выводом типов. Точный тип сверяется по typeid, что дешевле
+// dynamic_cast. Если вывод ошибся, возвращает nullptr, и операция выполняется общим путём
+template <typename Object>
+const Object* ProvenObject(const ObjectHolder& object) {
+    const runtime::Object* value = object.Get();
+    return value != nullptr && typeid(*value) == typeid(Object) ? static_cast<const Object*>(value)
+                                                                 : nullptr;
+}
+
+// Узел вычисляет логическое значение: сравнение либо логическая операция
+bool IsCondition(NodeKind kind) {
+    switch (kind) {
+    case NodeKind::Or:
+    case NodeKind::And:
+    case NodeKind::Not:
+    case NodeKind::Less:
+    case NodeKind::Greater:
+    case NodeKind::Equal:
+    case NodeKind::NotEqual:
+    case NodeKind::LessOrEqual:
+    case NodeKind::GreaterOrEqual:
+        return true;
+    default:
+        return false;
+    }
+}
+
+ObjectHolder AddValues(const ObjectHolder& lhs, const ObjectHolder& rhs, Context& context) {
+    if (const auto* n_lhs = lhs.TryAs<runtime::Number>()) {
+        if (const auto* n_rhs = rhs.TryAs<runtime::Number>()) {
+            return ObjectHolder::Own(runtime::Number(n_lhs->GetValue() + n_rhs->GetValue()));
+        }
+    } else if (const auto* s_lhs = lhs.TryAs<runtime::String>()) {
+        if (const auto* s_rhs = rhs.TryAs<runtime::String>()) {
+            return Concatenate(s_lhs->GetValue(), s_rhs->GetValue());
+        }
+    } else if (auto* instance = lhs.TryAs<runtime::ClassInstance>()) {
+        if (instance->HasMethod(ADD_METHOD, 1)) {
+            return instance->Call(ADD_METHOD, {rhs}, context);
+        }
+    }
+    throw runtime_error("Not valid add"s);
+}
+
+// Имя арифметической операции в сообщении об ошибке
+string_view ArithmeticName(NodeKind kind) {
+    switch (kind) {
+    case NodeKind::Add:
+        return "add"sv;
+    case NodeKind::Sub:
+        return "sub"sv;
+    case NodeKind::Mult:
+        return "mult"sv;
+    default:
+        return "div"sv;
+    }
+}
+
+void PrintValue(const ObjectHolder& object, Context& context) {
+    if (object) {
+        object->Print(context.GetOutputStream(), context);
+    } else {
+        context.GetOutputStream() << "None"sv;
+    }
+}
+
+// Вызывает метод объекта. Методы с переменными в ячейках вызываются без построения Closure
+ObjectHolder InvokeMethod(runtime::ClassInstance& instance, const runtime::Method& method,
+                          const vector<ObjectHolder>& args, Context& context) {
+    const auto* body = dynamic_cast<const MethodBody*>(method.body.get());
+    if (body != nullptr && body->HasSlots()) {
+        return body->Call(ObjectHolder::Share(instance), args, context);
+    }
+    return instance.Call(method.name, args, context);
+}
+
+}  // namespace
+
+bool IsFalseValue(const ObjectHolder& object) {
+    if (const auto* num = object.TryAs<runtime::Number>()) {
+        return num->GetValue() == 0;
+    }
+    if (const auto* str = object.TryAs<runtime::String>()) {
+        return str->GetValue().empty();
+    }
+    if (const auto* value = object.TryAs<runtime::Bool>()) {
+        return !value->GetValue();
+    }
+    return false;
+}
+
+// Ячейка кадра метода. Пустое значение соответствует None, поэтому признак присваивания
+// хранится отдельно. Число, присвоенное узлом ScratchAssignment и увеличенное узлом
+// LocalIncrement, хранится в number без создания объекта
+struct Ast::Slot {
+    ObjectHolder value;
+    bool defined = false;
+    bool is_number = false;
+    int number = 0;
+};
+
+// Промежуточный результат: аргумент арифметики или сравнения. Число, вычисленное
+// арифметикой или прочитанное из ячейки, хранится без создания объекта в куче
+struct Ast::Temporary {
+    ObjectHolder object;
+    int number = 0;
+    bool is_number = false;
+
+    // Записывает в value числовое значение. Если тип доказан выводом типов, сверяет только typeid
+    bool GetNumber(bool proven, int& value) const {
+        if (is_number) {
+            value = number;
+            return true;
+        }
+        if (const auto* num = proven ? ProvenObject<runtime::Number>(object) : nullptr) {
+            value = num->GetValue();
+            return true;
+        }
+        if (const auto* num = object.TryAs<runtime::Number>()) {
+            value = num->GetValue();
+            return true;
+        }
+        return false;
+    }
+
+    // Значение, которое покидает выражение
+    ObjectHolder Box() && {
+        return is_number ? ObjectHolder::Own(runtime::Number(number)) : std::move(object);
+    }
+};
+
+// Состояние выполнения тела метода либо инструкции верхнего уровня.
+// Переменные хранятся в closure либо, у методов с размещёнными переменными, в slots
+struct Ast::Frame {
+    Closure* closure;
+    Slot* slots;
+    Context& context;
+    // Выполнена инструкция return, result содержит её значение
+    bool returning = false;
+    ObjectHolder result{};
+};
+
+NodeId Ast::AddNode(NodeKind kind, Operands operands) {
+    kinds_.push_back(kind);
+    operands_.push_back(operands);
+    return static_cast<NodeId>(kinds_.size() - 1);
+}
+
+void Ast::SetNode(NodeId node, NodeKind kind, Operands operands) {
+    kinds_[node] = kind;
+    operands_[node] = operands;
+}
+
+void Ast::SetList(ListId list, const uint32_t* begin, const uint32_t* end) {
+    const auto size = static_cast<uint32_t>(end - begin);
+    if (size > lists_[list]) {
+        throw logic_error("List cannot grow"s);
+    }
+    lists_[list] = size;
+    std::copy(begin, end, lists_.begin() + list + 1);
+}
+
+uint32_t Ast::AddConstant(ObjectHolder value) {
+    constants_.push_back(std::move(value));
+    return static_cast<uint32_t>(constants_.size() - 1);
+}
+
+uint32_t Ast::AddName(std::string_view name) {
+    auto [it, inserted] = name_index_.emplace(string(name), static_cast<uint32_t>(names_.size()));
+    if (inserted) {
+        names_.push_back(it->first);
+    }
+    return it->second;
+}
+
+uint32_t Ast::AddMethod(NodeId body, vector<uint32_t> params) {
+    methods_.push_back({body, std::move(params)});
+    return static_cast<uint32_t>(methods_.size() - 1);
+}
+
+void Ast::SetSlotCount(uint32_t method, uint32_t slot_count) {
+    methods_[method].slot_count = slot_count;
+}
+
+uint32_t Ast::AddCallSite(CallSite site) {
+    call_sites_.push_back(site);
+    return static_cast<uint32_t>(call_sites_.size() - 1);
+}
+
+ListId Ast::AddList(const uint32_t* begin, const uint32_t* end) {
+    const auto list = static_cast<ListId>(lists_.size());
+    lists_.push_back(static_cast<uint32_t>(end - begin));
+    lists_.insert(lists_.end(), begin, end);
+    return list;
+}
+
+ObjectHolder Ast::Execute(NodeId node, Closure& closure, Context& context) const {
+    Frame frame{&closure, nullptr, context};
+    ObjectHolder result = Eval(node, frame);
+    if (frame.returning) {
+        throw std::move(frame.result);
+    }
+    return result;
+}
+
+ObjectHolder Ast::ExecuteMethod(uint32_t method, Closure& closure, Context& context) const {
+    Frame frame{&closure, nullptr, context};
+    Eval(methods_[method].body, frame);
+    return frame.returning ? std::move(frame.result) : ObjectHolder::None();
+}
+
+// Небольшие кадры размещаются на стеке, кадры с большим числом переменных - в куче
+MYTHON_NOINLINE ObjectHolder Ast::CallMethod(uint32_t method, ObjectHolder self,
+                                             const vector<ObjectHolder>& args,
+                                             Context& context) const {
+    constexpr uint32_t INLINE_SLOTS = 6;
+    const MethodInfo& info = methods_[method];
+    array<Slot, INLINE_SLOTS> inline_slots;
+    unique_ptr<Slot[]> heap_slots;
+    Slot* slots = inline_slots.data();
+    if (info.slot_count > INLINE_SLOTS) {
+        heap_slots = make_unique<Slot[]>(info.slot_count);
+        slots = heap_slots.get();
+    }
+    slots[0] = {std::move(self), true};
+    for (size_t i = 0; i < args.size(); ++i) {
+        slots[i + 1] = {args[i], true};
+    }
+    Frame frame{nullptr, slots, context};
+    Eval(info.body, frame);
+    return frame.returning ? std::move(frame.result) : ObjectHolder::None();
+}
+
+ObjectHolder Ast::EvalVariable(ListId names, Closure& closure) const {
+    const ListView ids = List(names);
+    auto it = closure.find(names_[ids[0]]);
+    if (it == closure.end()) {
+        throw runtime_error("Not have variable "s + names_[ids[0]]);
+    }
+    return LoadFields(it->second, ids);
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalLocalVariable(const Operands& op, Frame& frame) const {
+    const ListView ids = List(op.a);
+    const Slot& slot = frame.slots[op.b];
+    if (!slot.defined) {
+        throw runtime_error("Not have variable "s + names_[ids[0]]);
+    }
+    if (slot.is_number) {
+        return LoadFields(ObjectHolder::Own(runtime::Number(slot.number)), ids);
+    }
+    return LoadFields(slot.value, ids);
+}
+
+ObjectHolder Ast::LoadFields(ObjectHolder object, const ListView& ids) const {
+    for (size_t i = 1; i < ids.size(); ++i) {
+        auto* instance = object.TryAs<runtime::ClassInstance>();
+        if (instance == nullptr) {
+            throw runtime_error("Not an object: "s + names_[ids[i - 1]]);
+        }
+        auto field = instance->Fields().find(names_[ids[i]]);
+        if (field == instance->Fields().end()) {
+            throw runtime_error("Not have field "s + names_[ids[i]]);
+        }
+        object = field->second;
+    }
+    return object;
+}
+
+vector<ObjectHolder> Ast::EvalList(ListId list, Frame& frame) const {
+    const ListView nodes = List(list);
+    vector<ObjectHolder> values;
+    values.reserve(nodes.size());
+    for (NodeId node : nodes) {
+        values.push_back(Eval(node, frame));
+    }
+    return values;
+}
+
+// Глубина рекурсии Eval равна глубине вложенности узлов и вызовов методов, поэтому кадр Eval
+// должен быть небольшим. Узлы с большим числом локальных объектов выполняются отдельными функциями
+ObjectHolder Ast::Eval(NodeId node, Frame& frame) const {  // NOLINT
+    const Operands& op = operands_[node];
+    switch (kinds_[node]) {
+    case NodeKind::Constant:
+        return constants_[op.a];
+    case NodeKind::None:
+        return {};
+    case NodeKind::Variable:
+        return EvalVariable(op.a, *frame.closure);
+    case NodeKind::LocalVariable:
+        return EvalLocalVariable(op, frame);
+    case NodeKind::Assignment: {
+        ObjectHolder value = Eval(op.b, frame);
+        (*frame.closure)[names_[op.a]] = value;
+        return value;
+    }
+    case NodeKind::LocalAssignment: {
+        Slot& slot = frame.slots[op.c];
+        slot.value = Eval(op.b, frame);
+        slot.defined = true;
+        slot.is_number = false;
+        return slot.value;
+    }
+    case NodeKind::ScratchAssignment: {
+        // Число, в том числе константа, хранится без объекта, чтобы его увеличение узлом
+        // LocalIncrement тоже обходилось без создания объекта
+        Temporary value = EvalTemporary(op.b, frame);
+        Slot& slot = frame.slots[op.c];
+        slot.defined = true;
+        slot.is_number = value.GetNumber(false, slot.number);
+        slot.value = slot.is_number ? ObjectHolder() : std::move(value.object);
+        return {};
+    }
+    case NodeKind::FieldAssignment:
+        return EvalFieldAssignment(op, frame);
+    case NodeKind::FieldIncrement:
+        return EvalFieldIncrement(op, frame);
+    case NodeKind::LocalIncrement:
+        EvalLocalIncrement(op, frame);
+        return {};
+    case NodeKind::Print:
+        EvalPrint(op.a, frame);
+        return {};
+    case NodeKind::MethodCall:
+        return EvalMethodCall(op, frame);
+    case NodeKind::BoundMethodCall:
+        return EvalBoundMethodCall(op, frame);
+    case NodeKind::InlinedCall:
+        return EvalInlinedCall(op, frame);
+    case NodeKind::NewInstance:
+        return EvalNewInstance(op, frame);
+    case NodeKind::Stringify:
+        return EvalStringify(op.a, frame);
+    case NodeKind::Or:
+    case NodeKind::And:
+    case NodeKind::Not:
+        return MakeBool(EvalCondition(node, frame));
+    case NodeKind::Add:
+    case NodeKind::Sub:
+    case NodeKind::Mult:
+    case NodeKind::Div:
+        return EvalArithmetic(kinds_[node], op, frame).Box();
+    case NodeKind::Less:
+    case NodeKind::Greater:
+    case NodeKind::Equal:
+    case NodeKind::NotEqual:
+    case NodeKind::LessOrEqual:
+    case NodeKind::GreaterOrEqual:
+        return MakeBool(EvalComparison(kinds_[node], op, frame));
+    case NodeKind::Compound:
+        for (NodeId statement : List(op.a)) {
+            Eval(statement, frame);
+            if (frame.returning) {
+                break;
+            }
+        }
+        return {};
+    case NodeKind::Return:
+        frame.result = Eval(op.a, frame);
+        frame.returning = true;
+        return {};
+    case NodeKind::ReturnLocal:
+        frame.result = EvalLocalVariable(op, frame);
+        frame.returning = true;
+        return {};
+    case NodeKind::ClassDefinition: {
+        const ObjectHolder& cls = constants_[op.a];
+        (*frame.closure)[cls.TryAs<runtime::Class>()->GetName()] = cls;
+        return {};
+    }
+    case NodeKind::IfElse:
+        if (EvalCondition(op.a, frame)) {
+            return Eval(op.b, frame);
+        }
+        if (op.c != NO_NODE) {
+            return Eval(op.c, frame);
+        }
+        return {};
+    }
+    throw logic_error("Unknown node kind"s);
+}
+
+MYTHON_NOINLINE Ast::Temporary Ast::EvalTemporary(NodeId node, Frame& frame) const {
+    const Operands& op = operands_[node];
+    switch (kinds_[node]) {
+    case NodeKind::LocalVariable:
+        if (frame.slots[op.b].is_number && List(op.a).size() == 1) {
+            return {{}, frame.slots[op.b].number, true};
+        }
+        return {EvalLocalVariable(op, frame)};
+    case NodeKind::Add:
+    case NodeKind::Sub:
+    case NodeKind::Mult:
+    case NodeKind::Div:
+        return EvalArithmetic(kinds_[node], op, frame);
+    default:
+        return {Eval(node, frame)};
+    }
+}
+
+// Промежуточные результаты вложенной арифметики, например a + b в (a + b) * c,
+// не создают объектов: объект создаётся только для значения, которое покидает выражение
+MYTHON_NOINLINE Ast::Temporary Ast::EvalArithmetic(NodeKind kind, const Operands& op,
+                                                   Frame& frame) const {
+    Temporary lhs = EvalTemporary(op.a, frame);
+    Temporary rhs = EvalTemporary(op.b, frame);
+    // Типы аргументов доказаны выводом типов
+    if (op.c == static_cast<uint32_t>(ValueType::String)) {
+        const auto* l_string = ProvenObject<runtime::String>(lhs.object);
+        const auto* r_string = ProvenObject<runtime::String>(rhs.object);
+        if (l_string != nullptr && r_string != nullptr) {
+            return {Concatenate(l_string->GetValue(), r_string->GetValue())};
+        }
+    }
+    const bool proven = op.c == static_cast<uint32_t>(ValueType::Number);
+    int l_value = 0;
+    int r_value = 0;
+    if (lhs.GetNumber(proven, l_value) && rhs.GetNumber(proven, r_value)) {
+        return {{}, Calculate(kind, l_value, r_value), true};
+    }
+    if (kind != NodeKind::Add) {
+        throw runtime_error("Not valid "s + string(ArithmeticName(kind)));
+    }
+    return {AddValues(std::move(lhs).Box(), std::move(rhs).Box(), frame.context)};
+}
+
+MYTHON_NOINLINE bool Ast::EvalComparison(NodeKind kind, const Operands& op, Frame& frame) const {
+    Temporary l_temporary = EvalTemporary(op.a, frame);
+    Temporary r_temporary = EvalTemporary(op.b, frame);
+    if (op.c == static_cast<uint32_t>(ValueType::String)) {
+        const auto* l_string = ProvenObject<runtime::String>(l_temporary.object);
+        const auto* r_string = ProvenObject<runtime::String>(r_temporary.object);
+        if (l_string != nullptr && r_string != nullptr) {
+            return Compare(kind, l_string->GetValue(), r_string->GetValue());
+        }
+    }
+    const bool proven = op.c == static_cast<uint32_t>(ValueType::Number);
+    int l_value = 0;
+    int r_value = 0;
+    if (l_temporary.GetNumber(proven, l_value) && r_temporary.GetNumber(proven, r_value)) {
+        return Compare(kind, l_value, r_value);
+    }
+    const ObjectHolder lhs = std::move(l_temporary).Box();
+    const ObjectHolder rhs = std::move(r_temporary).Box();
+    Context& context = frame.context;
+    switch (kind) {
+    case NodeKind::Less:
+        return runtime::Less(lhs, rhs, context);
+    case NodeKind::Greater:
+        return runtime::Greater(lhs, rhs, context);
+    case NodeKind::Equal:
+        return runtime::Equal(lhs, rhs, context);
+    case NodeKind::NotEqual:
+        return runtime::NotEqual(lhs, rhs, context);
+    case NodeKind::LessOrEqual:
+        return runtime::LessOrEqual(lhs, rhs, context);
+    case NodeKind::GreaterOrEqual:
+        return runtime::GreaterOrEqual(lhs, rhs, context);
+    default:
+        throw logic_error("Not a comparison"s);
+    }
+}
+
+// Сравнения и логические операции в условии вычисляются без создания объекта Bool
+MYTHON_NOINLINE bool Ast::EvalCondition(NodeId node, Frame& frame) const {
+    const Operands& op = operands_[node];
+    switch (kinds_[node]) {
+    case NodeKind::Or:
+        return EvalCondition(op.a, frame) || EvalCondition(op.b, frame);
+    case NodeKind::And:
+        return EvalCondition(op.a, frame) && EvalCondition(op.b, frame);
+    case NodeKind::Not:
+        // Для значений, кроме логических, not расходится с IsTrue: экземпляр класса и None
+        // не являются ни истинными, ни ложными
+        if (IsCondition(kinds_[op.a])) {
+            return !EvalCondition(op.a, frame);
+        }
+        return IsFalseValue(Eval(op.a, frame));
+    case NodeKind::Less:
+    case NodeKind::Greater:
+    case NodeKind::Equal:
+    case NodeKind::NotEqual:
+    case NodeKind::LessOrEqual:
+    case NodeKind::GreaterOrEqual:
+        return EvalComparison(kinds_[node], op, frame);
+    default:
+        return runtime::IsTrue(Eval(node, frame));
+    }
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalFieldAssignment(const Operands& op, Frame& frame) const {
+    ObjectHolder object = Eval(op.a, frame);
+    auto* instance = object.TryAs<runtime::ClassInstance>();
+    if (instance == nullptr) {
+        throw runtime_error("Cannot assign field "s + names_[op.b] + " of a non-object"s);
+    }
+    ObjectHolder value = Eval(op.c, frame);
+    instance->Fields()[names_[op.b]] = value;
+    return value;
+}
+
+// Поле читается до вычисления слагаемого, как в x.f = x.f + k, а объект вычисляется один раз:
+// между двумя чтениями переменной x в исходной инструкции ничего не выполняется
+MYTHON_NOINLINE ObjectHolder Ast::EvalFieldIncrement(const Operands& op, Frame& frame) const {
+    ObjectHolder object = Eval(op.a, frame);
+    auto* instance = object.TryAs<runtime::ClassInstance>();
+    if (instance == nullptr) {
+        throw runtime_error("Cannot assign field "s + names_[op.b] + " of a non-object"s);
+    }
+    const string& name = names_[op.b];
+    const auto field = instance->Fields().find(name);
+    if (field == instance->Fields().end()) {
+        throw runtime_error("Not have field "s + name);
+    }
+    ObjectHolder current = field->second;
+    Temporary rhs = EvalTemporary(op.c, frame);
+    ObjectHolder value;
+    const auto* number = current.TryAs<runtime::Number>();
+    int r_value = 0;
+    if (number != nullptr && rhs.GetNumber(false, r_value)) {
+        value = ObjectHolder::Own(runtime::Number(number->GetValue() + r_value));
+    } else {
+        value = AddValues(current, std::move(rhs).Box(), frame.context);
+    }
+    // Вычисление слагаемого могло добавить объекту поля, поэтому поле ищется заново
+    instance->Fields()[name] = value;
+    return value;
+}
+
+// Слагаемое не может присвоить переменной метода, поэтому её значение читается после его
+// вычисления. Число в ячейке без объекта остаётся в ней без объекта
+MYTHON_NOINLINE void Ast::EvalLocalIncrement(const Operands& op, Frame& frame) const {
+    if (!frame.slots[op.c].defined) {
+        throw runtime_error("Not have variable "s + names_[op.a]);
+    }
+    Temporary rhs = EvalTemporary(op.b, frame);
+    Slot& slot = frame.slots[op.c];
+    int r_value = 0;
+    if (rhs.GetNumber(false, r_value)) {
+        if (slot.is_number) {
+            slot.number += r_value;
+            return;
+        }
+        if (const auto* number = slot.value.TryAs<runtime::Number>()) {
+            slot.value = ObjectHolder::Own(runtime::Number(number->GetValue() + r_value));
+            return;
+        }
+    }
+    ObjectHolder lhs = slot.is_number ? ObjectHolder::Own(runtime::Number(slot.number)) : slot.value;
+    slot.value = AddValues(lhs, std::move(rhs).Box(), frame.context);
+    slot.is_number = false;
+}
+
+MYTHON_NOINLINE void Ast::EvalPrint(ListId args, Frame& frame) const {
+    const ListView nodes = List(args);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (i > 0) {
+            frame.context.GetOutputStream() << ' ';
+        }
+        PrintValue(Eval(nodes[i], frame), frame.context);
+    }
+    frame.context.GetOutputStream() << '\n';
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalMethodCall(const Operands& op, Frame& frame) const {
+    // Как и в ast::MethodCall, аргументы вычисляются раньше объекта
+    const vector<ObjectHolder> args = EvalList(op.c, frame);
+    ObjectHolder object = Eval(op.a, frame);
+    auto* instance = object.TryAs<runtime::ClassInstance>();
+    if (instance == nullptr) {
+        return {};
+    }
+    const runtime::Method* method = instance->GetClass().GetMethod(names_[op.b]);
+    if (method == nullptr || method->formal_params.size() != args.size()) {
+        return {};
+    }
+    return InvokeMethod(*instance, *method, args, frame.context);
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalBoundMethodCall(const Operands& op, Frame& frame) const {
+    const vector<ObjectHolder> args = EvalList(op.c, frame);
+    ObjectHolder object = Eval(op.a, frame);
+    auto* instance = object.TryAs<runtime::ClassInstance>();
+    if (instance == nullptr) {
+        return {};
+    }
+    // Проверка класса объекта дешевле поиска метода по имени в цепочке базовых классов
+    const CallSite& site = call_sites_[op.b];
+    if (&instance->GetClass() == site.cls && site.body != nullptr && site.body->HasSlots()) {
+        return site.body->Call(ObjectHolder::Share(*instance), args, frame.context);
+    }
+    const runtime::Method* method = &instance->GetClass() == site.cls
+                                        ? site.method
+                                        : instance->GetClass().GetMethod(names_[site.name]);
+    if (method == nullptr || method->formal_params.size() != args.size()) {
+        return {};
+    }
+    return InvokeMethod(*instance, *method, args, frame.context);
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalInlinedCall(const Operands& op, Frame& frame) const {
+    // Объект встроенного вызова - переменная без полей. Неопределённая переменная обрабатывается
+    // исходным вызовом, который, как и без встраивания, сначала вычисляет аргументы
+    const NodeId receiver = operands_[op.a].a;
+    const ObjectHolder* object = nullptr;
+    if (kinds_[receiver] == NodeKind::LocalVariable) {
+        const Slot& slot = frame.slots[operands_[receiver].b];
+        object = slot.defined ? &slot.value : nullptr;
+    } else {
+        const auto it = frame.closure->find(names_[List(operands_[receiver].a)[0]]);
+        object = it != frame.closure->end() ? &it->second : nullptr;
+    }
+    const auto* instance = object != nullptr ? object->TryAs<runtime::ClassInstance>() : nullptr;
+    if (instance != nullptr && &instance->GetClass() == constants_[op.c].Get()) {
+        return Eval(op.b, frame);
+    }
+    return Eval(op.a, frame);
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalNewInstance(const Operands& op, Frame& frame) const {
+    const auto& cls = static_cast<const runtime::Class&>(*constants_[op.a]);  // NOLINT
+    ObjectHolder result = ObjectHolder::Own(runtime::ClassInstance(cls));
+    auto& instance = static_cast<runtime::ClassInstance&>(*result);  // NOLINT
+    const runtime::Method* init = cls.GetMethod(INIT_METHOD);
+    if (init != nullptr && init->formal_params.size() == List(op.b).size()) {
+        InvokeMethod(instance, *init, EvalList(op.b, frame), frame.context);
+    }
+    return result;
+}
+
+MYTHON_NOINLINE ObjectHolder Ast::EvalStringify(NodeId argument, Frame& frame) const {
+    ObjectHolder value = Eval(argument, frame);
+    if (!value) {
+        return ObjectHolder::Own(runtime::String("None"s));
+    }
+    ostringstream output;
+    value->Print(output, frame.context);
+    return ObjectHolder::Own(runtime::String(output.str()));
+}
+
+Statement::Statement(std::shared_ptr<const Ast> ast, NodeId node)
+    : ast_(std::move(ast))
+    , node_(node) {
+}
+
+ObjectHolder Statement::Execute(Closure& closure, Context& context) {
+    return ast_->Execute(node_, closure, context);
+}
+
+MethodBody::MethodBody(const Ast& ast, uint32_t method)
+    : ast_(&ast)
+    , method_(method) {
+}
+
+MethodBody::MethodBody(std::unique_ptr<MethodSource> source)
+    : source_(std::move(source)) {
+}
+
+void MethodBody::Parse() const {
+    auto [ast, method] = source_->Parse();
+    own_ast_ = std::move(ast);
+    method_ = method;
+    ast_ = own_ast_.get();
+    source_.reset();
+}
+
+ObjectHolder MethodBody::Execute(Closure& closure, Context& context) {
+    if (!HasSlots()) {
+        return ast_->ExecuteMethod(method_, closure, context);
+    }
+    const MethodInfo& info = ast_->Method(method_);
+    vector<ObjectHolder> args;
+    args.reserve(info.params.size());
+    for (uint32_t param : info.params) {
+        args.push_back(closure.at(ast_->Name(param)));
+    }
+    return Call(closure.at(SELF_NAME), args, context);
+}
+
+ObjectHolder MethodBody::Call(ObjectHolder self, const vector<ObjectHolder>& args,
+                              Context& context) const {
+    Load();
+    return ast_->CallMethod(method_, std::move(self), args, context);
+}
+
+}  // namespace flat
@@ -0,0 +1,345 @@
+#pragma once
+
+#include "runtime.h"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Синтаксическое дерево в плоском представлении. Узлы хранятся в непрерывных массивах
+// и ссылаются друг на друга 32-битными индексами, поэтому дерево большой программы занимает
+// несколько крупных блоков памяти вместо сотен тысяч мелких объектов
+namespace flat {
+
+using NodeId = uint32_t;
+// Индекс списка в общем массиве списков
+using ListId = uint32_t;
+
+// Отсутствующий узел, например ветка else условной инструкции без неё
+constexpr NodeId NO_NODE = std::numeric_limits<NodeId>::max();
+
+// Вид узла. В комментарии указано назначение операндов a, b и c
+enum class NodeKind : uint8_t {
+    // a - индекс константы: числа, строки или логического значения
+    Constant,
+    None,
+    // a - список индексов имён цепочки id1.id2.id3
+    Variable,
+    // a - индекс имени переменной, b - значение
+    Assignment,
+    // a - объект (узел Variable), b - индекс имени поля, c - значение
+    FieldAssignment,
+    // a - список аргументов
+    Print,
+    // a - объект, b - индекс имени метода, c - список аргументов
+    MethodCall,
+    // a - индекс константы с классом, b - список аргументов конструктора
+    NewInstance,
+    // a - аргумент
+    Stringify,
+    // a и b - аргументы бинарной операции, c - доказанный тип обоих аргументов (ValueType,
+    // см. SpecializeOperations в passes.h). Для ValueType::Unknown тип проверяется при выполнении
+    Add,
+    Sub,
+    Mult,
+    Div,
+    Or,
+    And,
+    // a - аргумент
+    Not,
+    // a и b - аргументы сравнения, c - доказанный тип обоих аргументов, как у Add
+    Less,
+    Greater,
+    Equal,
+    NotEqual,
+    LessOrEqual,
+    GreaterOrEqual,
+    // a - список инструкций
+    Compound,
+    // a - возвращаемое значение
+    Return,
+    // a - индекс константы с классом
+    ClassDefinition,
+    // a - условие, b - ветка if, c - ветка else либо NO_NODE
+    IfElse,
+    // Переменные метода, размещённые в ячейках его кадра (см. ResolveLocals в passes.h).
+    // a - список индексов имён цепочки, как у Variable, b - ячейка первого имени
+    LocalVariable,
+    // a - индекс имени переменной, b - значение, c - ячейка переменной
+    LocalAssignment,
+    // Вызов метода, привязанный к реализации анализом иерархии классов (см. DevirtualizeCalls
+    // в passes.h). a - объект, b - индекс привязки (см. CallSite), c - список аргументов
+    BoundMethodCall,
+    // Вызов метода, заменённый копией его тела (см. InlineCalls в passes.h). a - исходный вызов
+    // (MethodCall либо BoundMethodCall), b - копия тела, c - индекс константы с классом, для
+    // экземпляров которого выполняется копия
+    InlinedCall,
+    // Присваивание переменной в ячейке, значение которой читается только аргументами арифметики
+    // и сравнений (см. UnboxLocals в passes.h). Число записывается в ячейку без создания объекта.
+    // a - индекс имени переменной, b - значение, c - ячейка переменной
+    ScratchAssignment,
+    // Слитые инструкции частых видов (см. FuseStatements в passes.h).
+    // x.f = x.f + k: a - объект (переменная без полей), b - индекс имени поля, c - слагаемое k
+    FieldIncrement,
+    // x = x + k для переменной в ячейке: a - индекс имени переменной, b - слагаемое k,
+    // c - ячейка переменной
+    LocalIncrement,
+    // return x.f1...fn для переменной в ячейке: операнды как у LocalVariable
+    ReturnLocal,
+};
+
+// Тип значения узла, доказанный выводом типов (см. InferTypes в passes.h)
+enum class ValueType : uint8_t {
+    // Тип не доказан
+    Unknown,
+    Number,
+    String,
+    Bool,
+    None,
+    // Экземпляр класса
+    Instance,
+};
+
+struct Operands {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t c = 0;
+};
+
+// Элементы списка: индексы узлов либо имён
+class ListView {
+public:
+    ListView(const uint32_t* begin, const uint32_t* end)
+        : begin_(begin)
+        , end_(end) {
+    }
+
+    [[nodiscard]] const uint32_t* begin() const {
+        return begin_;
+    }
+    [[nodiscard]] const uint32_t* end() const {
+        return end_;
+    }
+    [[nodiscard]] size_t size() const {
+        return static_cast<size_t>(end_ - begin_);
+    }
+    [[nodiscard]] bool empty() const {
+        return begin_ == end_;
+    }
+    uint32_t operator[](size_t index) const {
+        return begin_[index];
+    }
+
+private:
+    const uint32_t* begin_;
+    const uint32_t* end_;
+};
+
+// Значение, которое операция not считает ложным: ноль, пустая строка или False.
+// None и экземпляры классов, как и в ast::Not, к ложным не относятся
+bool IsFalseValue(const runtime::ObjectHolder& object);
+
+// Метод класса в дереве программы
+struct MethodInfo {
+    // Тело метода
+    NodeId body = NO_NODE;
+    // Индексы имён формальных параметров
+    std::vector<uint32_t> params;
+    // Число ячеек кадра метода: self, параметры и локальные переменные.
+    // Ноль, если переменные метода хранятся в Closure
+    uint32_t slot_count = 0;
+};
+
+class MethodBody;
+
+// Привязка вызова метода. Если объект - экземпляр класса cls, вызывается method без поиска
+// по имени, иначе метод ищется по имени, как в узле MethodCall
+struct CallSite {
+    // Индекс имени метода
+    uint32_t name = 0;
+    const runtime::Class* cls = nullptr;
+    const runtime::Method* method = nullptr;
+    // Тело method, если оно представлено деревом, иначе nullptr
+    const MethodBody* body = nullptr;
+};
+
+// Дерево программы. Виды узлов, их операнды, списки дочерних узлов, имена и константы
+// хранятся в отдельных массивах. Узлы только добавляются, поэтому индексы остаются
+// действительными, пока существует дерево
+class Ast {
+public:
+    NodeId AddNode(NodeKind kind, Operands operands = {});
+    // Добавляет константу, значение которой возвращает узел NodeKind::Constant
+    uint32_t AddConstant(runtime::ObjectHolder value);
+    // Возвращает индекс имени. Одинаковые имена получают один индекс
+    uint32_t AddName(std::string_view name);
+    ListId AddList(const uint32_t* begin, const uint32_t* end);
+    // Добавляет метод с телом body и параметрами params, возвращает индекс метода
+    uint32_t AddMethod(NodeId body, std::vector<uint32_t> params);
+    // Заменяет узел node. Ссылки на node из других узлов начинают указывать на новый узел
+    void SetNode(NodeId node, NodeKind kind, Operands operands = {});
+    // Заменяет элементы списка list на [begin, end). Новый список не длиннее прежнего
+    void SetList(ListId list, const uint32_t* begin, const uint32_t* end);
+    // Задаёт число ячеек кадра метода, переменные которого размещены в ячейках
+    void SetSlotCount(uint32_t method, uint32_t slot_count);
+    // Добавляет привязку вызова, возвращает её индекс
+    uint32_t AddCallSite(CallSite site);
+
+    [[nodiscard]] size_t NodeCount() const {
+        return kinds_.size();
+    }
+    [[nodiscard]] NodeKind Kind(NodeId node) const {
+        return kinds_[node];
+    }
+    [[nodiscard]] const Operands& GetOperands(NodeId node) const {
+        return operands_[node];
+    }
+    [[nodiscard]] ListView List(ListId list) const {
+        const uint32_t* begin = lists_.data() + list + 1;
+        return {begin, begin + lists_[list]};
+    }
+    [[nodiscard]] const std::string& Name(uint32_t name) const {
+        return names_[name];
+    }
+    [[nodiscard]] const runtime::ObjectHolder& Constant(uint32_t constant) const {
+        return constants_[constant];
+    }
+    [[nodiscard]] size_t MethodCount() const {
+        return methods_.size();
+    }
+    [[nodiscard]] const MethodInfo& Method(uint32_t method) const {
+        return methods_[method];
+    }
+    [[nodiscard]] const CallSite& GetCallSite(uint32_t site) const {
+        return call_sites_[site];
+    }
+
+    // Выполняет инструкцию node. Инструкция return вне метода, как и в ast::Return,
+    // выбрасывает возвращаемое значение в виде исключения
+    runtime::ObjectHolder Execute(NodeId node, runtime::Closure& closure,
+                                  runtime::Context& context) const;
+    // Выполняет метод с переменными в closure и возвращает значение инструкции return либо None
+    runtime::ObjectHolder ExecuteMethod(uint32_t method, runtime::Closure& closure,
+                                        runtime::Context& context) const;
+    // Выполняет метод, переменные которого размещены в ячейках. args содержит значения
+    // параметров, self и args записываются в первые ячейки кадра
+    runtime::ObjectHolder CallMethod(uint32_t method, runtime::ObjectHolder self,
+                                     const std::vector<runtime::ObjectHolder>& args,
+                                     runtime::Context& context) const;
+
+private:
+    struct Frame;
+    struct Slot;
+    struct Temporary;
+
+    runtime::ObjectHolder Eval(NodeId node, Frame& frame) const;
+    runtime::ObjectHolder EvalVariable(ListId names, runtime::Closure& closure) const;
+    runtime::ObjectHolder EvalLocalVariable(const Operands& op, Frame& frame) const;
+    // Значение поля ids[1].ids[2]... объекта object
+    runtime::ObjectHolder LoadFields(runtime::ObjectHolder object, const ListView& ids) const;
+    std::vector<runtime::ObjectHolder> EvalList(ListId list, Frame& frame) const;
+    // Аргумент арифметики или сравнения, который не покидает вычисление операции
+    Temporary EvalTemporary(NodeId node, Frame& frame) const;
+    Temporary EvalArithmetic(NodeKind kind, const Operands& op, Frame& frame) const;
+    bool EvalComparison(NodeKind kind, const Operands& op, Frame& frame) const;
+    // Истинность значения узла node, как runtime::IsTrue
+    bool EvalCondition(NodeId node, Frame& frame) const;
+    runtime::ObjectHolder EvalFieldAssignment(const Operands& op, Frame& frame) const;
+    runtime::ObjectHolder EvalFieldIncrement(const Operands& op, Frame& frame) const;
+    void EvalLocalIncrement(const Operands& op, Frame& frame) const;
+    void EvalPrint(ListId args, Frame& frame) const;
+    runtime::ObjectHolder EvalMethodCall(const Operands& op, Frame& frame) const;
+    runtime::ObjectHolder EvalBoundMethodCall(const Operands& op, Frame& frame) const;
+    runtime::ObjectHolder EvalInlinedCall(const Operands& op, Frame& frame) const;
+    runtime::ObjectHolder EvalNewInstance(const Operands& op, Frame& frame) const;
+    runtime::ObjectHolder EvalStringify(NodeId argument, Frame& frame) const;
+
+    std::vector<NodeKind> kinds_;
+    std::vector<Operands> operands_;
+    // Списки хранятся подряд: длина списка, затем его элементы
+    std::vector<uint32_t> lists_;
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, uint32_t> name_index_;
+    std::vector<runtime::ObjectHolder> constants_;
+    std::vector<MethodInfo> methods_;
+    std::vector<CallSite> call_sites_;
+
+    // Запись дерева в образ и загрузка из образа (см. image.h)
+    friend class ImageWriter;
+    friend class ImageReader;
+};
+
+// Инструкция дерева, выполняемая через интерфейс Executable.
+// Инструкции одной программы совместно владеют её деревом
+class Statement : public runtime::Executable {
+public:
+    Statement(std::shared_ptr<const Ast> ast, NodeId node);
+
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+private:
+    std::shared_ptr<const Ast> ast_;
+    NodeId node_;
+};
+
+// Тело метода, которое разбирается при первом вызове (см. ParseProgramLazy в parse.h)
+class MethodSource {
+public:
+    virtual ~MethodSource() = default;
+    // Разбирает тело метода в отдельное дерево. Возвращает дерево и индекс метода в нём
+    virtual std::pair<std::shared_ptr<const Ast>, uint32_t> Parse() = 0;
+};
+
+// Тело метода. Классы принадлежат дереву через его константы, поэтому тело
+// не владеет деревом, а лишь ссылается на него. Отложенное тело владеет деревом,
+// в которое оно разобрано
+class MethodBody : public runtime::Executable {
+public:
+    MethodBody(const Ast& ast, uint32_t method);
+    explicit MethodBody(std::unique_ptr<MethodSource> source);
+
+    // Выполняет метод, получая self и параметры из closure, как при вызове через
+    // runtime::ClassInstance::Call
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Дерево, содержащее тело метода, либо nullptr, если отложенное тело ещё не разобрано
+    [[nodiscard]] const Ast* Tree() const {
+        return ast_;
+    }
+    // Индекс метода в дереве
+    [[nodiscard]] uint32_t MethodIndex() const {
+        return method_;
+    }
+
+    // Переменные метода размещены в ячейках, метод можно вызвать без построения Closure.
+    // Разбирает отложенное тело
+    [[nodiscard]] bool HasSlots() const {
+        Load();
+        return ast_->Method(method_).slot_count != 0;
+    }
+    // Вызывает метод, переменные которого размещены в ячейках
+    runtime::ObjectHolder Call(runtime::ObjectHolder self,
+                               const std::vector<runtime::ObjectHolder>& args,
+                               runtime::Context& context) const;
+
+private:
+    // Разбирает отложенное тело при первом обращении
+    void Load() const {
+        if (ast_ == nullptr) {
+            Parse();
+        }
+    }
+    void Parse() const;
+
+    mutable const Ast* ast_ = nullptr;
+    mutable uint32_t method_ = 0;
+    mutable std::shared_ptr<const Ast> own_ast_;
+    mutable std::unique_ptr<MethodSource> source_;
+};
+
+}  // namespace flat
@@ -0,0 +1,162 @@
+#include "flat_ast.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_runner_p.h"
+
+using namespace std;
+
+namespace flat {
+
+namespace {
+
+string Run(const string& program) {
+    parse::Lexer lexer(string_view{program});
+    auto tree = ParseProgram(lexer);
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    tree->Execute(closure, context);
+    return context.output.str();
+}
+
+void TestManualTree() {
+    // x = 2 + 3 * 4
+    // print x, 'done'
+    Ast ast;
+    const uint32_t x = ast.AddName("x"sv);
+    auto constant = [&ast](runtime::ObjectHolder value) {
+        return ast.AddNode(NodeKind::Constant, {ast.AddConstant(std::move(value))});
+    };
+    const NodeId two = constant(runtime::ObjectHolder::Own(runtime::Number(2)));
+    const NodeId three = constant(runtime::ObjectHolder::Own(runtime::Number(3)));
+    const NodeId four = constant(runtime::ObjectHolder::Own(runtime::Number(4)));
+    const NodeId mult = ast.AddNode(NodeKind::Mult, {three, four});
+    const NodeId add = ast.AddNode(NodeKind::Add, {two, mult});
+    const NodeId assignment = ast.AddNode(NodeKind::Assignment, {x, add});
+
+    const uint32_t x_path[] = {x};
+    const NodeId variable = ast.AddNode(NodeKind::Variable, {ast.AddList(begin(x_path), end(x_path))});
+    const NodeId done = constant(runtime::ObjectHolder::Own(runtime::String("done"s)));
+    const uint32_t args[] = {variable, done};
+    const NodeId print = ast.AddNode(NodeKind::Print, {ast.AddList(begin(args), end(args))});
+
+    const uint32_t statements[] = {assignment, print};
+    const NodeId root = ast.AddNode(NodeKind::Compound, {ast.AddList(begin(statements), end(statements))});
+
+    ASSERT_EQUAL(ast.NodeCount(), 10u);
+    ASSERT_EQUAL(ast.List(ast.GetOperands(root).a).size(), 2u);
+    ASSERT(ast.Kind(ast.List(ast.GetOperands(root).a)[1]) == NodeKind::Print);
+    ASSERT_EQUAL(ast.AddName("x"sv), x);
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    ast.Execute(root, closure, context);
+    ASSERT_EQUAL(context.output.str(), "14 done\n"s);
+    ASSERT_EQUAL(closure.at("x"s).TryAs<runtime::Number>()->GetValue(), 14);
+}
+
+void TestReturnFromNestedBlocks() {
+    const string program = R"(
+class Sign:
+  def of(x):
+    if x > 0:
+      if x > 100:
+        return 'big'
+      return 'positive'
+    else:
+      return 'negative'
+    print 'unreachable'
+
+s = Sign()
+print s.of(1000), s.of(5), s.of(-3)
+)"s;
+    ASSERT_EQUAL(Run(program), "big positive negative\n"s);
+}
+
+void TestEachInstanceIsNew() {
+    // Узел создания объекта возвращает новый экземпляр при каждом выполнении
+    const string program = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+class Factory:
+  def make():
+    return Counter()
+
+f = Factory()
+a = f.make()
+b = f.make()
+a.value = 5
+print a.value, b.value
+)"s;
+    ASSERT_EQUAL(Run(program), "5 0\n"s);
+}
+
+void TestFieldAssignmentEvaluatesValueOnce() {
+    const string program = R"(
+class Logger:
+  def next():
+    print 'called'
+    return 1
+
+class Holder:
+  def set(logger):
+    self.value = logger.next()
+
+h = Holder()
+h.set(Logger())
+print h.value
+)"s;
+    ASSERT_EQUAL(Run(program), "called\n1\n"s);
+}
+
+void TestRuntimeErrors() {
+    ASSERT_THROWS(Run("print x\n"s), std::runtime_error);
+    ASSERT_THROWS(Run("x = 1\nprint x.y\n"s), std::runtime_error);
+    ASSERT_THROWS(Run("x = 1 / 0\n"s), std::runtime_error);
+    ASSERT_THROWS(Run("x = 'a' - 1\n"s), std::runtime_error);
+}
+
+void TestTemporariesStayOffHeap() {
+    const string source = "a = 1\nb = 2\nc = 3\nx = (a + b) * c - a\nprint x, (a + b) * c < a\n"s;
+    parse::Lexer lexer(string_view{source});
+    Ast ast;
+    const NodeId root = ParseProgram(lexer, ast);
+    runtime::DummyContext context;
+    runtime::Closure closure;
+#ifndef NDEBUG
+    const size_t before = runtime::ObjectHolder::OwnCount();
+#endif
+    ast.Execute(root, closure, context);
+#ifndef NDEBUG
+    // Объекты создаются только для значения x и результата сравнения
+    ASSERT_EQUAL(runtime::ObjectHolder::OwnCount() - before, 2u);
+#endif
+    ASSERT_EQUAL(context.output.str(), "8 False\n"s);
+
+    for (const string& statement : {"x = (a + 'b') * c"s, "x = a * (b - c) / (a - a)"s,
+                                    "x = (a * b) + 'c'"s, "x = (a + b) < 'c'"s}) {
+        const string program = "a = 1\nb = 2\nc = 3\n"s + statement + "\n"s;
+        try {
+            Run(program);
+            ASSERT(false);
+        } catch (const runtime_error& error) {
+            const string message = error.what();
+            ASSERT(message.substr(0, "Not valid"s.size()) == "Not valid"s
+                   || message == "Cannot compare objects for less"s);
+        }
+    }
+}
+
+}  // namespace
+
+void RunFlatAstTests(TestRunner& tr) {
+    RUN_TEST(tr, flat::TestManualTree);
+    RUN_TEST(tr, flat::TestReturnFromNestedBlocks);
+    RUN_TEST(tr, flat::TestEachInstanceIsNew);
+    RUN_TEST(tr, flat::TestFieldAssignmentEvaluatesValueOnce);
+    RUN_TEST(tr, flat::TestRuntimeErrors);
+    RUN_TEST(tr, flat::TestTemporariesStayOffHeap);
+}
+
+}  // namespace flat
@@ -0,0 +1,256 @@
+#include "lexer.h"
+#include "parse.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Счётчики выделений памяти. Замеряются разностью значений до и после фазы
+namespace {
+
+atomic<size_t> allocated_bytes{0};
+atomic<size_t> allocation_count{0};
+
+void* Allocate(size_t size) {
+    allocated_bytes.fetch_add(size, memory_order_relaxed);
+    allocation_count.fetch_add(1, memory_order_relaxed);
+    if (void* ptr = malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw bad_alloc();
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+    return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+    return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t /*size*/) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t /*size*/) noexcept {
+    free(ptr);
+}
+
+namespace {
+
+// Синтетическая программа и число узлов AST, которые строит по ней ParseProgram
+struct Corpus {
+    string name;
+    string source;
+    size_t nodes = 1;  // составная инструкция верхнего уровня
+};
+
+string Indent(int level) {
+    return string(static_cast<size_t>(level) * 2, ' ');
+}
+
+// Вложенные условия глубиной depth: много лексем INDENT/DEDENT и длинные отступы
+Corpus GenerateDeepIndentation(size_t size) {
+    const int depth = 48;
+    Corpus corpus{"deep_indentation"s, {}};
+    for (int block = 0; corpus.source.size() < size; ++block) {
+        for (int level = 0; level < depth; ++level) {
+            corpus.source += Indent(level) + "if v"s + to_string(level) + " > "s
+                             + to_string(block) + ":\n"s;
+            // IfElse, Comparison, VariableValue, NumericConst, Compound
+            corpus.nodes += 5;
+        }
+        corpus.source += Indent(depth) + "x = v0 + 1\n"s;
+        corpus.source += Indent(depth) + "print x, v1\n"s;
+        // Assignment, Add, VariableValue, NumericConst; Print, VariableValue x 2
+        corpus.nodes += 7;
+        corpus.source += "else:\n"s + Indent(1) + "x = 0\n"s;
+        // Compound, Assignment, NumericConst
+        corpus.nodes += 3;
+    }
+    return corpus;
+}
+
+// Таблица строковых констант, каждая восьмая - с escape-последовательностями
+Corpus GenerateStringTable(size_t size) {
+    Corpus corpus{"string_table"s, {}};
+    for (int i = 0; corpus.source.size() < size; ++i) {
+        corpus.source += "s"s + to_string(i) + " = "s;
+        if (i % 8 == 7) {
+            corpus.source += "\"entry "s + to_string(i) + ":\\n\\tquoted \\'value\\' and \\\"text\\\"\"\n"s;
+        } else {
+            corpus.source += "'entry "s + to_string(i)
+                             + ": a long string constant from the generated string table'\n"s;
+        }
+        // Assignment, StringConst
+        corpus.nodes += 2;
+    }
+    return corpus;
+}
+
+// Множество небольших классов и создание их экземпляров
+Corpus GenerateSmallClasses(size_t size) {
+    Corpus corpus{"small_classes"s, {}};
+    for (int i = 0; corpus.source.size() < size; ++i) {
+        const string name = "Point"s + to_string(i);
+        corpus.source += "class "s + name + ":\n"s;
+        corpus.source += "  def __init__(x, y):\n"s;
+        corpus.source += "    self.x = x\n"s;
+        corpus.source += "    self.y = y\n"s;
+        corpus.source += "  def sum():\n"s;
+        corpus.source += "    return self.x + self.y\n"s;
+        corpus.source += "p"s + to_string(i) + " = "s + name + "(1, 2)\n"s;
+        // ClassDefinition
+        // __init__: MethodBody, Compound, FieldAssignment x 2, VariableValue x 2
+        // sum: MethodBody, Compound, Return, Add, VariableValue x 2
+        // Assignment, NewInstance, NumericConst x 2
+        corpus.nodes += 1 + 6 + 6 + 4;
+    }
+    return corpus;
+}
+
+// Длинные арифметические выражения из terms операндов
+Corpus GenerateLongExpressions(size_t size) {
+    const int terms = 200;
+    const char operations[] = {'+', '-', '*', '/'};
+    Corpus corpus{"long_expressions"s, {}};
+    for (int i = 0; corpus.source.size() < size; ++i) {
+        corpus.source += "e"s + to_string(i) + " = "s;
+        for (int term = 0; term < terms; ++term) {
+            if (term > 0) {
+                corpus.source += ' ';
+                corpus.source += operations[term % 4];
+                corpus.source += ' ';
+            }
+            if (term % 3 == 0) {
+                corpus.source += to_string(term + 1);
+            } else {
+                corpus.source += "a"s + to_string(term % 10);
+            }
+        }
+        corpus.source += '\n';
+        // Assignment, операнды и бинарные операции
+        corpus.nodes += 1 + terms + (terms - 1);
+    }
+    return corpus;
+}
+
+// Результаты замера одной фазы в расчёте на один прогон
+struct Phase {
+    double seconds = 0;
+    size_t bytes = 0;
+    size_t allocations = 0;
+};
+
+class PhaseMeter {
+public:
+    PhaseMeter()
+        : bytes_(allocated_bytes.load())
+        , allocations_(allocation_count.load())
+        , start_(chrono::steady_clock::now()) {
+    }
+
+    void AddTo(Phase& phase) const {
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start_;
+        phase.seconds += elapsed.count();
+        phase.bytes += allocated_bytes.load() - bytes_;
+        phase.allocations += allocation_count.load() - allocations_;
+    }
+
+private:
+    size_t bytes_;
+    size_t allocations_;
+    chrono::steady_clock::time_point start_;
+};
+
+size_t CountTokens(parse::Lexer& lexer) {
+    size_t count = 1;
+    while (!lexer.CurrentToken().Is<parse::token_type::Eof>()) {
+        lexer.NextToken();
+        ++count;
+    }
+    return count;
+}
+
+void PrintPhase(ostream& out, const Phase& phase, int repeat, const char* unit, size_t units) {
+    const double seconds = phase.seconds / repeat;
+    out << "{\"seconds\": "s << seconds << ", \""s << unit << "_per_sec\": "s
+        << static_cast<size_t>(seconds > 0 ? static_cast<double>(units) / seconds : 0)
+        << ", \"bytes_allocated\": "s << phase.bytes / repeat << ", \"allocations\": "s
+        << phase.allocations / repeat << '}';
+}
+
+// Лексический анализ замеряется вместе с созданием лексера в режиме Eager,
+// синтаксический - на уже разобранных лексемах, без разрушения дерева
+void RunCorpus(ostream& out, const Corpus& corpus, int repeat) {
+    const auto source = make_shared<const string>(corpus.source);
+    size_t tokens = 0;
+    Phase lex;
+    Phase parse;
+    for (int i = 0; i < repeat; ++i) {
+        {
+            PhaseMeter meter;
+            parse::Lexer lexer(string_view{*source}, source);
+            tokens = CountTokens(lexer);
+            meter.AddTo(lex);
+        }
+
+        parse::Lexer lexer(string_view{*source}, source);
+        PhaseMeter meter;
+        auto program = ParseProgram(lexer);
+        meter.AddTo(parse);
+    }
+
+    out << "    {\"corpus\": \""s << corpus.name << "\", \"source_bytes\": "s << source->size()
+        << ", \"tokens\": "s << tokens << ", \"nodes\": "s << corpus.nodes << ",\n"s;
+    out << "     \"lexer\": "s;
+    PrintPhase(out, lex, repeat, "tokens", tokens);
+    out << ",\n     \"parser\": "s;
+    PrintPhase(out, parse, repeat, "nodes", corpus.nodes);
+    out << '}';
+}
+
+}  // namespace
+
+// Использование: mython_frontend_bench [размер каждого корпуса в байтах] [количество повторов]
+// Результат выводится в формате JSON
+int main(int argc, char* argv[]) {
+    const size_t size = argc > 1 ? stoul(argv[1]) : (4u << 20);
+    const int repeat = argc > 2 ? stoi(argv[2]) : 3;
+
+    const vector<Corpus> corpora = {
+        GenerateDeepIndentation(size),
+        GenerateStringTable(size),
+        GenerateSmallClasses(size),
+        GenerateLongExpressions(size),
+    };
+
+    cout << "{\n  \"repeat\": "s << repeat << ",\n  \"results\": [\n"s;
+    bool first = true;
+    for (const Corpus& corpus : corpora) {
+        if (!first) {
+            cout << ",\n"s;
+        }
+        first = false;
+        RunCorpus(cout, corpus, repeat);
+    }
+    cout << "\n  ]\n}"s << endl;
+    return 0;
+}
@@ -0,0 +1,625 @@
+#include "image.h"
+
+#include "passes.h"
+
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace flat {
+
+using runtime::ObjectHolder;
+
+namespace {
+
+constexpr string_view MAGIC = "MYTHONC\0"sv;
+// Записывается в заголовок как число и позволяет обнаружить образ с другим порядком байтов
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr uint32_t NO_CLASS = numeric_limits<uint32_t>::max();
+
+// Заголовок образа. За ним следуют разделы:
+// виды узлов (выровнены до 4 байт), операнды узлов, списки, имена (смещение и длина в пуле
+// строк), методы, классы, константы и пул строк
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t node_count;
+    uint32_t list_size;
+    uint32_t name_count;
+    uint32_t method_count;
+    uint32_t class_count;
+    uint32_t constant_count;
+    uint32_t pool_size;
+    uint32_t root;
+};
+
+enum class ConstantTag : uint32_t {
+    Number,
+    String,
+    Bool,
+    Class,
+};
+
+// Константа: вид и два операнда. Число и логическое значение хранятся в a, строка -
+// смещением a и длиной b в пуле строк, класс - индексом a в таблице классов
+struct ConstantRecord {
+    ConstantTag tag;
+    uint32_t a;
+    uint32_t b;
+};
+
+static_assert(is_trivially_copyable_v<Operands> && sizeof(Operands) == 3 * sizeof(uint32_t));
+static_assert(sizeof(NodeKind) == 1);
+
+size_t Padding(size_t size) {
+    return (4 - size % 4) % 4;
+}
+
+}  // namespace
+
+class ImageWriter {
+public:
+    ImageWriter(const Ast& ast, ostream& output)
+        : ast_(ast)
+        , output_(output) {
+    }
+
+    void Write(NodeId root) {
+        vector<ConstantRecord> constants;
+        constants.reserve(ast_.constants_.size());
+        for (const ObjectHolder& constant : ast_.constants_) {
+            constants.push_back(MakeConstant(constant));
+        }
+
+        Header header{};
+        MAGIC.copy(header.magic, sizeof(header.magic));
+        header.version = IMAGE_VERSION;
+        header.byte_order = BYTE_ORDER_MARK;
+        header.node_count = Count(ast_.kinds_.size());
+        header.list_size = Count(ast_.lists_.size());
+        header.name_count = Count(ast_.names_.size());
+        header.method_count = Count(ast_.methods_.size());
+        header.class_count = Count(classes_.size());
+        header.constant_count = Count(constants.size());
+        header.root = root;
+
+        // Пул строк заполняется по ходу записи разделов, поэтому разделы собираются в буфере
+        ostringstream body;
+        PutArray(body, ast_.kinds_.data(), ast_.kinds_.size());
+        body.write("\0\0\0", static_cast<streamsize>(Padding(ast_.kinds_.size())));
+        // Привязка вызова ссылается на объекты времени выполнения, поэтому вместо неё
+        // записывается имя метода. Привязки восстанавливаются при загрузке образа
+        vector<Operands> operands = ast_.operands_;
+        for (size_t node = 0; node < operands.size(); ++node) {
+            if (ast_.kinds_[node] == NodeKind::BoundMethodCall) {
+                operands[node].b = ast_.call_sites_[operands[node].b].name;
+            }
+        }
+        PutArray(body, operands.data(), operands.size());
+        PutArray(body, ast_.lists_.data(), ast_.lists_.size());
+        for (const string& name : ast_.names_) {
+            PutString(body, name);
+        }
+        for (const MethodInfo& method : ast_.methods_) {
+            Put(body, method.body);
+            Put(body, method.slot_count);
+            Put(body, Count(method.params.size()));
+            PutArray(body, method.params.data(), method.params.size());
+        }
+        for (const runtime::Class* cls : classes_) {
+            PutString(body, cls->GetName());
+            Put(body, cls->GetParent() != nullptr ? class_index_.at(cls->GetParent()) : NO_CLASS);
+            Put(body, Count(cls->GetMethods().size()));
+            for (const runtime::Method& method : cls->GetMethods()) {
+                const auto* method_body = dynamic_cast<const MethodBody*>(method.body.get());
+                if (method_body == nullptr || method_body->Tree() != &ast_) {
+                    throw logic_error("Method "s + method.name + " is not a part of the tree"s);
+                }
+                Put(body, method_body->MethodIndex());
+                PutString(body, method.name);
+            }
+        }
+        PutArray(body, constants.data(), constants.size());
+        header.pool_size = Count(pool_.size());
+
+        Put(output_, header);
+        output_ << body.str() << pool_;
+    }
+
+private:
+    template <typename T>
+    static void Put(ostream& output, const T& value) {
+        output.write(reinterpret_cast<const char*>(&value), sizeof(T));  // NOLINT
+    }
+
+    template <typename T>
+    static void PutArray(ostream& output, const T* data, size_t count) {
+        output.write(reinterpret_cast<const char*>(data),  // NOLINT
+                     static_cast<streamsize>(count * sizeof(T)));
+    }
+
+    static uint32_t Count(size_t size) {
+        if (size > numeric_limits<uint32_t>::max()) {
+            throw ImageError("Program is too large for an image"s);
+        }
+        return static_cast<uint32_t>(size);
+    }
+
+    // Записывает смещение и длину строки в пуле строк
+    void PutString(ostream& output, string_view text) {
+        Put(output, Count(pool_.size()));
+        Put(output, Count(text.size()));
+        pool_.append(text);
+    }
+
+    // Индекс класса в таблице классов. Базовый класс получает индекс раньше производного
+    uint32_t ClassIndex(const runtime::Class& cls) {
+        if (auto it = class_index_.find(&cls); it != class_index_.end()) {
+            return it->second;
+        }
+        if (cls.GetParent() != nullptr) {
+            ClassIndex(*cls.GetParent());
+        }
+        const uint32_t index = Count(classes_.size());
+        classes_.push_back(&cls);
+        class_index_[&cls] = index;
+        return index;
+    }
+
+    ConstantRecord MakeConstant(const ObjectHolder& constant) {
+        if (const auto* number = constant.TryAs<runtime::Number>()) {
+            uint32_t bits = 0;
+            const int value = number->GetValue();
+            memcpy(&bits, &value, sizeof(bits));
+            return {ConstantTag::Number, bits, 0};
+        }
+        if (const auto* str = constant.TryAs<runtime::String>()) {
+            const uint32_t offset = Count(pool_.size());
+            pool_.append(str->GetValue());
+            return {ConstantTag::String, offset, Count(str->GetValue().size())};
+        }
+        if (const auto* value = constant.TryAs<runtime::Bool>()) {
+            return {ConstantTag::Bool, value->GetValue() ? 1U : 0U, 0};
+        }
+        if (const auto* cls = constant.TryAs<runtime::Class>()) {
+            return {ConstantTag::Class, ClassIndex(*cls), 0};
+        }
+        throw logic_error("Unsupported constant in the tree"s);
+    }
+
+    const Ast& ast_;
+    ostream& output_;
+    string pool_;
+    vector<const runtime::Class*> classes_;
+    unordered_map<const runtime::Class*, uint32_t> class_index_;
+};
+
+class ImageReader {
+public:
+    ImageReader(shared_ptr<const void> storage, string_view image)
+        : storage_(std::move(storage))
+        , image_(image) {
+    }
+
+    unique_ptr<runtime::Executable> Read() {
+        if (!IsImage(image_)) {
+            throw ImageError("Not a compiled Mython program"s);
+        }
+        const auto header = Get<Header>();
+        if (header.byte_order != BYTE_ORDER_MARK) {
+            throw ImageError("Compiled Mython program has a different byte order"s);
+        }
+        if (header.version != IMAGE_VERSION) {
+            throw ImageError("Compiled Mython program has unsupported version "s
+                             + to_string(header.version));
+        }
+        if (header.pool_size > image_.size()) {
+            throw ImageError("Truncated Mython image"s);
+        }
+        pool_ = image_.substr(image_.size() - header.pool_size);
+        image_.remove_suffix(header.pool_size);
+
+        auto ast = make_shared<Ast>();
+        GetArray(ast->kinds_, header.node_count);
+        Skip(Padding(header.node_count));
+        for (NodeKind kind : ast->kinds_) {
+            if (kind > NodeKind::ReturnLocal) {
+                throw ImageError("Unknown node kind in Mython image"s);
+            }
+        }
+        GetArray(ast->operands_, header.node_count);
+        GetArray(ast->lists_, header.list_size);
+        for (uint32_t i = 0; i < header.name_count; ++i) {
+            ast->AddName(GetString());
+        }
+        CheckCount(header.method_count, 3 * sizeof(uint32_t));
+        ast->methods_.resize(header.method_count);
+        for (MethodInfo& method : ast->methods_) {
+            method.body = Get<uint32_t>();
+            method.slot_count = Get<uint32_t>();
+            GetArray(method.params, Get<uint32_t>());
+            // Каждая ячейка кадра появляется из узла дерева, а первые ячейки занимают self
+            // и параметры
+            if (method.body >= header.node_count || method.slot_count > header.node_count
+                || (method.slot_count != 0 && method.slot_count <= method.params.size())) {
+                throw ImageError("Corrupted Mython image"s);
+            }
+            for (uint32_t param : method.params) {
+                if (param >= ast->names_.size()) {
+                    throw ImageError("Corrupted Mython image"s);
+                }
+            }
+        }
+        CheckCount(header.class_count, 4 * sizeof(uint32_t));
+        vector<ObjectHolder> classes;
+        classes.reserve(header.class_count);
+        for (uint32_t i = 0; i < header.class_count; ++i) {
+            classes.push_back(GetClass(*ast, classes));
+        }
+        CheckCount(header.constant_count, sizeof(ConstantRecord));
+        ast->constants_.reserve(header.constant_count + classes.size());
+        for (uint32_t i = 0; i < header.constant_count; ++i) {
+            ast->constants_.push_back(MakeConstant(Get<ConstantRecord>(), classes));
+        }
+        // Дерево владеет всеми классами, включая базовые классы, на которые не ссылаются узлы
+        ast->constants_.insert(ast->constants_.end(), classes.begin(), classes.end());
+        if (!image_.empty() || header.root >= header.node_count) {
+            throw ImageError("Corrupted Mython image"s);
+        }
+        Validate(*ast, header.root);
+        BindCalls(*ast);
+        return make_unique<Statement>(std::move(ast), header.root);
+    }
+
+private:
+    // Восстанавливает привязки вызовов, записанные в образ как имена методов. Классы образа
+    // и их методы совпадают с классами программы, поэтому повторный анализ иерархии привязывает
+    // те же вызовы. Встроенный вызов проверяет класс объекта по константе, а не по привязке
+    static void BindCalls(Ast& ast) {
+        bool has_bound_calls = false;
+        for (NodeId node = 0; node < ast.NodeCount(); ++node) {
+            if (ast.Kind(node) == NodeKind::BoundMethodCall) {
+                ast.kinds_[node] = NodeKind::MethodCall;
+                has_bound_calls = true;
+            }
+        }
+        if (has_bound_calls) {
+            DevirtualizeCalls(ast);
+        }
+    }
+
+    // Проверяет, что операнды узлов ссылаются на существующие узлы, имена, константы, списки
+    // и ячейки, узлы, которые используют константу с классом, ссылаются на класс, а дерево
+    // не содержит циклов.
+    // Кадры проверяются обходом тел методов: узел с ячейкой вне кадра метода либо в теле
+    // программы, у которого ячеек нет, и узел, обращающийся к Closure в методе с ячейками,
+    // означают повреждённый образ
+    static void Validate(const Ast& ast, NodeId root) {
+        const auto node_count = static_cast<uint32_t>(ast.NodeCount());
+        // Дочерние узлы узла node - children[child_begin[node]...child_begin[node + 1])
+        vector<uint32_t> child_begin;
+        vector<NodeId> children;
+        child_begin.reserve(node_count + 1);
+        for (NodeId node = 0; node < node_count; ++node) {
+            child_begin.push_back(static_cast<uint32_t>(children.size()));
+            ValidateNode(ast, node, children);
+        }
+        child_begin.push_back(static_cast<uint32_t>(children.size()));
+
+        // Узел, который входит в своё поддерево, зациклил бы выполнение. Обход в глубину
+        // отмечает узлы на пути от корня обхода и узлы с обойдёнными поддеревьями
+        enum class Mark : uint8_t { New, OnPath, Done };
+        vector<Mark> marks(node_count, Mark::New);
+        vector<pair<NodeId, uint32_t>> path;
+        for (NodeId start = 0; start < node_count; ++start) {
+            if (marks[start] != Mark::New) {
+                continue;
+            }
+            marks[start] = Mark::OnPath;
+            path.emplace_back(start, child_begin[start]);
+            while (!path.empty()) {
+                auto& [node, next] = path.back();
+                if (next == child_begin[node + 1]) {
+                    marks[node] = Mark::Done;
+                    path.pop_back();
+                    continue;
+                }
+                const NodeId child = children[next++];
+                if (marks[child] == Mark::OnPath) {
+                    throw ImageError("Corrupted Mython image"s);
+                }
+                if (marks[child] == Mark::New) {
+                    marks[child] = Mark::OnPath;
+                    path.emplace_back(child, child_begin[child]);
+                }
+            }
+        }
+
+        vector<uint32_t> visited(node_count, NO_NODE);
+        vector<NodeId> stack;
+        const auto check_frame = [&](NodeId body, uint32_t slot_count, uint32_t walk) {
+            stack.assign(1, body);
+            while (!stack.empty()) {
+                const NodeId node = stack.back();
+                stack.pop_back();
+                if (visited[node] == walk) {
+                    continue;
+                }
+                visited[node] = walk;
+                if (const optional<uint32_t> slot = SlotOf(ast, node); slot && *slot >= slot_count) {
+                    throw ImageError("Corrupted Mython image"s);
+                }
+                // Кадр метода с ячейками не содержит Closure
+                if (slot_count != 0 && UsesClosure(ast.Kind(node))) {
+                    throw ImageError("Corrupted Mython image"s);
+                }
+                stack.insert(stack.end(), children.begin() + child_begin[node],
+                             children.begin() + child_begin[node + 1]);
+            }
+        };
+        for (uint32_t method = 0; method < ast.methods_.size(); ++method) {
+            check_frame(ast.methods_[method].body, ast.methods_[method].slot_count, method);
+        }
+        check_frame(root, 0, static_cast<uint32_t>(ast.methods_.size()));
+    }
+
+    // Проверяет операнды узла node и добавляет в children его дочерние узлы
+    static void ValidateNode(const Ast& ast, NodeId node, vector<NodeId>& children) {
+        const Operands& op = ast.GetOperands(node);
+        const auto check = [](bool valid) {
+            if (!valid) {
+                throw ImageError("Corrupted Mython image"s);
+            }
+        };
+        const auto child = [&](NodeId child) {
+            check(child < ast.NodeCount());
+            children.push_back(child);
+        };
+        const auto name = [&](uint32_t name) {
+            check(name < ast.names_.size());
+        };
+        const auto list = [&](ListId list) {
+            check(list < ast.lists_.size() && ast.lists_[list] < ast.lists_.size() - list);
+            return ast.List(list);
+        };
+        const auto child_list = [&](ListId items) {
+            for (NodeId item : list(items)) {
+                child(item);
+            }
+        };
+        // Непустая цепочка имён переменной
+        const auto names = [&](ListId items) {
+            const ListView ids = list(items);
+            check(ids.size() > 0);
+            for (uint32_t id : ids) {
+                name(id);
+            }
+        };
+        const auto constant = [&](uint32_t constant) {
+            check(constant < ast.constants_.size());
+        };
+        const auto class_constant = [&](uint32_t index) {
+            constant(index);
+            check(ast.constants_[index].TryAs<runtime::Class>() != nullptr);
+        };
+        switch (ast.Kind(node)) {
+        case NodeKind::Constant:
+            constant(op.a);
+            break;
+        case NodeKind::None:
+            break;
+        case NodeKind::Variable:
+        case NodeKind::LocalVariable:
+        case NodeKind::ReturnLocal:
+            names(op.a);
+            break;
+        case NodeKind::Assignment:
+        case NodeKind::LocalAssignment:
+        case NodeKind::ScratchAssignment:
+        case NodeKind::LocalIncrement:
+            name(op.a);
+            child(op.b);
+            break;
+        case NodeKind::FieldAssignment:
+        case NodeKind::FieldIncrement:
+            child(op.a);
+            name(op.b);
+            child(op.c);
+            break;
+        case NodeKind::Print:
+        case NodeKind::Compound:
+            child_list(op.a);
+            break;
+        case NodeKind::MethodCall:
+        case NodeKind::BoundMethodCall:
+            // Привязка вызова записана в образ как индекс имени метода
+            child(op.a);
+            name(op.b);
+            child_list(op.c);
+            break;
+        case NodeKind::NewInstance:
+            class_constant(op.a);
+            child_list(op.b);
+            break;
+        case NodeKind::Stringify:
+        case NodeKind::Not:
+        case NodeKind::Return:
+            child(op.a);
+            break;
+        case NodeKind::ClassDefinition:
+            class_constant(op.a);
+            break;
+        case NodeKind::IfElse:
+            child(op.a);
+            child(op.b);
+            if (op.c != NO_NODE) {
+                child(op.c);
+            }
+            break;
+        case NodeKind::InlinedCall: {
+            // Встроенный вызов читает объект исходного вызова как переменную
+            child(op.a);
+            child(op.b);
+            class_constant(op.c);
+            const NodeKind call = ast.Kind(op.a);
+            check(call == NodeKind::MethodCall || call == NodeKind::BoundMethodCall);
+            const NodeId receiver = ast.GetOperands(op.a).a;
+            check(receiver < ast.NodeCount()
+                  && (ast.Kind(receiver) == NodeKind::Variable
+                      || ast.Kind(receiver) == NodeKind::LocalVariable));
+            break;
+        }
+        default:
+            // Бинарные операции и сравнения. Операнд c с неизвестным типом означает
+            // проверку типов при выполнении
+            child(op.a);
+            child(op.b);
+            break;
+        }
+    }
+
+    // Ячейка кадра, к которой обращается узел node
+    static optional<uint32_t> SlotOf(const Ast& ast, NodeId node) {
+        const Operands& op = ast.GetOperands(node);
+        switch (ast.Kind(node)) {
+        case NodeKind::LocalVariable:
+        case NodeKind::ReturnLocal:
+            return op.b;
+        case NodeKind::LocalAssignment:
+        case NodeKind::ScratchAssignment:
+        case NodeKind::LocalIncrement:
+            return op.c;
+        default:
+            return nullopt;
+        }
+    }
+
+    static bool UsesClosure(NodeKind kind) {
+        return kind == NodeKind::Variable || kind == NodeKind::Assignment
+               || kind == NodeKind::ClassDefinition;
+    }
+
+    void Skip(size_t size) {
+        if (size > image_.size()) {
+            throw ImageError("Truncated Mython image"s);
+        }
+        image_.remove_prefix(size);
+    }
+
+    // Проверяет, что в образе хватает места для count записей размером не меньше record_size,
+    // прежде чем выделять под них память
+    void CheckCount(size_t count, size_t record_size) const {
+        if (count > image_.size() / record_size) {
+            throw ImageError("Truncated Mython image"s);
+        }
+    }
+
+    template <typename T>
+    T Get() {
+        T value;
+        const char* data = image_.data();
+        Skip(sizeof(T));
+        memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void GetArray(vector<T>& values, size_t count) {
+        const char* data = image_.data();
+        CheckCount(count, sizeof(T));
+        Skip(count * sizeof(T));
+        values.resize(count);
+        if (count > 0) {
+            memcpy(values.data(), data, count * sizeof(T));
+        }
+    }
+
+    string_view PoolString(uint32_t offset, uint32_t size) const {
+        if (offset > pool_.size() || size > pool_.size() - offset) {
+            throw ImageError("Corrupted Mython image"s);
+        }
+        return pool_.substr(offset, size);
+    }
+
+    string_view GetString() {
+        const auto offset = Get<uint32_t>();
+        return PoolString(offset, Get<uint32_t>());
+    }
+
+    ObjectHolder GetClass(const Ast& ast, const vector<ObjectHolder>& classes) {
+        string name(GetString());
+        if (name.empty()) {
+            throw ImageError("Corrupted Mython image"s);
+        }
+        const auto parent_index = Get<uint32_t>();
+        const runtime::Class* parent = nullptr;
+        if (parent_index != NO_CLASS) {
+            if (parent_index >= classes.size()) {
+                throw ImageError("Corrupted Mython image"s);
+            }
+            parent = static_cast<const runtime::Class*>(classes[parent_index].Get());  // NOLINT
+        }
+        const auto method_count = Get<uint32_t>();
+        CheckCount(method_count, 3 * sizeof(uint32_t));
+        vector<runtime::Method> methods(method_count);
+        for (runtime::Method& method : methods) {
+            const auto index = Get<uint32_t>();
+            if (index >= ast.methods_.size()) {
+                throw ImageError("Corrupted Mython image"s);
+            }
+            method.name = GetString();
+            for (uint32_t param : ast.methods_[index].params) {
+                method.formal_params.push_back(ast.Name(param));
+            }
+            method.body = make_unique<MethodBody>(ast, index);
+        }
+        return ObjectHolder::Own(runtime::Class(std::move(name), std::move(methods), parent));
+    }
+
+    ObjectHolder MakeConstant(const ConstantRecord& record,
+                              const vector<ObjectHolder>& classes) const {
+        switch (record.tag) {
+        case ConstantTag::Number: {
+            int value = 0;
+            memcpy(&value, &record.a, sizeof(value));
+            return ObjectHolder::Own(runtime::Number(value));
+        }
+        case ConstantTag::String:
+            return ObjectHolder::Own(runtime::String(storage_, PoolString(record.a, record.b)));
+        case ConstantTag::Bool:
+            return ObjectHolder::Own(runtime::Bool(record.a != 0));
+        case ConstantTag::Class:
+            if (record.a < classes.size()) {
+                return classes[record.a];
+            }
+            break;
+        }
+        throw ImageError("Corrupted Mython image"s);
+    }
+
+    shared_ptr<const void> storage_;
+    // Ещё не прочитанная часть образа без пула строк
+    string_view image_;
+    string_view pool_;
+};
+
+void WriteImage(const Ast& ast, NodeId root, ostream& output) {
+    ImageWriter(ast, output).Write(root);
+}
+
+bool IsImage(string_view data) {
+    return data.substr(0, MAGIC.size()) == MAGIC;
+}
+
+unique_ptr<runtime::Executable> ReadImage(shared_ptr<const void> storage, string_view image) {
+    return ImageReader(std::move(storage), image).Read();
+}
+
+}  // namespace flat
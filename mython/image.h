@@ -0,0 +1,39 @@
+#pragma once
+
+#include "flat_ast.h"
+#include "runtime.h"
+
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Образ разобранной программы: плоское дерево, его имена, константы, методы и классы
+// в двоичном виде. Загрузка образа не требует лексического и синтаксического анализа:
+// массивы узлов и списков копируются целиком, а строковые константы ссылаются на образ.
+// Образ записывается в порядке байтов текущей платформы и читается только программой
+// той же версии формата
+namespace flat {
+
+class ImageError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Версия формата образа. Увеличивается при любом изменении формата или видов узлов
+constexpr uint32_t IMAGE_VERSION = 5;
+
+// Записывает в output образ дерева ast с корневой инструкцией root
+void WriteImage(const Ast& ast, NodeId root, std::ostream& output);
+
+// Проверяет, начинается ли data с сигнатуры образа
+bool IsImage(std::string_view data);
+
+// Загружает программу из образа image. storage владеет памятью образа: строковые константы
+// программы ссылаются на неё и удерживают её. Выбрасывает ImageError, если образ повреждён
+// или записан другой версией формата
+std::unique_ptr<runtime::Executable> ReadImage(std::shared_ptr<const void> storage,
+                                               std::string_view image);
+
+}  // namespace flat
@@ -0,0 +1,203 @@
+#include "image.h"
+#include "lexer.h"
+#include "parse.h"
+#include "passes.h"
+#include "test_runner_p.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace flat {
+
+namespace {
+
+const string PROGRAM = R"(
+class Shape:
+  def __init__(name):
+    self.name = name
+  def area():
+    return 0
+  def __str__():
+    return self.name + ' ' + str(self.area())
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.name = 'rect'
+    self.w = w
+    self.h = h
+  def area():
+    return self.w * self.h
+
+class Square(Rect):
+  def __init__(side):
+    self.name = 'square'
+    self.w = side
+    self.h = side
+
+shapes = Shape('dot')
+r = Rect(2, 3)
+s = Square(4)
+if r.area() < s.area():
+  print shapes, r, s, 'строка', -7, True, None
+print 2 * 3 + 1, s.w
+)"s;
+
+// Разбирает программу, выполняет оптимизирующие проходы и возвращает её образ
+string Compile(const string& source) {
+    parse::Lexer lexer(string_view{source});
+    Ast ast;
+    const NodeId root = ParseProgram(lexer, ast);
+    RunPasses(ast);
+    ostringstream image;
+    WriteImage(ast, root, image);
+    return image.str();
+}
+
+string Run(runtime::Executable& program) {
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    program.Execute(closure, context);
+    return context.output.str();
+}
+
+string Run(const string& source) {
+    parse::Lexer lexer(string_view{source});
+    return Run(*ParseProgram(lexer));
+}
+
+void TestImageRoundTrip() {
+    auto image = make_shared<const string>(Compile(PROGRAM));
+    ASSERT(IsImage(*image));
+    ASSERT(!IsImage(PROGRAM));
+
+    auto program = ReadImage(image, *image);
+    ASSERT_EQUAL(Run(*program), Run(PROGRAM));
+    // Строковые константы удерживают образ после удаления остальных ссылок на него
+    const weak_ptr<const string> weak_image = image;
+    image.reset();
+    ASSERT(!weak_image.expired());
+    ASSERT_EQUAL(Run(*program), "dot 0 rect 6 square 16 строка -7 True None\n7 4\n"s);
+    program.reset();
+    ASSERT(weak_image.expired());
+}
+
+void TestImageOfEmptyProgram() {
+    const string image = Compile(""s);
+    ASSERT_EQUAL(Run(*ReadImage(nullptr, image)), ""s);
+}
+
+void TestImageIsDeterministic() {
+    ASSERT_EQUAL(Compile(PROGRAM), Compile(PROGRAM));
+}
+
+void TestRejectsBadImages() {
+    const string image = Compile(PROGRAM);
+
+    // Обрезанный образ
+    for (size_t size : {size_t{3}, size_t{20}, image.size() / 2, image.size() - 1}) {
+        ASSERT_THROWS(ReadImage(nullptr, string_view(image).substr(0, size)), ImageError);
+    }
+    // Лишние данные в конце образа
+    ASSERT_THROWS(ReadImage(nullptr, image + "\0\0\0\0"s), ImageError);
+    // Другая версия формата записана сразу после сигнатуры
+    string other_version = image;
+    other_version[8] = static_cast<char>(IMAGE_VERSION + 1);
+    ASSERT_THROWS(ReadImage(nullptr, other_version), ImageError);
+    // Исходный текст не является образом
+    ASSERT_THROWS(ReadImage(nullptr, PROGRAM), ImageError);
+}
+
+// Заголовок образа: сигнатура и десять чисел, из них число узлов - третье, размер списков - четвёртое
+constexpr size_t HEADER_SIZE = 48;
+constexpr size_t NODE_COUNT_OFFSET = 16;
+constexpr size_t LIST_SIZE_OFFSET = 20;
+
+uint32_t GetNumber(const string& image, size_t offset) {
+    uint32_t value = 0;
+    memcpy(&value, image.data() + offset, sizeof(value));
+    return value;
+}
+
+// Смещение операнда number (0 - a, 1 - b, 2 - c) первого узла вида kind
+size_t OperandOffset(const string& image, NodeKind kind, size_t number) {
+    const uint32_t node_count = GetNumber(image, NODE_COUNT_OFFSET);
+    const size_t node = image.substr(HEADER_SIZE, node_count).find(static_cast<char>(kind));
+    ASSERT(node != string::npos);
+    const size_t operands = HEADER_SIZE + node_count + (4 - node_count % 4) % 4;
+    return operands + node * sizeof(Operands) + number * sizeof(uint32_t);
+}
+
+string WithOperand(string image, NodeKind kind, size_t number, uint32_t value) {
+    memcpy(image.data() + OperandOffset(image, kind, number), &value, sizeof(value));
+    return image;
+}
+
+void TestRejectsCorruptedOperands() {
+    const string image = Compile(PROGRAM);
+    const uint32_t node_count = GetNumber(image, NODE_COUNT_OFFSET);
+    // Значение присваивания за пределами дерева
+    ASSERT_THROWS(ReadImage(nullptr, WithOperand(image, NodeKind::Assignment, 1, node_count)),
+                  ImageError);
+    // Список аргументов print за пределами пула списков
+    ASSERT_THROWS(ReadImage(nullptr, WithOperand(image, NodeKind::Print, 0,
+                                                 GetNumber(image, LIST_SIZE_OFFSET))),
+                  ImageError);
+    // Создание объекта из константы, которая не является классом
+    const uint32_t number = GetNumber(image, OperandOffset(image, NodeKind::Constant, 0));
+    ASSERT_THROWS(ReadImage(nullptr, WithOperand(image, NodeKind::NewInstance, 0, number)),
+                  ImageError);
+    // Ячейка за пределами кадра метода
+    ASSERT_THROWS(ReadImage(nullptr, WithOperand(image, NodeKind::LocalVariable, 1, node_count)),
+                  ImageError);
+    // Образ с неизменённым значением операнда читается
+    const auto same = make_shared<const string>(WithOperand(image, NodeKind::Constant, 0, number));
+    ASSERT_EQUAL(Run(*ReadImage(same, *same)), Run(PROGRAM));
+}
+
+void TestImageRebindsCalls() {
+    const string source = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+  def add(n):
+    self.value = self.value + n
+    return self.value
+  def add_twice(n):
+    self.add(n)
+    return self.add(n)
+  def get():
+    return self.value
+
+class Other:
+  def add_twice(n):
+    return 'other'
+
+class Named(Counter):
+  def name():
+    return 'named'
+
+c = Counter()
+o = Other()
+n = Named()
+print c.add_twice(2), c.add(1), o.add_twice(1), c.add_twice(1, 2), c.get(), n.get()
+)"s;
+    auto image = make_shared<const string>(Compile(source));
+    auto program = ReadImage(image, *image);
+    // Встроенный вызов get проверяет класс объекта и после загрузки образа
+    ASSERT_EQUAL(Run(*program), Run(source));
+    ASSERT_EQUAL(Run(*program), "4 5 other None 5 0\n"s);
+}
+
+}  // namespace
+
+void RunImageTests(TestRunner& tr) {
+    RUN_TEST(tr, flat::TestImageRoundTrip);
+    RUN_TEST(tr, flat::TestImageOfEmptyProgram);
+    RUN_TEST(tr, flat::TestImageIsDeterministic);
+    RUN_TEST(tr, flat::TestRejectsBadImages);
+    RUN_TEST(tr, flat::TestRejectsCorruptedOperands);
+    RUN_TEST(tr, flat::TestImageRebindsCalls);
+}
+
+}  // namespace flat
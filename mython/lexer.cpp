@@ -1,13 +1,44 @@
 #include "lexer.h"
+#include "scan.h"
 
 #include <algorithm>
+#include <array>
 #include <charconv>
-#include <unordered_map>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <optional>
 
 using namespace std;
 
 namespace parse {
 
+TokenText TokenText::View(std::string_view text) {
+    TokenText result;
+    result.view_ = text;
+    return result;
+}
+
+bool operator==(const TokenText& lhs, const TokenText& rhs) {
+    return lhs.Get() == rhs.Get();
+}
+
+bool operator==(const TokenText& lhs, const std::string& rhs) {
+    return lhs.Get() == rhs;
+}
+
+bool operator==(const std::string& lhs, const TokenText& rhs) {
+    return lhs == rhs.Get();
+}
+
+bool operator!=(const TokenText& lhs, const TokenText& rhs) {
+    return !(lhs == rhs);
+}
+
+std::ostream& operator<<(std::ostream& os, const TokenText& text) {
+    return os << text.Get();
+}
+
 bool operator==(const Token& lhs, const Token& rhs) {
     using namespace token_type;
 
@@ -75,43 +106,221 @@ std::ostream& operator<<(std::ostream& os, const Token& rhs) {
     return os << "Unknown token :("sv;
 }
 
+namespace {
+
+template <size_t... Index>
+std::array<Token, sizeof...(Index)> MakeDefaultTokens(std::index_sequence<Index...>) {
+    return {Token(std::in_place_index<Index>)...};
+}
+
+// Лексемы без значения, по одной на каждую альтернативу TokenBase
+const std::array<Token, std::variant_size_v<TokenBase>>& DefaultTokens() {
+    static const auto tokens
+        = MakeDefaultTokens(std::make_index_sequence<std::variant_size_v<TokenBase>>());
+    return tokens;
+}
+
+std::array<Token, 256> MakeCharTokens() {
+    std::array<Token, 256> tokens;
+    for (size_t code = 0; code < tokens.size(); ++code) {
+        tokens[code] = token_type::Char{static_cast<char>(code)};
+    }
+    return tokens;
+}
+
+// Лексемы Char для всех возможных кодов символов
+const std::array<Token, 256>& CharTokens() {
+    static const auto tokens = MakeCharTokens();
+    return tokens;
+}
+
+template <typename T, typename... Types>
+constexpr uint8_t IndexOf(const std::variant<Types...>* /*variant*/) {
+    constexpr bool matches[] = {std::is_same_v<T, Types>...};
+    uint8_t index = 0;
+    while (!matches[index]) {
+        ++index;
+    }
+    return index;
+}
+
+// Номер альтернативы TokenBase для лексемы типа T
+template <typename T>
+constexpr uint8_t KindOf() {
+    return IndexOf<T>(static_cast<const TokenBase*>(nullptr));
+}
+
+}  // namespace
+
+uint32_t TokenArray::Intern(std::unordered_map<std::string_view, uint32_t>& index,
+                            Token&& token) {
+    const auto text = [](const Token& value) {
+        const auto* id = value.TryAs<token_type::Id>();
+        return id != nullptr ? id->value.Get() : value.As<token_type::String>().value.Get();
+    };
+
+    if (auto it = index.find(text(token)); it != index.end()) {
+        return it->second;
+    }
+    const auto position = static_cast<uint32_t>(values_.size());
+    // Ключ ссылается на текст сохранённой лексемы, адрес которой больше не изменится
+    index.emplace(text(values_.emplace_back(std::move(token))), position);
+    return position;
+}
+
+void TokenArray::PushBack(Token token) {
+    CompactToken compact;
+    compact.kind = static_cast<uint8_t>(token.index());
+
+    if (token.Is<token_type::Id>()) {
+        compact.payload = Intern(ids_, std::move(token));
+    } else if (token.Is<token_type::String>()) {
+        compact.payload = Intern(strings_, std::move(token));
+    } else if (const auto* num = token.TryAs<token_type::Number>()) {
+        const auto position = static_cast<uint32_t>(values_.size());
+        const auto [it, inserted] = numbers_.emplace(num->value, position);
+        if (inserted) {
+            values_.push_back(std::move(token));
+        }
+        compact.payload = it->second;
+    } else if (const auto* ch = token.TryAs<token_type::Char>()) {
+        compact.payload = static_cast<unsigned char>(ch->value);
+    }
+
+    tokens_.push_back(compact);
+}
+
+const Token& TokenArray::operator[](size_t index) const {
+    const CompactToken& compact = tokens_[index];
+    switch (compact.kind) {
+    case KindOf<token_type::Id>():
+    case KindOf<token_type::String>():
+    case KindOf<token_type::Number>():
+        return values_[compact.payload];
+    case KindOf<token_type::Char>():
+        return CharTokens()[compact.payload];
+    default:
+        return DefaultTokens()[compact.kind];
+    }
+}
+
 namespace detail {
 
-bool CheckSpecialChar(char ch){
-    return token_type::Special_Char.count(ch);
+// Классы символов исходного текста. Символ может принадлежать нескольким классам
+enum CharClass : uint8_t {
+    DIGIT = 1,
+    // Одиночный символ-оператор: = . , ( ) + > < - * / : !
+    SPECIAL = 2,
+    // Символ, завершающий идентификатор или ключевое слово
+    WORD_END = 4,
+    // Первый символ составного оператора ==, !=, <=, >=
+    COMPARISON_START = 8,
+};
+
+constexpr std::array<uint8_t, 256> MakeCharClassTable() {
+    std::array<uint8_t, 256> table{};
+    for (char ch = '0'; ch <= '9'; ++ch) {
+        table[static_cast<unsigned char>(ch)] |= DIGIT;
+    }
+    for (char ch : {'=', '.', ',', '(', ')', '+', '>', '<', '-', '*', '/', ':', '!'}) {
+        table[static_cast<unsigned char>(ch)] |= SPECIAL | WORD_END;
+    }
+    for (char ch : {' ', '\n', '#'}) {
+        table[static_cast<unsigned char>(ch)] |= WORD_END;
+    }
+    for (char ch : {'=', '!', '<', '>'}) {
+        table[static_cast<unsigned char>(ch)] |= COMPARISON_START;
+    }
+    return table;
 }
 
-bool CheckKeyWord(std::string str){
-    return token_type::KeyWords.count(str);
+constexpr std::array<uint8_t, 256> CHAR_CLASS = MakeCharClassTable();
+
+constexpr bool HasClass(char ch, uint8_t char_class) {
+    return (CHAR_CLASS[static_cast<unsigned char>(ch)] & char_class) != 0;
 }
 
-bool CheckEscapeSequence(char ch){
-    return token_type::EscapeSequence.count(ch);
+template <typename T>
+Token MakeToken() {
+    return T{};
 }
 
-// Функция парсит строку в кавычках "str" или 'str'
-std::string SplitAsStringInQuotes(std::istream& input, char quotes){
-    auto it = std::istreambuf_iterator<char>(input);
-    auto end = std::istreambuf_iterator<char>();
+struct KeyWord {
+    std::string_view word;
+    Token (*make)() = nullptr;
+};
+
+constexpr size_t KEYWORD_TABLE_SIZE = 32;
+
+// Совершенная хеш-функция для набора ключевых слов Mython:
+// у всех ключевых слов различается сумма первого и последнего символов и длины слова
+constexpr size_t KeyWordHash(std::string_view word) {
+    return (static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back())
+            + word.size())
+           % KEYWORD_TABLE_SIZE;
+}
+
+constexpr std::array<KeyWord, KEYWORD_TABLE_SIZE> MakeKeyWordTable() {
+    using namespace token_type;
+    const KeyWord key_words[] = {
+        {"class"sv, &MakeToken<Class>}, {"return"sv, &MakeToken<Return>},
+        {"if"sv, &MakeToken<If>},       {"else"sv, &MakeToken<Else>},
+        {"def"sv, &MakeToken<Def>},     {"print"sv, &MakeToken<Print>},
+        {"and"sv, &MakeToken<And>},     {"or"sv, &MakeToken<Or>},
+        {"not"sv, &MakeToken<Not>},     {"None"sv, &MakeToken<None>},
+        {"True"sv, &MakeToken<True>},   {"False"sv, &MakeToken<False>},
+    };
+
+    std::array<KeyWord, KEYWORD_TABLE_SIZE> table{};
+    for (const KeyWord& key_word : key_words) {
+        KeyWord& slot = table[KeyWordHash(key_word.word)];
+        if (slot.make != nullptr) {
+            // Коллизия делает вычисление неконстантным, и таблица не скомпилируется
+            throw std::logic_error("Keyword hash collision");
+        }
+        slot = key_word;
+    }
+    return table;
+}
+
+constexpr std::array<KeyWord, KEYWORD_TABLE_SIZE> KEYWORDS = MakeKeyWordTable();
+
+// Функция парсит строку в кавычках "str" или 'str', pos указывает на открывающую кавычку.
+// Участки между escape-последовательностями находятся векторным поиском и копируются целиком.
+// Если keep_view == true и в строке нет escape-последовательностей,
+// возвращается ссылка на участок исходного буфера без копирования
+TokenText SplitAsStringInQuotes(const char*& pos, const char* end, char quotes, bool keep_view){
+    const char* begin = ++pos;
     std::string s;
-    bool first_quote = false;
+    bool has_escape = false;
     while (true) {
-        if (it == end) {
+        const char* chunk_begin = pos;
+        pos = scan::FindStringSpecial(pos, end, quotes);
+        // Искомые символы - ASCII, поэтому участок не разрезает многобайтовые символы
+        if (scan::FindInvalidUtf8(chunk_begin, pos) != pos) {
+            throw LexerError("Invalid UTF-8 sequence in string literal"s);
+        }
+        if (has_escape) {
+            s.append(chunk_begin, pos);
+        }
+        if (pos == end) {
             throw logic_error("String parsing error");
         }
-        const char ch = *it;
-        if (ch == quotes && first_quote) {
-            ++it;
+        const char ch = *pos;
+        if (ch == quotes) {
+            ++pos;
             break;
-        }else if(ch == quotes && first_quote == false){
-            first_quote = true;
         }
         else if (ch == '\\') {
-            ++it;
-            if (it == end) {
+            if (!has_escape) {
+                has_escape = true;
+                s.assign(begin, pos);
+            }
+            ++pos;
+            if (pos == end) {
                 throw logic_error("String parsing error");
             }
-            const char escaped_char = *(it);
+            const char escaped_char = *pos;
             switch (escaped_char) {
             case 'n':
                 s.push_back('\n');
@@ -129,194 +338,391 @@ std::string SplitAsStringInQuotes(std::istream& input, char quotes){
                 throw logic_error("Unrecognized escape sequence \\"s + escaped_char);
             }
         }
-        else if (ch == '\n' || ch == '\r') {
-            throw logic_error("Unexpected end of line"s);
-        }
         else {
-            s.push_back(ch);
+            // Символ '\n' или '\r'
+            throw logic_error("Unexpected end of line"s);
         }
-        ++it;
+        ++pos;
     }
 
-    return s;
+    if (has_escape) {
+        return s;
+    }
+    const std::string_view text(begin, pos - begin - 1);
+    return keep_view ? TokenText::View(text) : TokenText(std::string(text));
 }
 
-std::string SplitAsStringWithoutQuotes(std::istream& input ){
-    auto it = std::istreambuf_iterator<char>(input);
-    auto end = std::istreambuf_iterator<char>();
-    std::string s;
-    while (true) {
-        if (it == end) {
-            break;
-        }
-        const char ch = *it;
-        if (ch == ' ' || ch == '\n' || CheckSpecialChar(ch) || ch == '#') {
-            break;
-        }
+// Функция возвращает очередное слово (идентификатор или ключевое слово), начинающееся в pos.
+// Идентификатор может содержать символы UTF-8, например буквы кириллицы.
+// Символы слова проверяются на корректность, только если среди них есть не ASCII
+std::string_view SplitAsStringWithoutQuotes(const char*& pos, const char* end){
+    const char* begin = pos;
+    unsigned char all_bits = 0;
+    while (pos != end && !HasClass(*pos, WORD_END)) {
+        all_bits |= static_cast<unsigned char>(*pos);
+        ++pos;
+    }
+    if ((all_bits & 0x80u) != 0 && scan::FindInvalidUtf8(begin, pos) != pos) {
+        throw LexerError("Invalid UTF-8 sequence in identifier"s);
+    }
+    return std::string_view(begin, pos - begin);
+}
 
-        if(CheckKeyWord(s)){
-            break;
+Token DefineToken(std::string_view str, bool keep_view = false){
+    if (!str.empty()) {
+        const KeyWord& key_word = KEYWORDS[KeyWordHash(str)];
+        if (key_word.make != nullptr && key_word.word == str) {
+            return key_word.make();
         }
-
-        else {
-            s.push_back(ch);
-        }
-        ++it;
-    }
-
-    return s;
-}
-
-Token DefineToken(std::string_view str){
-
-    if(str == "class"){
-        return token_type::Class();
-    }else if(str == "return"){
-        return token_type::Return();
-    }else if(str == "if"){
-        return token_type::If();
-    }else if(str == "else"){
-        return token_type::Else();
-    }else if(str == "def"){
-        return token_type::Def();
-    }else if(str == "\n"){
-        return token_type::Newline();
-    }else if(str == "print"){
-        return token_type::Print();
-    }else if(str == "and"){
-        return token_type::And();
-    }else if(str == "or"){
-        return token_type::Or();
-    }else if(str == "not"){
-        return token_type::Not();
-    }else if(str == "=="){
-        return token_type::Eq();
-    }else if(str == "!="){
-        return token_type::NotEq();
-    }else if(str == "<="){
-        return token_type::LessOrEq();
-    }else if(str == ">="){
-        return token_type::GreaterOrEq();
-    }else if(str == "None"){
-        return token_type::None();
-    }else if(str == "True"){
-        return token_type::True();
-    }else if(str == "False"){
-        return token_type::False();
     }
 
     token_type::Id id;
-    id.value = str;
+    id.value = keep_view ? TokenText::View(str) : TokenText(std::string(str));
     return id;
 }
 
-bool CheckSpecialCharCombination(char current_ch, char next_char){
-    std::string check_str;
-    check_str += current_ch;
-    check_str += next_char;
-    std::set<std::string> set_special_char = {"==","!=","<=",">="};
-    return set_special_char.count(check_str);
+// Если current_ch и next_char образуют составной оператор сравнения, возвращает его лексему
+std::optional<Token> DefineComparison(char current_ch, char next_char){
+    if (next_char != '=' || !HasClass(current_ch, COMPARISON_START)) {
+        return std::nullopt;
+    }
+    switch (current_ch) {
+    case '=':
+        return token_type::Eq();
+    case '!':
+        return token_type::NotEq();
+    case '<':
+        return token_type::LessOrEq();
+    default:
+        return token_type::GreaterOrEq();
+    }
 }
 
-int SplitAsNumber(std::istream& input) {
-    std::string parsed_num;
-
-    // Считывает в parsed_num очередной символ из input
-    auto read_char = [&parsed_num, &input] {
-        parsed_num += static_cast<char>(input.get());
-        if (!input) {
-            throw LexerError("Failed to read number from stream"s);
-        }
-    };
+int SplitAsNumber(const char*& pos, const char* end) {
+    const char* begin = pos;
 
-    // Считывает одну или более цифр в parsed_num из input
-    auto read_digits = [&input, read_char] {
-        if (!std::isdigit(input.peek())) {
+    auto read_digits = [&pos, end] {
+        if (pos == end || !HasClass(*pos, DIGIT)) {
             throw LexerError("A digit is expected"s);
         }
-        while (std::isdigit(input.peek())) {
-            read_char();
+        while (pos != end && HasClass(*pos, DIGIT)) {
+            ++pos;
         }
     };
 
-    if (input.peek() == '-') {
-        read_char();
-    }
     // Парсим целую часть числа
-    if (input.peek() == '0') {
-        read_char();
+    if (*pos == '0') {
+        ++pos;
     }
     else {
         read_digits();
     }
+    const char* integer_end = pos;
 
-    // Парсим экспоненциальную часть числа
-    if (int ch = input.peek(); ch == 'e' || ch == 'E') {
-        read_char();
-        if (ch = input.peek(); ch == '+' || ch == '-') {
-            read_char();
+    // Экспоненциальная часть числа допускается синтаксисом, но в значении не учитывается
+    if (pos != end && (*pos == 'e' || *pos == 'E')) {
+        ++pos;
+        if (pos != end && (*pos == '+' || *pos == '-')) {
+            ++pos;
         }
         read_digits();
     }
 
-    // Пробуем преобразовать строку в int
-    try {
-        return std::stoi(parsed_num);
+    int result = 0;
+    if (const auto [ptr, ec] = std::from_chars(begin, integer_end, result); ec != std::errc()) {
+        throw LexerError("Failed to convert "s + std::string(begin, pos) + " to number"s);
     }
-    catch (...) {
-        throw LexerError("Failed to convert "s + parsed_num + " to number"s);
-    }
-    return 0;
+    return result;
 }
 
 } // end namespace detail
 
-Lexer::Lexer(std::istream& input) {
-    SplitStream(input);
+bool IsTopLevelStatementStart(std::string_view line) {
+    if (line.empty()) {
+        return false;
+    }
+    const char first = line.front();
+    if (first == ' ' || first == '\t' || first == '\n' || first == '#') {
+        return false;
+    }
+    // Ветка else продолжает инструкцию if, начатую выше
+    constexpr std::string_view ELSE = "else"sv;
+    if (line.substr(0, ELSE.size()) == ELSE) {
+        return line.size() > ELSE.size() && !detail::HasClass(line[ELSE.size()], detail::WORD_END);
+    }
+    return true;
+}
+
+std::vector<std::string_view> SplitTopLevel(std::string_view source, size_t min_segment_size) {
+    std::vector<std::string_view> segments;
+    size_t segment_begin = 0;
+    size_t line_begin = 0;
+    while (line_begin < source.size()) {
+        const size_t newline = source.find('\n', line_begin);
+        const size_t line_end = newline == std::string_view::npos ? source.size() : newline + 1;
+
+        if (line_begin - segment_begin >= std::max<size_t>(min_segment_size, 1)
+            && IsTopLevelStatementStart(source.substr(line_begin, line_end - line_begin))) {
+            segments.push_back(source.substr(segment_begin, line_begin - segment_begin));
+            segment_begin = line_begin;
+        }
+        line_begin = line_end;
+    }
+    if (segment_begin < source.size()) {
+        segments.push_back(source.substr(segment_begin));
+    }
+    return segments;
+}
+
+// Ограниченная очередь пакетов лексем. Пакет содержит лексемы нескольких строк,
+// поэтому синхронизация требуется один раз на пакет, а не на каждую лексему
+class TokenQueue {
+public:
+    explicit TokenQueue(size_t capacity)
+        : capacity_(capacity) {
+    }
+
+    // Добавляет пакет, дожидаясь свободного места.
+    // Возвращает false, если курсор больше не нуждается в лексемах
+    bool Push(std::vector<Token> batch) {
+        std::unique_lock lock(mutex_);
+        not_full_.wait(lock, [this] {
+            return closed_ || batches_.size() < capacity_;
+        });
+        if (closed_) {
+            return false;
+        }
+        batches_.push_back(std::move(batch));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Извлекает очередной пакет, дожидаясь его появления.
+    // Если все пакеты извлечены, а разбор завершился ошибкой, выбрасывает её
+    std::vector<Token> Pop() {
+        std::unique_lock lock(mutex_);
+        not_empty_.wait(lock, [this] {
+            return !batches_.empty() || error_;
+        });
+        if (batches_.empty()) {
+            std::rethrow_exception(error_);
+        }
+        std::vector<Token> batch = std::move(batches_.front());
+        batches_.pop_front();
+        // Поток лексического анализа будится, только когда очередь опустела наполовину,
+        // чтобы потоки не переключались на каждом пакете
+        if (batches_.size() == capacity_ / 2) {
+            not_full_.notify_one();
+        }
+        return batch;
+    }
+
+    void Fail(std::exception_ptr error) {
+        std::lock_guard lock(mutex_);
+        error_ = std::move(error);
+        not_empty_.notify_one();
+    }
+
+    // Сообщает потоку лексического анализа, что лексемы больше не нужны
+    void Close() {
+        std::lock_guard lock(mutex_);
+        closed_ = true;
+        not_full_.notify_one();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<std::vector<Token>> batches_;
+    size_t capacity_;
+    std::exception_ptr error_;
+    bool closed_ = false;
+};
+
+namespace {
+
+// Наибольшее число пакетов лексем в очереди режима Pipelined
+constexpr size_t PIPELINE_CAPACITY = 64;
+// Пакет передаётся в очередь по достижении этого размера либо когда чтение ввода может ждать
+constexpr size_t PIPELINE_BATCH_SIZE = 256;
+
+}  // namespace
+
+Lexer::Lexer(std::istream& input)
+    : Lexer(input, LexerMode::Eager) {
+}
+
+Lexer::Lexer(std::istream& input, LexerMode mode)
+    : mode_(mode)
+    , input_(&input) {
+    if (mode_ == LexerMode::Eager) {
+        SplitStream(input);
+    } else {
+        if (mode_ == LexerMode::Pipelined) {
+            // Чтение связанного потока сбрасывает поток вывода, в который одновременно пишет
+            // исполнитель, поэтому на время работы потока лексического анализа связь снимается
+            tied_output_ = input.tie(nullptr);
+            queue_ = std::make_unique<TokenQueue>(PIPELINE_CAPACITY);
+            producer_ = std::thread([this] { ProduceTokens(); });
+        }
+        FillFirstToken();
+    }
+}
+
+Lexer::Lexer(std::string_view source, LexerMode mode)
+    : mode_(mode)
+    , keep_views_(true)
+    , pos_(source.data())
+    , end_(source.data() + source.size()) {
+    if (mode_ == LexerMode::Eager) {
+        while (ReadTokens()) {
+        }
+    } else {
+        if (mode_ == LexerMode::Pipelined) {
+            queue_ = std::make_unique<TokenQueue>(PIPELINE_CAPACITY);
+            producer_ = std::thread([this] { ProduceTokens(); });
+        }
+        FillFirstToken();
+    }
+}
+
+Lexer::Lexer(std::string_view source, std::shared_ptr<const void> source_owner, LexerMode mode)
+    : Lexer(source, mode) {
+    source_owner_ = std::move(source_owner);
+}
+
+Lexer::~Lexer() {
+    StopProducer();
+}
+
+void Lexer::FillFirstToken() {
+    try {
+        FillBuffer(0);
+    } catch (...) {
+        // Деструктор не вызывается для объекта, конструктор которого выбросил исключение
+        StopProducer();
+        throw;
+    }
+}
+
+void Lexer::StopProducer() {
+    if (producer_.joinable()) {
+        queue_->Close();
+        producer_.join();
+        if (input_ != nullptr) {
+            input_->tie(tied_output_);
+        }
+    }
+}
+
+void Lexer::ProduceTokens() {
+    try {
+        while (ReadTokens()) {
+        }
+    } catch (...) {
+        // Лексемы, прочитанные до ошибки, остаются доступны курсору
+        FlushBatch();
+        queue_->Fail(std::current_exception());
+    }
 }
 
 void Lexer::SplitStream(std::istream& input) {
-    auto it = std::istreambuf_iterator<char>(input);
-    auto end = std::istreambuf_iterator<char>();
-    bool not_space_exist = false;
-    int prev_count_space = 0;
-    int current_count_space = 0;
-    bool stroke_not_empty = false;
-    bool is_comment = false;
-
-    while(true){
-        if (it == end) {
+    input_ = &input;
+    while (ReadTokens()) {
+    }
+}
+
+void Lexer::PushToken(Token token) {
+    last_token_is_newline = token.Is<token_type::Newline>();
+    ++tokens_read;
+    if (mode_ == LexerMode::Eager) {
+        all_tokens.PushBack(std::move(token));
+    } else if (mode_ == LexerMode::Streaming) {
+        tokens.push_back(std::move(token));
+    } else {
+        const bool is_eof = token.Is<token_type::Eof>();
+        batch_.push_back(std::move(token));
+        if (is_eof || batch_.size() >= PIPELINE_BATCH_SIZE) {
+            FlushBatch();
+        }
+    }
+}
+
+void Lexer::FlushBatch() {
+    if (batch_.empty()) {
+        return;
+    }
+    if (!queue_->Push(std::move(batch_))) {
+        // Курсор уничтожен, дальнейший разбор не нужен
+        stream_finished = true;
+    }
+    batch_.clear();
+}
+
+size_t Lexer::BufferSize() const {
+    return mode_ == LexerMode::Eager ? all_tokens.Size() : tokens.size();
+}
+
+const Token& Lexer::TokenAt(size_t index) const {
+    return mode_ == LexerMode::Eager ? all_tokens[index] : tokens[index];
+}
+
+bool Lexer::ReadSourceLine() {
+    if (mode_ == LexerMode::Pipelined && input_ != nullptr && input_->rdbuf()->in_avail() <= 0) {
+        // Чтение следующей строки может ждать ввода, а курсору уже нужны прочитанные лексемы
+        FlushBatch();
+    }
+    if (input_ == nullptr || !std::getline(*input_, line_)) {
+        return false;
+    }
+    if (!input_->eof()) {
+        // getline извлекает символ перевода строки, но не сохраняет его
+        line_.push_back('\n');
+    }
+    pos_ = line_.data();
+    end_ = line_.data() + line_.size();
+    return true;
+}
+
+bool Lexer::ReadTokens() {
+    if (stream_finished) {
+        return false;
+    }
+
+    const size_t tokens_before = tokens_read;
+
+    while(tokens_read == tokens_before){
+        // Лексемы не переходят через границу строки, поэтому поток можно читать построчно
+        if (pos_ == end_ && !ReadSourceLine()) {
             if(current_count_space < prev_count_space){
                 const int count_space = prev_count_space - current_count_space;
                 for(int i = 2; count_space >= i; ){
                     i += 2;
-                    tokens.push_back(token_type::Dedent()) ;
+                    PushToken(token_type::Dedent()) ;
                 }
             }
-            if(stroke_not_empty && tokens[tokens.size() - 1] != token_type::Newline()){
-                tokens.push_back(token_type::Newline());
+            if(stroke_not_empty && !last_token_is_newline){
+                PushToken(token_type::Newline());
             }
-            tokens.push_back(token_type::Eof());
+            PushToken(token_type::Eof());
+            stream_finished = true;
             break;
         }
-        const char c = *it;
+        const char c = *pos_;
 
-        if(c == '#' && !is_comment){
-            is_comment = true;
-        }       
-
-        if(is_comment && c != '\n'){
-            ++it;
+        if(c == '#'){
+            // Комментарий продолжается до конца строки
+            pos_ = scan::FindNewline(pos_, end_);
             continue;
-        }else{
-            is_comment = false;
         }
 
         if(c == ' '){
+            const size_t count_space = scan::CountSpaces(pos_, end_);
             if(!not_space_exist){
-                ++current_count_space;
+                current_count_space += static_cast<int>(count_space);
             }
-            ++it;
+            pos_ += count_space;
             continue;
         }else{
             stroke_not_empty = true;
@@ -326,7 +732,7 @@ void Lexer::SplitStream(std::istream& input) {
             if(!not_space_exist){
                 current_count_space += 2;
             }
-            ++it;
+            ++pos_;
             continue;
         }
 
@@ -336,13 +742,13 @@ void Lexer::SplitStream(std::istream& input) {
                     const int count_space = current_count_space - prev_count_space;
                     for(int i = 2; count_space >= i; ){
                         i += 2;
-                        tokens.push_back(token_type::Indent()) ;
+                        PushToken(token_type::Indent()) ;
                     }
                 }else{
                     const int count_space = prev_count_space - current_count_space;
                     for(int i = 2; count_space >= i; ){
                         i += 2;
-                        tokens.push_back(token_type::Dedent()) ;
+                        PushToken(token_type::Dedent()) ;
                     }
                 }
                 prev_count_space = current_count_space;
@@ -352,78 +758,112 @@ void Lexer::SplitStream(std::istream& input) {
         }
 
         if(c == '"' || c == '\'' ){
-            if(it == end){
-                // конец потока
-                tokens.push_back(token_type::Eof());
-                break;
-            }
             token_type::String str;
-            str.value = detail::SplitAsStringInQuotes(input, c);
-            tokens.push_back(str) ;
+            str.value = detail::SplitAsStringInQuotes(pos_, end_, c, keep_views_);
+            PushToken(std::move(str)) ;
             continue;
         }
         if(c == '\n'){
             stroke_not_empty = false;
             if(not_space_exist){
                 not_space_exist = false;
-                tokens.push_back(token_type::Newline()) ;
+                PushToken(token_type::Newline()) ;
             }else{
                 current_count_space = 0;
             }
-            ++it;
+            ++pos_;
             continue;
         }
-        if(std::isdigit(c)){
+        if(detail::HasClass(c, detail::DIGIT)){
             token_type::Number num;
-            num.value = detail::SplitAsNumber(input);
-            tokens.push_back(num);
+            num.value = detail::SplitAsNumber(pos_, end_);
+            PushToken(num);
             continue;
         }
-        if(detail::CheckSpecialChar(c)){
-            ++it;
-            if(it == end){
+        if(detail::HasClass(c, detail::SPECIAL)){
+            ++pos_;
+            if(pos_ == end_){
                 token_type::Char char_;
                 char_.value = c;
-                tokens.push_back(char_) ;
+                PushToken(char_) ;
 
                 continue;
             }
-            char next_ch = *it;
-            if(detail::CheckSpecialCharCombination(c,next_ch)){
-                std::string str_;
-                str_ += c;
-                str_ += next_ch;
-                auto token = detail::DefineToken(str_);
-                tokens.push_back(token) ;
-                ++it;
+            if(auto comparison = detail::DefineComparison(c, *pos_)){
+                PushToken(std::move(*comparison)) ;
+                ++pos_;
             }else{
                 token_type::Char char_;
                 char_.value = c;
-                tokens.push_back(char_) ;
+                PushToken(char_) ;
 
             }
             continue;
         }
 
-        std::string str_ = detail::SplitAsStringWithoutQuotes(input);
-        auto token = detail::DefineToken(str_);
-        tokens.push_back(token) ;
+        const std::string_view word = detail::SplitAsStringWithoutQuotes(pos_, end_);
+        PushToken(detail::DefineToken(word, keep_views_)) ;
     }
 
+    return true;
+}
+
+void Lexer::FillBuffer(size_t index) {
+    if (mode_ == LexerMode::Pipelined) {
+        // Последней лексемой потока всегда идёт token_type::Eof
+        while (tokens.size() <= index && (tokens.empty() || !tokens.back().Is<token_type::Eof>())) {
+            for (Token& token : queue_->Pop()) {
+                tokens.push_back(std::move(token));
+            }
+        }
+        return;
+    }
+    while (BufferSize() <= index && ReadTokens()) {
+    }
 }
 
 const Token& Lexer::CurrentToken() const {
-    if(tokens.size() == 0 || index_current_token >= tokens.size() - 1){
-        return tokens[index_current_token];
+    return TokenAt(index_current_token);
+}
+
+const Token& Lexer::NextToken() {
+    if (CurrentToken().Is<token_type::Eof>()) {
+        return CurrentToken();
+    }
+
+    if (mode_ != LexerMode::Eager) {
+        // Прочитанная лексема больше не нужна, курсор всегда указывает на начало окна
+        tokens.pop_front();
+        FillBuffer(0);
+    } else {
+        ++index_current_token;
     }
-    return tokens[index_current_token];
+    return CurrentToken();
+}
+
+void Lexer::Rewind() {
+    assert(mode_ == LexerMode::Eager);
+    index_current_token = 0;
+}
+
+size_t Lexer::Position() const {
+    assert(mode_ == LexerMode::Eager);
+    return index_current_token;
+}
+
+void Lexer::Seek(size_t position) {
+    assert(mode_ == LexerMode::Eager && position < BufferSize());
+    index_current_token = position;
 }
 
-Token Lexer::NextToken() {
-    if(tokens.size() == 0 || index_current_token >= tokens.size() - 1){
-        return tokens[index_current_token];
+const Token& Lexer::PeekToken(size_t offset) {
+    const size_t index = index_current_token + offset;
+    FillBuffer(index);
+    if (index >= BufferSize()) {
+        // Поток закончился, последняя лексема всегда token_type::Eof
+        return TokenAt(BufferSize() - 1);
     }
-    return tokens[++index_current_token];
+    return TokenAt(index);
 }
 
 }  // namespace parse
@@ -6,21 +6,72 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <deque>
+#include <unordered_map>
 #include <vector>
 #include <cassert>
-#include <set>
+#include <cstdint>
+#include <memory>
+#include <thread>
 
 namespace parse {
 
+// Текст лексемы-идентификатора или строковой константы.
+// Либо владеет своей строкой, либо ссылается на участок исходного буфера без копирования.
+// Во втором случае буфер должен пережить лексему
+class TokenText {
+public:
+    TokenText() = default;
+
+    TokenText(std::string text)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : owned_(std::move(text)) {
+    }
+
+    TokenText(const char* text)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : owned_(text) {
+    }
+
+    // Создаёт текст, ссылающийся на text без копирования
+    [[nodiscard]] static TokenText View(std::string_view text);
+
+    [[nodiscard]] std::string_view Get() const {
+        return IsView() ? view_ : std::string_view(owned_);
+    }
+
+    // Возвращает true, если текст ссылается на внешний буфер
+    [[nodiscard]] bool IsView() const {
+        return view_.data() != nullptr;
+    }
+
+    operator std::string_view() const {  // NOLINT(google-explicit-constructor)
+        return Get();
+    }
+
+    operator std::string() const {  // NOLINT(google-explicit-constructor)
+        return std::string(Get());
+    }
+
+private:
+    std::string owned_;
+    std::string_view view_;
+};
+
+bool operator==(const TokenText& lhs, const TokenText& rhs);
+bool operator==(const TokenText& lhs, const std::string& rhs);
+bool operator==(const std::string& lhs, const TokenText& rhs);
+bool operator!=(const TokenText& lhs, const TokenText& rhs);
+
+std::ostream& operator<<(std::ostream& os, const TokenText& text);
+
 namespace token_type {
 struct Number {  // Лексема «число»
     int value;   // число
 };
 
-struct Id {             // Лексема «идентификатор»
-    std::string value;  // Имя идентификатора
+struct Id {           // Лексема «идентификатор»
+    TokenText value;  // Имя идентификатора
 };
 
 struct Char {    // Лексема «символ»
@@ -28,7 +79,7 @@ struct Char {    // Лексема «символ»
 };
 
 struct String {  // Лексема «строковая константа»
-    std::string value;
+    TokenText value;
 };
 
 struct Class {};    // Лексема «class»
@@ -52,14 +103,6 @@ struct None {};         // Лексема «None»
 struct True {};         // Лексема «True»
 struct False {};        // Лексема «False»
 
-const static std::set<char> Special_Char {'=','.',',','(',')','+','>','<','-','*','/',':', '!'};
-
-const static std::set<std::string> KeyWords {"Class", "Return", "If", "Else", "Def", "Newline", "Print",
-                               "Indent", "Dedent", "And", "Or", "Not", "Eq", "NotEq", "LessOrEq",
-                               "GreaterOrEq", "None", "True", "False", "Eof"};
-
-const static std::set<char> EscapeSequence {'n', 't'};
-
 }  // namespace token_type
 
 using TokenBase
@@ -94,22 +137,125 @@ bool operator!=(const Token& lhs, const Token& rhs);
 
 std::ostream& operator<<(std::ostream& os, const Token& rhs);
 
+// Компактное представление лексемы фиксированного размера
+struct CompactToken {
+    // Номер альтернативы TokenBase
+    uint8_t kind = 0;
+    // Для Id, String и Number - индекс значения в таблице TokenArray, для Char - код символа
+    uint32_t payload = 0;
+};
+
+static_assert(sizeof(CompactToken) == 8);
+
+// Массив лексем в компактном представлении.
+// Значения идентификаторов, строковых констант и чисел хранятся в таблицах без повторов,
+// поэтому лексема, значение которой уже встречалось, добавляется без выделения памяти
+class TokenArray {
+public:
+    void PushBack(Token token);
+
+    [[nodiscard]] size_t Size() const {
+        return tokens_.size();
+    }
+
+    [[nodiscard]] const CompactToken& Compact(size_t index) const {
+        return tokens_[index];
+    }
+
+    // Возвращает лексему с индексом index.
+    // Лексемы с одинаковым значением разделяют один объект, ссылка действительна, пока жив массив
+    [[nodiscard]] const Token& operator[](size_t index) const;
+
+private:
+    // Возвращает индекс лексемы Id или String с таким же текстом, добавляя её при необходимости
+    uint32_t Intern(std::unordered_map<std::string_view, uint32_t>& index, Token&& token);
+
+    std::vector<CompactToken> tokens_;
+    // Лексемы Id, String и Number. Адреса элементов deque не меняются при добавлении
+    std::deque<Token> values_;
+    std::unordered_map<std::string_view, uint32_t> ids_;
+    std::unordered_map<std::string_view, uint32_t> strings_;
+    std::unordered_map<int, uint32_t> numbers_;
+};
+
+// Проверяет, начинается ли в строке line новая инструкция верхнего уровня
+bool IsTopLevelStatementStart(std::string_view line);
+
+// Разбивает исходный текст на участки, каждый из которых начинается с инструкции верхнего уровня:
+// строки без отступа, не являющейся комментарием и не продолжающей инструкцию if веткой else.
+// Лексемы участков, разобранных по отдельности, совпадают с лексемами всего текста,
+// если отбросить промежуточные token_type::Eof.
+// Соседние инструкции объединяются в один участок, пока он короче min_segment_size байт
+std::vector<std::string_view> SplitTopLevel(std::string_view source, size_t min_segment_size = 0);
+
 class LexerError : public std::runtime_error {
 public:
     using std::runtime_error::runtime_error;
 };
 
+// Режим работы лексера
+enum class LexerMode {
+    // Весь входной поток разбивается на лексемы при создании лексера
+    Eager,
+    // Лексемы читаются из потока по мере продвижения курсора.
+    // В памяти хранятся только текущая лексема и окно упреждающего просмотра
+    Streaming,
+    // Как Streaming, но входной поток разбирается на лексемы в отдельном потоке выполнения,
+    // опережая курсор не более чем на ограниченное число лексем.
+    // Ошибка лексического анализа выбрасывается, когда курсор доходит до места ошибки
+    Pipelined,
+};
+
+// Очередь лексем между потоком лексического анализа и курсором в режиме Pipelined
+class TokenQueue;
+
 class Lexer {
 public:
     explicit Lexer(std::istream& input);
-
+    Lexer(std::istream& input, LexerMode mode);
+    // Разбивает на лексемы буфер source, не копируя его.
+    // Лексемы Id и String ссылаются на участки source, поэтому буфер должен пережить лексер
+    // и все полученные от него лексемы
+    explicit Lexer(std::string_view source, LexerMode mode = LexerMode::Eager);
+    // Разбивает на лексемы буфер source, которым владеет source_owner.
+    // Строковые константы программы ссылаются на source и продлевают время жизни буфера
+    Lexer(std::string_view source, std::shared_ptr<const void> source_owner,
+          LexerMode mode = LexerMode::Eager);
+
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+
+    // В режиме Pipelined дожидается завершения потока лексического анализа.
+    // Поток завершается после разбора текущей строки, поэтому деструктор может ждать ввода
+    ~Lexer();
+
+    // Разбивает на лексемы весь оставшийся входной поток
     void SplitStream(std::istream& input);
 
     // Возвращает ссылку на текущий токен или token_type::Eof, если поток токенов закончился
     [[nodiscard]] const Token& CurrentToken() const;
 
-    // Возвращает следующий токен, либо token_type::Eof, если поток токенов закончился
-    Token NextToken();
+    // Возвращает ссылку на следующий токен, либо token_type::Eof, если поток токенов закончился.
+    // В потоковом режиме ссылки на предыдущие токены после вызова становятся недействительными
+    const Token& NextToken();
+
+    // Возвращает токен, находящийся на offset позиций впереди текущего, не сдвигая курсор.
+    // Если поток токенов закончится раньше, возвращает token_type::Eof
+    const Token& PeekToken(size_t offset);
+
+    // Возвращает курсор к первой лексеме, чтобы разобрать поток повторно. Только для режима Eager
+    void Rewind();
+
+    // Номер текущей лексемы. Только для режима Eager
+    [[nodiscard]] size_t Position() const;
+    // Перемещает курсор к лексеме с номером position, полученным от Position. Только для режима Eager
+    void Seek(size_t position);
+
+    // Возвращает владельца исходного буфера либо nullptr, если лексемы нельзя использовать
+    // после уничтожения лексера без копирования
+    [[nodiscard]] const std::shared_ptr<const void>& SourceOwner() const {
+        return source_owner_;
+    }
 
     // Если текущий токен имеет тип T, метод возвращает ссылку на него.
     // В противном случае метод выбрасывает исключение LexerError
@@ -160,8 +306,7 @@ public:
     // В противном случае метод выбрасывает исключение LexerError
     template <typename T>
     const T& ExpectNext() {
-        using namespace std::literals;
-        [[maybe_unused]] const Token token = NextToken();
+        NextToken();
 
         return Expect<T>();
     }
@@ -170,16 +315,62 @@ public:
     // В противном случае метод выбрасывает исключение LexerError
     template <typename T, typename U>
     void ExpectNext(const U& value) {
-        using namespace std::literals;
-
-        [[maybe_unused]] const Token token = NextToken();
+        NextToken();
 
         return Expect<T>(value);
     }
 
 private:
-    std::vector<Token> tokens;
+    // Читает входной поток до тех пор, пока не будет получена хотя бы одна новая лексема.
+    // Возвращает false, если поток уже полностью разобран
+    bool ReadTokens();
+    // Читает из входного потока очередную строку. Возвращает false, если поток закончился
+    bool ReadSourceLine();
+    // Дочитывает поток, пока в буфере не окажется лексема с индексом index
+    void FillBuffer(size_t index);
+    void PushToken(Token token);
+    // Читает первую лексему в конструкторе. При ошибке останавливает поток режима Pipelined
+    void FillFirstToken();
+    // Тело потока лексического анализа в режиме Pipelined
+    void ProduceTokens();
+    // Останавливает поток режима Pipelined и дожидается его завершения
+    void StopProducer();
+    // Передаёт накопленный пакет лексем в очередь режима Pipelined
+    void FlushBatch();
+    [[nodiscard]] size_t BufferSize() const;
+    [[nodiscard]] const Token& TokenAt(size_t index) const;
+
+    LexerMode mode_ = LexerMode::Eager;
+    std::istream* input_ = nullptr;
+    // Поток вывода, с которым был связан input_ до запуска потока режима Pipelined
+    std::ostream* tied_output_ = nullptr;
+    // Лексемы ссылаются на исходный буфер вместо копирования текста
+    bool keep_views_ = false;
+    std::shared_ptr<const void> source_owner_;
+
+    // Ещё не разобранная часть текущей строки потока либо всего исходного буфера
+    std::string line_;
+    const char* pos_ = nullptr;
+    const char* end_ = nullptr;
+
+    // Все лексемы в режиме Eager
+    TokenArray all_tokens;
+    // Окно упреждающего просмотра в режимах Streaming и Pipelined
+    std::deque<Token> tokens;
+    // Режим Pipelined: лексемы, ещё не переданные в очередь
+    std::vector<Token> batch_;
+    std::unique_ptr<TokenQueue> queue_;
+    std::thread producer_;
     size_t index_current_token = 0;
+    size_t tokens_read = 0;
+
+    // Состояние разбора входного потока между вызовами ReadTokens
+    bool not_space_exist = false;
+    int prev_count_space = 0;
+    int current_count_space = 0;
+    bool stroke_not_empty = false;
+    bool last_token_is_newline = false;
+    bool stream_finished = false;
 };
 
 }  // namespace parse
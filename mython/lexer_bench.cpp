@@ -0,0 +1,86 @@
+#include "lexer.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace {
+
+// Генерирует программу из class_count классов, похожую на генерируемые скрипты
+string GenerateProgram(int class_count) {
+    ostringstream out;
+    for (int i = 0; i < class_count; ++i) {
+        out << "# class number " << i << '\n';
+        out << "class Shape" << i << ":\n";
+        out << "  def __init__(width, height):\n";
+        out << "    self.width = width\n";
+        out << "    self.height = height\n";
+        out << "    self.title = 'shape number " << i << "'\n";
+        out << "    self.description = 'generated shape with a long description used as a table entry "
+            << i << " of the string table in the generated program'\n";
+        out << '\n';
+        out << "  def area():\n";
+        out << "    if self.width >= 0 and self.height != 0:\n";
+        out << "      return self.width * self.height + " << i << " - (2 * 5) / 3\n";
+        out << "    else:\n";
+        out << "      return None\n";
+        out << '\n';
+        out << "s" << i << " = Shape" << i << "(" << i << ", " << i + 1 << ")\n";
+        out << "print s" << i << ".area(), \"done\\n\"\n";
+    }
+    return out.str();
+}
+
+size_t CountTokens(parse::Lexer& lexer) {
+    size_t count = 1;
+    while (!lexer.CurrentToken().Is<parse::token_type::Eof>()) {
+        lexer.NextToken();
+        ++count;
+    }
+    return count;
+}
+
+template <typename Func>
+void Measure(const string& name, const string& program, int repeat, Func lex) {
+    size_t tokens = 0;
+    const auto start = chrono::steady_clock::now();
+    for (int i = 0; i < repeat; ++i) {
+        tokens += lex(program);
+    }
+    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    cout << name << ": "s << tokens / repeat << " tokens, "s
+         << static_cast<size_t>(tokens / elapsed.count()) << " tokens/sec, "s
+         << static_cast<size_t>(program.size() * repeat / elapsed.count() / (1 << 20))
+         << " MiB/sec"s << endl;
+}
+
+}  // namespace
+
+// Использование: mython_lexer_bench [количество классов] [количество повторов]
+int main(int argc, char* argv[]) {
+    const int class_count = argc > 1 ? stoi(argv[1]) : 20000;
+    const int repeat = argc > 2 ? stoi(argv[2]) : 5;
+
+    const string program = GenerateProgram(class_count);
+    cout << "source: "s << program.size() << " bytes"s << endl;
+
+    Measure("istream, eager"s, program, repeat, [](const string& source) {
+        istringstream input(source);
+        parse::Lexer lexer(input);
+        return CountTokens(lexer);
+    });
+    Measure("istream, streaming"s, program, repeat, [](const string& source) {
+        istringstream input(source);
+        parse::Lexer lexer(input, parse::LexerMode::Streaming);
+        return CountTokens(lexer);
+    });
+    Measure("buffer, streaming"s, program, repeat, [](const string& source) {
+        parse::Lexer lexer(string_view{source}, parse::LexerMode::Streaming);
+        return CountTokens(lexer);
+    });
+    return 0;
+}
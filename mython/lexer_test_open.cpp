@@ -351,6 +351,336 @@ abc#
         ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Eof{}));
     }
 }
+
+void TestStreamingModeMatchesEager() {
+    const string program = R"(
+x = 4
+y = "hello"
+
+class Point:
+  def __init__(self, x, y):
+    self.x = x  # comment
+    self.y = y
+
+  def __str__(self):
+    return str(x) + ' ' + str(y)
+
+p = Point(1, 2)
+if p.x >= 1 and p.y != 3:
+  print str(p)
+  )"s;
+
+    istringstream eager_input(program);
+    Lexer eager(eager_input);
+    istringstream streaming_input(program);
+    Lexer streaming(streaming_input, LexerMode::Streaming);
+
+    ASSERT_EQUAL(streaming.CurrentToken(), eager.CurrentToken());
+    while (!eager.CurrentToken().Is<token_type::Eof>()) {
+        ASSERT_EQUAL(streaming.NextToken(), eager.NextToken());
+    }
+    ASSERT_EQUAL(streaming.NextToken(), Token(token_type::Eof{}));
+}
+
+void TestPipelinedModeMatchesEager() {
+    // Программа длиннее очереди лексем, поэтому поток лексического анализа успевает её заполнить
+    ostringstream program;
+    for (int i = 0; i < 5000; ++i) {
+        program << "if x"s << i << " >= "s << i << ":\n  print 'line', "s << i << "  # comment\n"s;
+    }
+    const string source = program.str();
+
+    for (bool from_buffer : {false, true}) {
+        istringstream eager_input(source);
+        Lexer eager(eager_input);
+        istringstream input(source);
+        Lexer pipelined = from_buffer ? Lexer(string_view{source}, LexerMode::Pipelined)
+                                      : Lexer(input, LexerMode::Pipelined);
+
+        ASSERT_EQUAL(pipelined.PeekToken(4), Token(token_type::Char{':'}));
+        ASSERT_EQUAL(pipelined.CurrentToken(), eager.CurrentToken());
+        while (!eager.CurrentToken().Is<token_type::Eof>()) {
+            ASSERT_EQUAL(pipelined.NextToken(), eager.NextToken());
+        }
+        ASSERT_EQUAL(pipelined.NextToken(), Token(token_type::Eof{}));
+    }
+
+    // Лексер, уничтоженный до конца разбора, останавливает поток лексического анализа
+    {
+        istringstream input(source);
+        Lexer pipelined(input, LexerMode::Pipelined);
+        ASSERT_EQUAL(pipelined.CurrentToken(), Token(token_type::If{}));
+    }
+
+    // Ошибка выбрасывается, когда курсор доходит до неё
+    istringstream input("x = 1\ny = 'unterminated\n"s);
+    Lexer pipelined(input, LexerMode::Pipelined);
+    ASSERT_EQUAL(pipelined.CurrentToken(), Token(token_type::Id{"x"s}));
+    ASSERT_EQUAL(pipelined.NextToken(), Token(token_type::Char{'='}));
+    ASSERT_EQUAL(pipelined.NextToken(), Token(token_type::Number{1}));
+    ASSERT_EQUAL(pipelined.NextToken(), Token(token_type::Newline{}));
+    ASSERT_EQUAL(pipelined.NextToken(), Token(token_type::Id{"y"s}));
+    ASSERT_EQUAL(pipelined.NextToken(), Token(token_type::Char{'='}));
+    ASSERT_THROWS(pipelined.NextToken(), std::logic_error);
+
+    // Ошибка в первой лексеме выбрасывается из конструктора, поток останавливается
+    for (const bool from_buffer : {false, true}) {
+        const string unterminated = "\"abc\n"s;
+        istringstream first_input(unterminated);
+        ASSERT_THROWS(from_buffer ? Lexer(string_view{unterminated}, LexerMode::Pipelined)
+                                  : Lexer(first_input, LexerMode::Pipelined),
+                      std::logic_error);
+    }
+}
+
+void TestPeekToken() {
+    istringstream input("a = 'b'\n"s);
+    Lexer lexer(input, LexerMode::Streaming);
+
+    ASSERT_EQUAL(lexer.PeekToken(0), Token(token_type::Id{"a"s}));
+    ASSERT_EQUAL(lexer.PeekToken(2), Token(token_type::String{"b"s}));
+    ASSERT_EQUAL(lexer.PeekToken(10), Token(token_type::Eof{}));
+    ASSERT_EQUAL(lexer.CurrentToken(), Token(token_type::Id{"a"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Char{'='}));
+    ASSERT_EQUAL(lexer.PeekToken(2), Token(token_type::Newline{}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::String{"b"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Newline{}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Eof{}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Eof{}));
+}
+
+void TestBufferTokensReferToSource() {
+    const string program = "name = 'plain' + \"esc\\taped\"\nprint name\n"s;
+    Lexer lexer(string_view{program});
+
+    const auto& id = lexer.Expect<token_type::Id>();
+    ASSERT(id.value.IsView());
+    ASSERT_EQUAL(id.value.Get().data(), program.data());
+    ASSERT_EQUAL(id.value, "name"s);
+
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Char{'='}));
+    const auto& plain = lexer.ExpectNext<token_type::String>();
+    ASSERT(plain.value.IsView());
+    ASSERT_EQUAL(plain.value, "plain"s);
+
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Char{'+'}));
+    // Строка с escape-последовательностью декодируется в собственный буфер
+    const auto& escaped = lexer.ExpectNext<token_type::String>();
+    ASSERT(!escaped.value.IsView());
+    ASSERT_EQUAL(escaped.value, "esc\taped"s);
+
+    istringstream input(program);
+    Lexer stream_lexer(input);
+    Lexer buffer_lexer(string_view{program}, LexerMode::Streaming);
+    ASSERT_EQUAL(buffer_lexer.CurrentToken(), stream_lexer.CurrentToken());
+    while (!stream_lexer.CurrentToken().Is<token_type::Eof>()) {
+        ASSERT_EQUAL(buffer_lexer.NextToken(), stream_lexer.NextToken());
+    }
+}
+
+void TestKeywordPrefixedIds() {
+    istringstream input("Classic Nonempty Trueish returned classes iffy def_ x1e3"s);
+    Lexer lexer(input);
+
+    ASSERT_EQUAL(lexer.CurrentToken(), Token(token_type::Id{"Classic"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"Nonempty"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"Trueish"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"returned"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"classes"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"iffy"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"def_"s}));
+    ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Id{"x1e3"s}));
+}
+
+void TestNumberLimits() {
+    {
+        istringstream input("2147483647 007"s);
+        Lexer lexer(input);
+        ASSERT_EQUAL(lexer.CurrentToken(), Token(token_type::Number{2147483647}));
+        ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Number{0}));
+        ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Number{0}));
+        ASSERT_EQUAL(lexer.NextToken(), Token(token_type::Number{7}));
+    }
+    {
+        istringstream input("2147483648"s);
+        ASSERT_THROWS(Lexer{input}, LexerError);
+    }
+    {
+        istringstream input("1e"s);
+        ASSERT_THROWS(Lexer{input}, LexerError);
+    }
+}
+
+void TestLongStringsCommentsAndIndents() {
+    // Длины подобраны так, чтобы искомые символы попадали в разные позиции блоков по 16 и 32 байта
+    for (size_t length : {0u, 1u, 15u, 16u, 17u, 31u, 32u, 33u, 100u}) {
+        const string body(length, 'x');
+        const string indent(length / 2 * 2, ' ');
+        ostringstream program;
+        program << "if True:\n"s << indent << "  s = '"s << body << "'  # "s << body << "\n"s
+                << indent << "  t = \""s << body << "\\t"s << body << "\"\n"s;
+
+        const string source = program.str();
+        for (bool from_buffer : {false, true}) {
+            istringstream input(source);
+            Lexer lexer = from_buffer ? Lexer(string_view{source}) : Lexer(input);
+
+            ASSERT_EQUAL(lexer.CurrentToken(), Token(token_type::If{}));
+            lexer.ExpectNext<token_type::True>();
+            lexer.ExpectNext<token_type::Char>(':');
+            lexer.ExpectNext<token_type::Newline>();
+            for (size_t i = 0; i < indent.size() / 2 + 1; ++i) {
+                lexer.ExpectNext<token_type::Indent>();
+            }
+            lexer.ExpectNext<token_type::Id>("s"s);
+            lexer.ExpectNext<token_type::Char>('=');
+            lexer.ExpectNext<token_type::String>(body);
+            lexer.ExpectNext<token_type::Newline>();
+            lexer.ExpectNext<token_type::Id>("t"s);
+            lexer.ExpectNext<token_type::Char>('=');
+            lexer.ExpectNext<token_type::String>(body + "\t"s + body);
+            lexer.ExpectNext<token_type::Newline>();
+        }
+    }
+
+    istringstream unterminated("s = 'abcdefghijklmnopqrstuvwxyz0123456789\n'"s);
+    ASSERT_THROWS(Lexer{unterminated}, std::logic_error);
+}
+
+void TestUtf8IdsAndStrings() {
+    const string source = "класс_точки = 'Привет, мир'\nпоказать.имя = \"строка\\tс табуляцией 😀\"\n"s;
+    for (bool from_buffer : {false, true}) {
+        istringstream input(source);
+        Lexer lexer = from_buffer ? Lexer(string_view{source}) : Lexer(input);
+
+        ASSERT_EQUAL(lexer.CurrentToken(), Token(token_type::Id{"класс_точки"s}));
+        lexer.ExpectNext<token_type::Char>('=');
+        lexer.ExpectNext<token_type::String>("Привет, мир"s);
+        lexer.ExpectNext<token_type::Newline>();
+        lexer.ExpectNext<token_type::Id>("показать"s);
+        lexer.ExpectNext<token_type::Char>('.');
+        lexer.ExpectNext<token_type::Id>("имя"s);
+        lexer.ExpectNext<token_type::Char>('=');
+        lexer.ExpectNext<token_type::String>("строка\tс табуляцией 😀"s);
+        lexer.ExpectNext<token_type::Newline>();
+        lexer.ExpectNext<token_type::Eof>();
+    }
+
+    // Длинная строка из символов кириллицы проверяется блоками, некорректный байт - в разных позициях
+    const string long_text = string(40, 'x') + "ёжик"s + string(40, 'y');
+    {
+        istringstream input("s = '"s + long_text + "'"s);
+        Lexer lexer(input);
+        lexer.ExpectNext<token_type::Char>('=');
+        lexer.ExpectNext<token_type::String>(long_text);
+    }
+    for (size_t position : {0u, 15u, 16u, 33u, 70u}) {
+        string broken = long_text;
+        broken[position] = '\xFF';
+        istringstream input("s = '"s + broken + "'"s);
+        ASSERT_THROWS(Lexer{input}, LexerError);
+    }
+
+    // Обрезанная последовательность, лишний байт продолжения, избыточная запись,
+    // суррогат и код больше U+10FFFF
+    for (const string& bad : {"\xD0"s, "\x80"s, "\xC0\xAF"s, "\xED\xA0\x80"s, "\xF4\x90\x80\x80"s}) {
+        istringstream string_input("s = '"s + bad + "'"s);
+        ASSERT_THROWS(Lexer{string_input}, LexerError);
+        istringstream id_input("x"s + bad + " = 1"s);
+        ASSERT_THROWS(Lexer{id_input}, LexerError);
+    }
+}
+
+void TestTokenArray() {
+    TokenArray tokens;
+    tokens.PushBack(token_type::Id{"counter"s});
+    tokens.PushBack(token_type::Char{'='});
+    tokens.PushBack(token_type::Number{42});
+    tokens.PushBack(token_type::String{"text"s});
+    tokens.PushBack(token_type::Newline{});
+    tokens.PushBack(token_type::Id{"counter"s});
+    tokens.PushBack(token_type::Number{42});
+    tokens.PushBack(token_type::String{"other"s});
+    tokens.PushBack(token_type::Eof{});
+
+    ASSERT_EQUAL(tokens.Size(), 9u);
+    ASSERT_EQUAL(tokens[0], Token(token_type::Id{"counter"s}));
+    ASSERT(tokens[1].Is<token_type::Char>());
+    ASSERT_EQUAL(tokens[1].As<token_type::Char>().value, '=');
+    ASSERT_EQUAL(tokens[2].As<token_type::Number>().value, 42);
+    ASSERT(tokens[3].TryAs<token_type::String>() != nullptr);
+    ASSERT(tokens[3].TryAs<token_type::Id>() == nullptr);
+    ASSERT_EQUAL(tokens[3].As<token_type::String>().value, "text"s);
+    ASSERT(tokens[4].Is<token_type::Newline>());
+    ASSERT_EQUAL(tokens[7], Token(token_type::String{"other"s}));
+    ASSERT(tokens[8].Is<token_type::Eof>());
+
+    // Повторяющиеся значения хранятся в таблице один раз
+    ASSERT(&tokens[0] == &tokens[5]);
+    ASSERT(&tokens[2] == &tokens[6]);
+    ASSERT_EQUAL(tokens.Compact(0).payload, tokens.Compact(5).payload);
+    ASSERT_EQUAL(tokens.Compact(1).payload, static_cast<uint32_t>('='));
+}
+
+// Собирает лексемы участков без промежуточных Eof
+vector<Token> SegmentTokens(const vector<string_view>& segments) {
+    vector<Token> result;
+    for (string_view segment : segments) {
+        Lexer lexer(segment);
+        for (; !lexer.CurrentToken().Is<token_type::Eof>(); lexer.NextToken()) {
+            result.push_back(lexer.CurrentToken());
+        }
+    }
+    result.push_back(token_type::Eof{});
+    return result;
+}
+
+void TestSplitTopLevel() {
+    const string source = R"(x = 1
+# comment
+
+if x:
+  print 'yes'
+
+# comment between branches
+else:
+  print 'no'
+class A:
+  def f():
+    return 1
+elsewhere = 2
+)"s;
+
+    const auto segments = SplitTopLevel(source);
+    ASSERT_EQUAL(segments.size(), 4u);
+    ASSERT_EQUAL(segments[0], "x = 1\n# comment\n\n"sv);
+    ASSERT_EQUAL(segments[1], "if x:\n  print 'yes'\n\n# comment between branches\nelse:\n  print 'no'\n"sv);
+    ASSERT_EQUAL(segments[2], "class A:\n  def f():\n    return 1\n"sv);
+    ASSERT_EQUAL(segments[3], "elsewhere = 2\n"sv);
+
+    string joined;
+    for (string_view segment : segments) {
+        ASSERT(!segment.empty());
+        joined += segment;
+    }
+    ASSERT_EQUAL(joined, source);
+
+    vector<Token> expected;
+    for (Lexer lexer(source); ; lexer.NextToken()) {
+        expected.push_back(lexer.CurrentToken());
+        if (lexer.CurrentToken().Is<token_type::Eof>()) {
+            break;
+        }
+    }
+    ASSERT(SegmentTokens(segments) == expected);
+
+    // Короткие инструкции объединяются в участки не короче min_segment_size
+    const auto merged = SplitTopLevel(source, 20);
+    ASSERT_EQUAL(merged.size(), 3u);
+    ASSERT(SegmentTokens(merged) == expected);
+    ASSERT_EQUAL(SplitTopLevel(source, source.size()).size(), 1u);
+    ASSERT(SplitTopLevel(""sv).empty());
+}
 }  // namespace
 
 void RunOpenLexerTests(TestRunner& tr) {
@@ -367,6 +697,16 @@ void RunOpenLexerTests(TestRunner& tr) {
     RUN_TEST(tr, parse::TestMythonProgram);
     RUN_TEST(tr, parse::TestAlwaysEmitsNewlineAtTheEndOfNonemptyLine);
     RUN_TEST(tr, parse::TestCommentsAreIgnored);
+    RUN_TEST(tr, parse::TestStreamingModeMatchesEager);
+    RUN_TEST(tr, parse::TestPipelinedModeMatchesEager);
+    RUN_TEST(tr, parse::TestPeekToken);
+    RUN_TEST(tr, parse::TestBufferTokensReferToSource);
+    RUN_TEST(tr, parse::TestKeywordPrefixedIds);
+    RUN_TEST(tr, parse::TestNumberLimits);
+    RUN_TEST(tr, parse::TestLongStringsCommentsAndIndents);
+    RUN_TEST(tr, parse::TestUtf8IdsAndStrings);
+    RUN_TEST(tr, parse::TestTokenArray);
+    RUN_TEST(tr, parse::TestSplitTopLevel);
 }
 
 }  // namespace parse
\ No newline at end of file
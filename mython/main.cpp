@@ -1,10 +1,17 @@
+#include "image.h"
 #include "lexer.h"
 #include "parse.h"
+#include "passes.h"
 #include "runtime.h"
+#include "source_file.h"
 #include "statement.h"
 #include "test_runner_p.h"
 
+#include <atomic>
+#include <charconv>
+#include <fstream>
 #include <iostream>
+#include <thread>
 
 using namespace std;
 
@@ -15,6 +22,11 @@ void RunOpenLexerTests(TestRunner& tr);
 namespace ast {
 void RunUnitTests(TestRunner& tr);
 }
+namespace flat {
+void RunFlatAstTests(TestRunner& tr);
+void RunPassesTests(TestRunner& tr);
+void RunImageTests(TestRunner& tr);
+}  // namespace flat
 namespace runtime {
 void RunObjectHolderTests(TestRunner& tr);
 void RunObjectsTests(TestRunner& tr);
@@ -24,15 +36,74 @@ void TestParseProgram(TestRunner& tr);
 
 namespace {
 
+// Выполняет каждую инструкцию верхнего уровня сразу после разбора, пока лексер
+// в отдельном потоке читает продолжение программы
 void RunMythonProgram(istream& input, ostream& output) {
-    parse::Lexer lexer(input);
-    auto program = ParseProgram(lexer);
+    parse::Lexer lexer(input, parse::LexerMode::Pipelined);
+    runtime::SimpleContext context{output};
+    runtime::Closure closure;
+    vector<unique_ptr<runtime::Executable>> executed;
+    ParseProgram(lexer, [&](unique_ptr<runtime::Executable> statement) {
+        statement->Execute(closure, context);
+        // Вывод инструкции не должен ждать разбора всей программы
+        output.flush();
+        executed.push_back(std::move(statement));
+    });
+}
+
+// Выполняет программу из файла path, разбирая его прямо из отображённой в память копии
+// на thread_count потоках (0 - по числу ядер). Образ, записанный mython --compile,
+// загружается без разбора
+void RunMythonFile(const string& path, ostream& output, size_t thread_count = 0) {
+    // Строковые константы программы ссылаются на отображённый файл и удерживают его
+    const auto source = std::make_shared<const parse::MappedFile>(path);
+    auto program = flat::IsImage(source->Data())
+                       ? flat::ReadImage(source, source->Data())
+                       : ParseProgramParallel(source->Data(), thread_count, source);
 
     runtime::SimpleContext context{output};
     runtime::Closure closure;
     program->Execute(closure, context);
 }
 
+// Выполняет программу из файла path, разбирая тела методов при их первом вызове
+void RunMythonFileLazy(const string& path, ostream& output) {
+    const auto source = std::make_shared<const parse::MappedFile>(path);
+    auto program = ParseProgramLazy(std::make_shared<parse::Lexer>(source->Data(), source));
+
+    runtime::SimpleContext context{output};
+    runtime::Closure closure;
+    program->Execute(closure, context);
+}
+
+// Разбирает программу из файла path и записывает её образ в файл image_path
+void CompileMythonFile(const string& path, const string& image_path) {
+    const parse::MappedFile source(path);
+    parse::Lexer lexer(source.Data());
+    flat::Ast ast;
+    const flat::NodeId root = ParseProgram(lexer, ast);
+    flat::RunPasses(ast);
+
+    ofstream image(image_path, ios::binary);
+    if (!image) {
+        throw runtime_error("Cannot open "s + image_path + " for writing"s);
+    }
+    flat::WriteImage(ast, root, image);
+    if (!image.flush()) {
+        throw runtime_error("Cannot write "s + image_path);
+    }
+}
+
+// Наибольший размер встраиваемого метода из ключа --inline-limit
+size_t ParseInlineLimit(string_view value) {
+    size_t limit = 0;
+    const auto [end, error] = from_chars(value.data(), value.data() + value.size(), limit);
+    if (value.empty() || error != errc{} || end != value.data() + value.size()) {
+        throw invalid_argument("Invalid inline limit: "s + string(value));
+    }
+    return limit;
+}
+
 void TestSimplePrints() {
     istringstream input(R"(
 print 57
@@ -113,28 +184,127 @@ print y.value
     ASSERT_EQUAL(output.str(), "2\n3\n");
 }
 
+// Буфер вывода в строку, который отмечает сброс из другого потока
+class OwnerThreadBuf : public std::stringbuf {
+public:
+    [[nodiscard]] bool SyncedByOtherThread() const {
+        return synced_by_other_thread_;
+    }
+
+protected:
+    int sync() override {
+        if (std::this_thread::get_id() != owner_) {
+            synced_by_other_thread_ = true;
+        }
+        return std::stringbuf::sync();
+    }
+
+private:
+    std::thread::id owner_ = std::this_thread::get_id();
+    std::atomic<bool> synced_by_other_thread_ = false;
+};
+
+void TestLongProgramFromTiedStream() {
+    // Ввод связан с выводом, как cin с cout
+    string program;
+    string expected;
+    for (int i = 0; i < 3000; ++i) {
+        program += "print "s + to_string(i) + ", 'line'\n"s;
+        expected += to_string(i) + " line\n"s;
+    }
+    istringstream input(program);
+    OwnerThreadBuf buffer;
+    ostream output(&buffer);
+    input.tie(&output);
+    RunMythonProgram(input, output);
+
+    ASSERT_EQUAL(buffer.str(), expected);
+    // Поток лексического анализа не сбрасывает вывод исполнителя, а связь восстанавливается
+    ASSERT(!buffer.SyncedByOtherThread());
+    ASSERT_EQUAL(input.tie(), &output);
+}
+
 void TestAll() {
     TestRunner tr;
     parse::RunOpenLexerTests(tr);
     runtime::RunObjectHolderTests(tr);
     runtime::RunObjectsTests(tr);
     ast::RunUnitTests(tr);
+    flat::RunFlatAstTests(tr);
+    flat::RunPassesTests(tr);
+    flat::RunImageTests(tr);
     TestParseProgram(tr);
 
     RUN_TEST(tr, TestSimplePrints);
     RUN_TEST(tr, TestAssignments);
     RUN_TEST(tr, TestArithmetics);
     RUN_TEST(tr, TestVariablesArePointers);
+    RUN_TEST(tr, TestLongProgramFromTiedStream);
 }
 
 }  // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
     try {
         // При необходимости можно запустить тесты, раскомментировав следующую строку
         //TestAll();
 
-        RunMythonProgram(cin, cout);
+        // Без синхронизации с stdio поток ввода буферизуется, и лексер может узнать,
+        // есть ли уже прочитанные данные
+        std::ios::sync_with_stdio(false);
+
+        // Ключи оптимизирующих проходов предшествуют остальным аргументам
+        flat::PassManager& passes = flat::DefaultPasses();
+        bool dump = false;
+        bool pass_stats = false;
+        bool type_report = false;
+        for (; argc > 1; --argc, ++argv) {
+            const string_view option = argv[1];
+            if (option.substr(0, "--passes="sv.size()) == "--passes="sv) {
+                passes.SetPipeline(option.substr("--passes="sv.size()));
+            } else if (option.substr(0, "--dump-after="sv.size()) == "--dump-after="sv) {
+                passes.DumpAfter(option.substr("--dump-after="sv.size()), cerr);
+                dump = true;
+            } else if (option.substr(0, "--inline-limit="sv.size()) == "--inline-limit="sv) {
+                flat::SetInlineLimit(ParseInlineLimit(option.substr("--inline-limit="sv.size())));
+            } else if (option == "--pass-stats"sv) {
+                passes.EnableStats();
+                pass_stats = true;
+            } else if (option == "--type-report"sv) {
+                flat::EnableTypeReport();
+                type_report = true;
+            } else {
+                break;
+            }
+        }
+
+        if (argc > 1 && argv[1] == "--compile"sv) {
+            if (argc != 5 || argv[3] != "-o"sv) {
+                std::cerr << "Usage: mython --compile <program> -o <image>" << std::endl;
+                return 1;
+            }
+            CompileMythonFile(argv[2], argv[4]);
+        } else if (argc > 1 && argv[1] == "--lazy"sv) {
+            if (argc != 3) {
+                std::cerr << "Usage: mython --lazy <program>" << std::endl;
+                return 1;
+            }
+            RunMythonFileLazy(argv[2], cout);
+        } else if (argc > 1) {
+            // Дерево печатается по инструкциям в порядке программы только при разборе в одном потоке
+            RunMythonFile(argv[1], cout, dump ? 1 : 0);
+        } else {
+            RunMythonProgram(cin, cout);
+        }
+
+        if (pass_stats) {
+            cout.flush();
+            passes.PrintStats(cerr);
+        }
+        if (type_report) {
+            cout.flush();
+            flat::PrintTypeReport(cerr);
+        }
     } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
 		return 1;
@@ -1,13 +1,72 @@
 #include "parse.h"
 
+#include "flat_ast.h"
 #include "lexer.h"
+#include "passes.h"
 #include "statement.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <optional>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
 using namespace std;
 
 namespace TokenType = parse::token_type;
 
 namespace {
+
+// Класс, объявленный заранее параллельным анализатором (см. ParseProgramParallel)
+struct PredeclaredClass {
+    // Класс без методов, методы задаёт анализатор участка, где находится определение
+    runtime::ObjectHolder cls;
+    // Номер участка программы, в котором определён класс
+    size_t segment = 0;
+};
+
+using PredeclaredClasses = std::unordered_map<string, PredeclaredClass>;
+
+// Класс, видимый при отложенном разборе тел методов (см. ParseProgramLazy)
+struct LazyClass {
+    // Не владеет классом: классами владеют деревья программы
+    runtime::ObjectHolder cls;
+    // Порядковый номер объявления класса
+    size_t order = 0;
+};
+
+// Общие данные отложенного разбора тел методов одной программы
+struct LazyContext {
+    // Лексер программы в режиме Eager, тела методов разбираются из его лексем
+    std::shared_ptr<parse::Lexer> lexer;
+    std::unordered_map<string, LazyClass> classes;
+};
+
+// Тело метода, разбираемое при первом вызове
+class LazyMethodSource : public flat::MethodSource {
+public:
+    LazyMethodSource(std::shared_ptr<LazyContext> lazy, size_t position, size_t visible_classes,
+                     vector<string> params)
+        : lazy_(std::move(lazy))
+        , position_(position)
+        , visible_classes_(visible_classes)
+        , params_(std::move(params)) {
+    }
+
+    pair<std::shared_ptr<const flat::Ast>, uint32_t> Parse() override;
+
+private:
+    std::shared_ptr<LazyContext> lazy_;
+    // Номер лексемы Newline перед телом метода
+    size_t position_;
+    // Тело видит только классы, объявленные до метода
+    size_t visible_classes_;
+    vector<string> params_;
+};
+
 bool operator==(const parse::Token& token, char c) {
     const auto* p = token.TryAs<TokenType::Char>();
     return p != nullptr && p->value == c;
@@ -17,41 +76,282 @@ bool operator!=(const parse::Token& token, char c) {
     return !(token == c);
 }
 
+// Незавершённая операция, скобка или вызов при разборе выражения (см. Parser::ParseTest)
+struct PendingOperator {
+    enum class Type : uint8_t { Binary, Not, Negate, Paren, Call };
+
+    // Приоритеты операций. Скобки и вызовы имеют нулевой приоритет: операции внутри них
+    // сворачиваются только при закрытии группы
+    enum : int { GROUP, OR, AND, NOT, COMPARISON, SUM, PRODUCT, NEGATION };
+
+    [[nodiscard]] int Precedence() const {
+        switch (type) {
+        case Type::Binary:
+            switch (kind) {
+            case flat::NodeKind::Or:
+                return OR;
+            case flat::NodeKind::And:
+                return AND;
+            case flat::NodeKind::Add:
+            case flat::NodeKind::Sub:
+                return SUM;
+            case flat::NodeKind::Mult:
+            case flat::NodeKind::Div:
+                return PRODUCT;
+            default:
+                return COMPARISON;
+            }
+        case Type::Not:
+            return NOT;
+        case Type::Negate:
+            return NEGATION;
+        default:
+            return GROUP;
+        }
+    }
+
+    Type type;
+    // Вид узла бинарной операции
+    flat::NodeKind kind = flat::NodeKind::None;
+    // Для вызова: узел объекта либо NO_NODE, имя метода и начало аргументов в scratch_
+    flat::NodeId object = flat::NO_NODE;
+    uint32_t name = 0;
+    size_t args = 0;
+};
+
+// Вид узла бинарной операции, которую обозначает лексема token
+optional<flat::NodeKind> BinaryOperator(const parse::Token& token) {
+    if (const auto* c = token.TryAs<TokenType::Char>()) {
+        switch (c->value) {
+        case '+':
+            return flat::NodeKind::Add;
+        case '-':
+            return flat::NodeKind::Sub;
+        case '*':
+            return flat::NodeKind::Mult;
+        case '/':
+            return flat::NodeKind::Div;
+        case '<':
+            return flat::NodeKind::Less;
+        case '>':
+            return flat::NodeKind::Greater;
+        default:
+            return nullopt;
+        }
+    }
+    if (token.Is<TokenType::Eq>()) {
+        return flat::NodeKind::Equal;
+    }
+    if (token.Is<TokenType::NotEq>()) {
+        return flat::NodeKind::NotEqual;
+    }
+    if (token.Is<TokenType::LessOrEq>()) {
+        return flat::NodeKind::LessOrEqual;
+    }
+    if (token.Is<TokenType::GreaterOrEq>()) {
+        return flat::NodeKind::GreaterOrEqual;
+    }
+    if (token.Is<TokenType::Or>()) {
+        return flat::NodeKind::Or;
+    }
+    if (token.Is<TokenType::And>()) {
+        return flat::NodeKind::And;
+    }
+    return nullopt;
+}
+
+// Синтаксический анализатор. Строит плоское дерево flat::Ast, которым совместно владеют
+// инструкции, возвращаемые анализатором
 class Parser {
 public:
     explicit Parser(parse::Lexer& lexer)
         : lexer_(lexer) {
     }
 
+    // Анализатор, добавляющий узлы в дерево ast, которым владеет вызывающий
+    Parser(parse::Lexer& lexer, flat::Ast& ast)
+        : lexer_(lexer)
+        , ast_(std::shared_ptr<flat::Ast>(), &ast) {
+    }
+
+    // Анализатор, откладывающий разбор тел методов. Классы из lazy с порядковым номером
+    // меньше visible_classes видны так же, как объявленные этим анализатором
+    Parser(parse::Lexer& lexer, std::shared_ptr<LazyContext> lazy, size_t visible_classes)
+        : lexer_(lexer)
+        , lazy_(std::move(lazy))
+        , visible_classes_(visible_classes) {
+    }
+
+    // Анализатор участка segment программы. Классы из предшествующих участков берутся из predeclared,
+    // определения классов этого участка заполняют заранее созданные объекты из predeclared
+    Parser(parse::Lexer& lexer, const PredeclaredClasses& predeclared, size_t segment)
+        : lexer_(lexer)
+        , predeclared_(&predeclared)
+        , segment_(segment) {
+    }
+
     // Program -> eps
     //          | Statement \n Program
-    unique_ptr<ast::Statement> ParseProgram() {
-        auto result = make_unique<ast::Compound>();
+    // Возвращает корневую составную инструкцию. Оптимизирующие проходы не выполняются
+    flat::NodeId ParseProgram() {
+        const size_t mark = scratch_.size();
         while (!lexer_.CurrentToken().Is<TokenType::Eof>()) {
-            result->AddStatement(ParseStatement());
+            scratch_.push_back(ParseStatement());
         }
+        return AddNode(flat::NodeKind::Compound, {TakeList(mark)});
+    }
+
+    // Разбирает программу и выполняет над её деревом оптимизирующие проходы
+    unique_ptr<runtime::Executable> ParseOptimizedProgram() {
+        const flat::NodeId root = ParseProgram();
+        flat::RunPasses(*ast_);
+        return make_unique<flat::Statement>(ast_, root);
+    }
 
+    // Разбирает инструкции до конца потока лексем. Оптимизирующие проходы выполняются над всеми
+    // инструкциями сразу, чтобы анализ иерархии видел все классы разобранного текста
+    vector<unique_ptr<runtime::Executable>> ParseStatements() {
+        const flat::NodeId root = ParseProgram();
+        flat::RunPasses(*ast_);
+        vector<unique_ptr<runtime::Executable>> result;
+        for (flat::NodeId statement : ast_->List(ast_->GetOperands(root).a)) {
+            result.push_back(make_unique<flat::Statement>(ast_, statement));
+        }
         return result;
     }
 
+    // Передаёт handler каждую инструкцию верхнего уровня сразу после её разбора.
+    // Оптимизирующие проходы обрабатывают только узлы очередной инструкции
+    template <typename Handler>
+    void ParseStatements(Handler&& handler) {
+        while (!lexer_.CurrentToken().Is<TokenType::Eof>()) {
+            const auto first = static_cast<flat::NodeId>(ast_->NodeCount());
+            const flat::NodeId statement = ParseStatement();
+            flat::RunPasses(*ast_, first);
+            handler(make_unique<flat::Statement>(ast_, statement));
+        }
+    }
+
+    // Разбирает отложенное тело метода с параметрами params, начиная с текущей лексемы Newline,
+    // и выполняет над ним оптимизирующие проходы. Возвращает дерево и индекс метода в нём
+    pair<std::shared_ptr<const flat::Ast>, uint32_t> ParseMethodBody(const vector<string>& params) {
+        const flat::NodeId body = ParseSuite();
+        const uint32_t method = AddMethod(body, params);
+        flat::RunPasses(*ast_);
+        return {ast_, method};
+    }
+
+    // Классы, определённые в разобранном тексте
+    [[nodiscard]] const runtime::Closure& DeclaredClasses() const {
+        return declared_classes_;
+    }
+
 private:
+    flat::NodeId AddNode(flat::NodeKind kind, flat::Operands operands = {}) {
+        return ast_->AddNode(kind, operands);
+    }
+
+    flat::NodeId AddConstant(runtime::ObjectHolder value) {
+        return AddNode(flat::NodeKind::Constant, {ast_->AddConstant(std::move(value))});
+    }
+
+    // Переносит в дерево элементы scratch_, добавленные после mark, и удаляет их из scratch_.
+    // Вложенные списки собираются в том же буфере, поэтому разбор не выделяет память на списки
+    flat::ListId TakeList(size_t mark) {
+        const flat::ListId list = ast_->AddList(scratch_.data() + mark, scratch_.data() + scratch_.size());
+        scratch_.resize(mark);
+        return list;
+    }
+
+    // Возвращает класс name, объявленный до текущей позиции, либо nullptr
+    const runtime::ObjectHolder* FindClass(const string& name) const {
+        if (auto it = declared_classes_.find(name); it != declared_classes_.end()) {
+            return &it->second;
+        }
+        if (predeclared_ != nullptr) {
+            if (auto it = predeclared_->find(name);
+                it != predeclared_->end() && it->second.segment < segment_) {
+                return &it->second.cls;
+            }
+        }
+        if (lazy_ != nullptr) {
+            if (auto it = lazy_->classes.find(name);
+                it != lazy_->classes.end() && it->second.order < visible_classes_) {
+                return &it->second.cls;
+            }
+        }
+        return nullptr;
+    }
+
+    uint32_t AddMethod(flat::NodeId body, const vector<string>& formal_params) {
+        vector<uint32_t> params;
+        params.reserve(formal_params.size());
+        for (const string& param : formal_params) {
+            params.push_back(ast_->AddName(param));
+        }
+        return ast_->AddMethod(body, std::move(params));
+    }
+
+    // Пропускает тело метода: Suite -> NEWLINE INDENT ... DEDENT с учётом вложенных отступов.
+    // Возвращает номер лексемы Newline, с которой начинается тело
+    size_t SkipSuite() {
+        const size_t position = lexer_.Position();
+        lexer_.Expect<TokenType::Newline>();
+        lexer_.ExpectNext<TokenType::Indent>();
+        for (size_t depth = 1; depth > 0;) {
+            const parse::Token& token = lexer_.NextToken();
+            if (token.Is<TokenType::Indent>()) {
+                ++depth;
+            } else if (token.Is<TokenType::Dedent>()) {
+                --depth;
+            } else if (token.Is<TokenType::Eof>()) {
+                throw ParseError("Unexpected end of method body"s);
+            }
+        }
+        lexer_.NextToken();
+        return position;
+    }
+
+    // Создаёт класс либо заполняет методами класс, заранее объявленный для этого участка
+    runtime::ObjectHolder DefineClass(const string& class_name, vector<runtime::Method> methods,
+                                      const runtime::Class* base_class) {
+        if (predeclared_ != nullptr) {
+            if (auto it = predeclared_->find(class_name);
+                it != predeclared_->end() && it->second.segment == segment_) {
+                auto& cls = static_cast<runtime::Class&>(*it->second.cls);  // NOLINT
+                cls.SetMethods(std::move(methods));
+                return it->second.cls;
+            }
+        }
+        return runtime::ObjectHolder::Own(runtime::Class(class_name, std::move(methods), base_class));
+    }
+
+    // Строковая константа. Текст без escape-последовательностей не копируется,
+    // если исходным буфером лексера можно владеть совместно
+    runtime::String MakeString(const parse::TokenText& text) const {
+        if (text.IsView() && lexer_.SourceOwner()) {
+            return runtime::String(lexer_.SourceOwner(), text.Get());
+        }
+        return runtime::String(std::string(text.Get()));
+    }
+
     // Suite -> NEWLINE INDENT (Statement)+ DEDENT
-    unique_ptr<ast::Statement> ParseSuite()  // NOLINT
+    flat::NodeId ParseSuite()  // NOLINT
     {
         lexer_.Expect<TokenType::Newline>();
         lexer_.ExpectNext<TokenType::Indent>();
 
         lexer_.NextToken();
 
-        auto result = make_unique<ast::Compound>();
+        const size_t mark = scratch_.size();
         while (!lexer_.CurrentToken().Is<TokenType::Dedent>()) {
-            result->AddStatement(ParseStatement());  // NOLINT
+            scratch_.push_back(ParseStatement());  // NOLINT
         }
 
         lexer_.Expect<TokenType::Dedent>();
         lexer_.NextToken();
 
-        return result;
+        return AddNode(flat::NodeKind::Compound, {TakeList(mark)});
     }
 
     // Methods -> [def id(Params) : Suite]*
@@ -76,7 +376,14 @@ private:
             lexer_.ExpectNext<TokenType::Char>(':');
             lexer_.NextToken();
 
-            m.body = std::make_unique<ast::MethodBody>(ParseSuite());  // NOLINT
+            if (lazy_ != nullptr) {
+                const size_t position = SkipSuite();
+                m.body = std::make_unique<flat::MethodBody>(std::make_unique<LazyMethodSource>(
+                    lazy_, position, lazy_->classes.size(), m.formal_params));
+            } else {
+                const flat::NodeId body = ParseSuite();  // NOLINT
+                m.body = std::make_unique<flat::MethodBody>(*ast_, AddMethod(body, m.formal_params));
+            }
 
             result.push_back(std::move(m));
         }
@@ -84,7 +391,7 @@ private:
     }
 
     // ClassDefinition -> Id ['(' Id ')'] : new_line indent MethodList dedent
-    unique_ptr<ast::Statement> ParseClassDefinition()  // NOLINT
+    flat::NodeId ParseClassDefinition()  // NOLINT
     {
         string class_name = lexer_.Expect<TokenType::Id>().value;
 
@@ -92,15 +399,15 @@ private:
 
         const runtime::Class* base_class = nullptr;
         if (lexer_.CurrentToken() == '(') {
-            auto name = lexer_.ExpectNext<TokenType::Id>().value;
+            string name = lexer_.ExpectNext<TokenType::Id>().value;
             lexer_.ExpectNext<TokenType::Char>(')');
             lexer_.NextToken();
 
-            auto it = declared_classes_.find(name);
-            if (it == declared_classes_.end()) {
+            const runtime::ObjectHolder* base = FindClass(name);
+            if (base == nullptr) {
                 throw ParseError("Base class "s + name + " not found for class "s + class_name);
             }
-            base_class = static_cast<const runtime::Class*>(it->second.Get());  // NOLINT
+            base_class = static_cast<const runtime::Class*>(base->Get());  // NOLINT
         }
 
         lexer_.Expect<TokenType::Char>(':');
@@ -112,195 +419,290 @@ private:
         lexer_.Expect<TokenType::Dedent>();
         lexer_.NextToken();
 
+        if (FindClass(class_name) != nullptr) {
+            throw ParseError("Class "s + class_name + " already exists"s);
+        }
         auto [it, inserted] = declared_classes_.insert({
             class_name,
-            runtime::ObjectHolder::Own(runtime::Class(class_name, std::move(methods), base_class)),
+            DefineClass(class_name, std::move(methods), base_class),
         });
-
-        if (!inserted) {
-            throw ParseError("Class "s + class_name + " already exists"s);
+        if (lazy_ != nullptr) {
+            lazy_->classes.try_emplace(
+                class_name, LazyClass{runtime::ObjectHolder::Share(*it->second), lazy_->classes.size()});
         }
 
-        return make_unique<ast::ClassDefinition>(it->second);
+        return AddNode(flat::NodeKind::ClassDefinition, {ast_->AddConstant(it->second)});
     }
 
-    vector<string> ParseDottedIds() {
-        vector<string> result(1, lexer_.Expect<TokenType::Id>().value);
+    // Добавляет в scratch_ индексы имён цепочки id1.id2.id3
+    void ParseDottedIds() {
+        scratch_.push_back(ast_->AddName(lexer_.Expect<TokenType::Id>().value.Get()));
 
         while (lexer_.NextToken() == '.') {
-            result.push_back(lexer_.ExpectNext<TokenType::Id>().value);
+            scratch_.push_back(ast_->AddName(lexer_.ExpectNext<TokenType::Id>().value.Get()));
         }
-
-        return result;
     }
 
     //  AssgnOrCall -> DottedIds = Expr
     //               | DottedIds '(' ExprList ')'
-    unique_ptr<ast::Statement> ParseAssignmentOrCall() {
+    flat::NodeId ParseAssignmentOrCall() {
         lexer_.Expect<TokenType::Id>();
 
-        vector<string> id_list = ParseDottedIds();
-        string last_name = id_list.back();
-        id_list.pop_back();
+        const size_t mark = scratch_.size();
+        ParseDottedIds();
+        const uint32_t last_name = scratch_.back();
+        scratch_.pop_back();
+        const bool is_variable = scratch_.size() == mark;
 
         if (lexer_.CurrentToken() == '=') {
             lexer_.NextToken();
 
-            if (id_list.empty()) {
-                return make_unique<ast::Assignment>(std::move(last_name), ParseTest());
+            if (is_variable) {
+                return AddNode(flat::NodeKind::Assignment, {last_name, ParseTest()});
             }
-            return make_unique<ast::FieldAssignment>(ast::VariableValue{std::move(id_list)},
-                                                     std::move(last_name), ParseTest());
+            const flat::NodeId object = AddNode(flat::NodeKind::Variable, {TakeList(mark)});
+            return AddNode(flat::NodeKind::FieldAssignment, {object, last_name, ParseTest()});
         }
         lexer_.Expect<TokenType::Char>('(');
         lexer_.NextToken();
 
-        if (id_list.empty()) {
-            throw ParseError("Mython doesn't support functions, only methods: "s + last_name);
+        if (is_variable) {
+            throw ParseError("Mython doesn't support functions, only methods: "s
+                             + ast_->Name(last_name));
         }
+        const flat::NodeId object = AddNode(flat::NodeKind::Variable, {TakeList(mark)});
 
-        vector<unique_ptr<ast::Statement>> args;
+        const flat::ListId args = ParseArguments();
+        return AddNode(flat::NodeKind::MethodCall, {object, last_name, args});
+    }
+
+    // Разбирает список аргументов вызова до закрывающей скобки включительно
+    flat::ListId ParseArguments() {
+        const size_t mark = scratch_.size();
         if (lexer_.CurrentToken() != ')') {
-            args = ParseTestList();
+            ParseTestList();
         }
         lexer_.Expect<TokenType::Char>(')');
         lexer_.NextToken();
-
-        return make_unique<ast::MethodCall>(make_unique<ast::VariableValue>(std::move(id_list)),
-                                            std::move(last_name), std::move(args));
+        return TakeList(mark);
     }
 
+    // Test -> AndTest [OR AndTest]*
+    // AndTest -> NotTest [AND NotTest]*
+    // NotTest -> NOT NotTest
+    //          | Comparison
+    // Comparison -> Expr [COMP_OP Expr]
     // Expr -> Adder ['+'/'-' Adder]*
-    unique_ptr<ast::Statement> ParseExpression()  // NOLINT
-    {
-        unique_ptr<ast::Statement> result = ParseAdder();
-        while (lexer_.CurrentToken() == '+' || lexer_.CurrentToken() == '-') {
-            char op = lexer_.CurrentToken().As<TokenType::Char>().value;
-            lexer_.NextToken();
-
-            if (op == '+') {
-                result = make_unique<ast::Add>(std::move(result), ParseAdder());
-            } else {
-                result = make_unique<ast::Sub>(std::move(result), ParseAdder());
-            }
-        }
-        return result;
-    }
-
     // Adder -> Mult ['*'/'/' Mult]*
-    unique_ptr<ast::Statement> ParseAdder()  // NOLINT
-    {
-        unique_ptr<ast::Statement> result = ParseMult();
-        while (lexer_.CurrentToken() == '*' || lexer_.CurrentToken() == '/') {
-            char op = lexer_.CurrentToken().As<TokenType::Char>().value;
-            lexer_.NextToken();
-
-            if (op == '*') {
-                result = make_unique<ast::Mult>(std::move(result), ParseMult());
-            } else {
-                result = make_unique<ast::Div>(std::move(result), ParseMult());
-            }
-        }
-        return result;
-    }
-
-    // Mult -> '(' Expr ')'
+    // Mult -> '(' Test ')'
     //       | NUMBER
     //       | '-' Mult
     //       | STRING
     //       | NONE
     //       | TRUE
     //       | FALSE
-    //       | DottedIds '(' ExprList ')'
+    //       | DottedIds '(' TestList ')'
     //       | DottedIds
-    unique_ptr<ast::Statement> ParseMult()  // NOLINT
-    {
-        if (lexer_.CurrentToken() == '(') {
-            lexer_.NextToken();
-            auto result = ParseTest();
-            lexer_.Expect<TokenType::Char>(')');
-            lexer_.NextToken();
-            return result;
+    //
+    // Выражение разбирается без рекурсии по приоритетам операций: незавершённые операции, скобки
+    // и вызовы хранятся в operators_, операнды — в scratch_. Узлы добавляются в дерево в том же
+    // порядке, что и при рекурсивном спуске по грамматике, поэтому длина выражения и глубина
+    // вложенности скобок ограничены только памятью
+    flat::NodeId ParseTest() {
+        const size_t base = operators_.size();
+        for (;;) {
+            if (!ParseOperand(base)) {
+                // Открыт вызов, разбирается его первый аргумент
+                continue;
+            }
+            while (!ParseBinaryOperator(base)) {
+                // Выражение текущей группы закончилось
+                ReduceOperators(base, PendingOperator::OR);
+                if (operators_.size() == base) {
+                    const flat::NodeId result = scratch_.back();
+                    scratch_.pop_back();
+                    return result;
+                }
+                if (!CloseGroup()) {
+                    // После запятой начинается следующий аргумент вызова
+                    break;
+                }
+            }
         }
-        if (lexer_.CurrentToken() == '-') {
-            lexer_.NextToken();
-            return make_unique<ast::Mult>(ParseMult(), make_unique<ast::NumericConst>(-1));
+    }
+
+    // Добавляет в operators_ префиксные операции и открывающие скобки перед операндом, затем
+    // добавляет в scratch_ узел первичного выражения. Возвращает false, если первичное выражение
+    // открыло вызов, аргументы которого ещё предстоит разобрать
+    bool ParseOperand(size_t base) {
+        for (;; lexer_.NextToken()) {
+            const auto& tok = lexer_.CurrentToken();
+            if (tok == '(') {
+                operators_.push_back({PendingOperator::Type::Paren});
+            } else if (tok == '-') {
+                operators_.push_back({PendingOperator::Type::Negate});
+            } else if (tok.Is<TokenType::Not>() && AcceptsNot(base)) {
+                operators_.push_back({PendingOperator::Type::Not});
+            } else {
+                break;
+            }
         }
+
         if (const auto* num = lexer_.CurrentToken().TryAs<TokenType::Number>()) {
-            int result = num->value;
+            int value = num->value;
             lexer_.NextToken();
-            return make_unique<ast::NumericConst>(result);
+            scratch_.push_back(AddConstant(runtime::ObjectHolder::Own(runtime::Number(value))));
+            return true;
         }
         if (const auto* str = lexer_.CurrentToken().TryAs<TokenType::String>()) {
-            string result = str->value;
+            runtime::String value = MakeString(str->value);
             lexer_.NextToken();
-            return make_unique<ast::StringConst>(std::move(result));
+            scratch_.push_back(AddConstant(runtime::ObjectHolder::Own(std::move(value))));
+            return true;
         }
         if (lexer_.CurrentToken().Is<TokenType::True>()) {
             lexer_.NextToken();
-            return make_unique<ast::BoolConst>(runtime::Bool(true));
+            scratch_.push_back(AddConstant(runtime::ObjectHolder::Own(runtime::Bool(true))));
+            return true;
         }
         if (lexer_.CurrentToken().Is<TokenType::False>()) {
             lexer_.NextToken();
-            return make_unique<ast::BoolConst>(runtime::Bool(false));
+            scratch_.push_back(AddConstant(runtime::ObjectHolder::Own(runtime::Bool(false))));
+            return true;
         }
         if (lexer_.CurrentToken().Is<TokenType::None>()) {
             lexer_.NextToken();
-            return make_unique<ast::None>();
+            scratch_.push_back(AddNode(flat::NodeKind::None));
+            return true;
         }
 
-        return ParseDottedIdsInMultExpr();
-    }
-
-    std::unique_ptr<ast::Statement> ParseDottedIdsInMultExpr() {
-        vector<string> names = ParseDottedIds();
+        const size_t mark = scratch_.size();
+        ParseDottedIds();
+        if (lexer_.CurrentToken() != '(') {
+            const flat::NodeId variable = AddNode(flat::NodeKind::Variable, {TakeList(mark)});
+            scratch_.push_back(variable);
+            return true;
+        }
+        lexer_.NextToken();
 
-        if (lexer_.CurrentToken() == '(') {
-            // various calls
-            vector<unique_ptr<ast::Statement>> args;
-            if (lexer_.NextToken() != ')') {
-                args = ParseTestList();
-            }
-            lexer_.Expect<TokenType::Char>(')');
+        PendingOperator call{PendingOperator::Type::Call};
+        call.name = scratch_.back();
+        scratch_.pop_back();
+        if (scratch_.size() != mark) {
+            call.object = AddNode(flat::NodeKind::Variable, {TakeList(mark)});
+        }
+        // Значения аргументов остаются в scratch_ элементами списка аргументов
+        call.args = scratch_.size();
+        if (lexer_.CurrentToken() == ')') {
             lexer_.NextToken();
+            scratch_.push_back(AddCall(call));
+            return true;
+        }
+        operators_.push_back(call);
+        return false;
+    }
 
-            auto method_name = names.back();
-            names.pop_back();
+    // NOT допускается в начале выражения и после AND, OR и NOT
+    [[nodiscard]] bool AcceptsNot(size_t base) const {
+        if (operators_.size() == base) {
+            return true;
+        }
+        const PendingOperator& top = operators_.back();
+        return top.Precedence() <= PendingOperator::NOT;
+    }
 
-            if (!names.empty()) {
-                return make_unique<ast::MethodCall>(
-                    make_unique<ast::VariableValue>(std::move(names)), std::move(method_name),
-                    std::move(args));
+    // Если текущая лексема — бинарная операция, сворачивает предшествующие операции с не меньшим
+    // приоритетом и добавляет её в operators_. Возвращает false в конце выражения текущей группы
+    bool ParseBinaryOperator(size_t base) {
+        const optional<flat::NodeKind> kind = BinaryOperator(lexer_.CurrentToken());
+        if (!kind) {
+            return false;
+        }
+        const PendingOperator op{PendingOperator::Type::Binary, *kind};
+        if (op.Precedence() == PendingOperator::COMPARISON) {
+            // Сравнения не объединяются в цепочки: второе сравнение завершает выражение
+            ReduceOperators(base, PendingOperator::COMPARISON + 1);
+            if (operators_.size() > base
+                && operators_.back().Precedence() == PendingOperator::COMPARISON) {
+                return false;
             }
-            if (auto it = declared_classes_.find(method_name); it != declared_classes_.end()) {
-                return make_unique<ast::NewInstance>(
-                    static_cast<const runtime::Class&>(*it->second), std::move(args));  // NOLINT
+        } else {
+            ReduceOperators(base, op.Precedence());
+        }
+        operators_.push_back(op);
+        lexer_.NextToken();
+        return true;
+    }
+
+    // Сворачивает в узлы операции на вершине operators_ с приоритетом не ниже precedence
+    void ReduceOperators(size_t base, int precedence) {
+        while (operators_.size() > base && operators_.back().Precedence() >= precedence) {
+            const PendingOperator op = operators_.back();
+            operators_.pop_back();
+            if (op.type == PendingOperator::Type::Binary) {
+                const flat::NodeId rhs = scratch_.back();
+                scratch_.pop_back();
+                scratch_.back() = AddNode(op.kind, {scratch_.back(), rhs});
+            } else if (op.type == PendingOperator::Type::Not) {
+                scratch_.back() = AddNode(flat::NodeKind::Not, {scratch_.back()});
+            } else {
+                const flat::NodeId argument = scratch_.back();
+                scratch_.back() = AddNode(
+                    flat::NodeKind::Mult,
+                    {argument, AddConstant(runtime::ObjectHolder::Own(runtime::Number(-1)))});
             }
-            if (method_name == "str"sv) {
-                if (args.size() != 1) {
-                    throw ParseError("Function str takes exactly one argument"s);
-                }
-                return make_unique<ast::Stringify>(std::move(args.front()));
+        }
+    }
+
+    // Закрывает скобку или вызов на вершине operators_. Возвращает false, если текущая лексема —
+    // запятая между аргументами вызова
+    bool CloseGroup() {
+        const PendingOperator group = operators_.back();
+        if (group.type == PendingOperator::Type::Call && lexer_.CurrentToken() == ',') {
+            lexer_.NextToken();
+            return false;
+        }
+        lexer_.Expect<TokenType::Char>(')');
+        lexer_.NextToken();
+        operators_.pop_back();
+        if (group.type == PendingOperator::Type::Call) {
+            scratch_.push_back(AddCall(group));
+        }
+        return true;
+    }
+
+    // Добавляет узел вызова, аргументы которого находятся в scratch_ начиная с call.args
+    flat::NodeId AddCall(const PendingOperator& call) {
+        const flat::ListId args = TakeList(call.args);
+        if (call.object != flat::NO_NODE) {
+            return AddNode(flat::NodeKind::MethodCall, {call.object, call.name, args});
+        }
+        const string& name = ast_->Name(call.name);
+        if (const runtime::ObjectHolder* cls = FindClass(name)) {
+            return AddNode(flat::NodeKind::NewInstance, {ast_->AddConstant(*cls), args});
+        }
+        if (name == "str"sv) {
+            if (ast_->List(args).size() != 1) {
+                throw ParseError("Function str takes exactly one argument"s);
             }
-            throw ParseError("Unknown call to "s + method_name + "()"s);
+            return AddNode(flat::NodeKind::Stringify, {ast_->List(args)[0]});
         }
-        return make_unique<ast::VariableValue>(std::move(names));
+        throw ParseError("Unknown call to "s + name + "()"s);
     }
 
-    vector<unique_ptr<ast::Statement>> ParseTestList()  // NOLINT
+    // Добавляет в scratch_ узлы выражений списка через запятую
+    void ParseTestList()  // NOLINT
     {
-        vector<unique_ptr<ast::Statement>> result;
-        result.push_back(ParseTest());
+        scratch_.push_back(ParseTest());
 
         while (lexer_.CurrentToken() == ',') {
             lexer_.NextToken();
-            result.push_back(ParseTest());
+            scratch_.push_back(ParseTest());
         }
-        return result;
     }
 
-    // Condition -> if LogicalExpr: Suite [else: Suite]
-    unique_ptr<ast::Statement> ParseCondition()  // NOLINT
+    // Condition -> if Test: Suite [else: Suite]
+    flat::NodeId ParseCondition()  // NOLINT
     {
         lexer_.Expect<TokenType::If>();
         lexer_.NextToken();
@@ -312,94 +714,20 @@ private:
 
         auto if_body = ParseSuite();
 
-        unique_ptr<ast::Statement> else_body;
+        flat::NodeId else_body = flat::NO_NODE;
         if (lexer_.CurrentToken().Is<TokenType::Else>()) {
             lexer_.ExpectNext<TokenType::Char>(':');
             lexer_.NextToken();
             else_body = ParseSuite();
         }
 
-        return make_unique<ast::IfElse>(std::move(condition), std::move(if_body),
-                                        std::move(else_body));
-    }
-
-    // LogicalExpr -> AndTest [OR AndTest]
-    // AndTest -> NotTest [AND NotTest]
-    // NotTest -> [NOT] NotTest
-    //          | Comparison
-    unique_ptr<ast::Statement> ParseTest()  // NOLINT
-    {
-        auto result = ParseAndTest();
-        while (lexer_.CurrentToken().Is<TokenType::Or>()) {
-            lexer_.NextToken();
-            result = make_unique<ast::Or>(std::move(result), ParseAndTest());
-        }
-        return result;
-    }
-
-    unique_ptr<ast::Statement> ParseAndTest()  // NOLINT
-    {
-        auto result = ParseNotTest();
-        while (lexer_.CurrentToken().Is<TokenType::And>()) {
-            lexer_.NextToken();
-            result = make_unique<ast::And>(std::move(result), ParseNotTest());
-        }
-        return result;
-    }
-
-    unique_ptr<ast::Statement> ParseNotTest()  // NOLINT
-    {
-        if (lexer_.CurrentToken().Is<TokenType::Not>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Not>(ParseNotTest());  // NOLINT
-        }
-        return ParseComparison();
-    }
-
-    // Comparison -> Expr [COMP_OP Expr]
-    unique_ptr<ast::Statement> ParseComparison()  // NOLINT
-    {
-        auto result = ParseExpression();
-
-        const auto tok = lexer_.CurrentToken();
-
-        if (tok == '<') {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Less, std::move(result),
-                                                ParseExpression());
-        }
-        if (tok == '>') {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Greater, std::move(result),
-                                                ParseExpression());
-        }
-        if (tok.Is<TokenType::Eq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::Equal, std::move(result),
-                                                ParseExpression());
-        }
-        if (tok.Is<TokenType::NotEq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::NotEqual, std::move(result),
-                                                ParseExpression());
-        }
-        if (tok.Is<TokenType::LessOrEq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::LessOrEqual, std::move(result),
-                                                ParseExpression());
-        }
-        if (tok.Is<TokenType::GreaterOrEq>()) {
-            lexer_.NextToken();
-            return make_unique<ast::Comparison>(runtime::GreaterOrEqual, std::move(result),
-                                                ParseExpression());
-        }
-        return result;
+        return AddNode(flat::NodeKind::IfElse, {condition, if_body, else_body});
     }
 
     // Statement -> SimpleStatement Newline
     //           | class ClassDefinition
     //           | if Condition
-    unique_ptr<ast::Statement> ParseStatement()  // NOLINT
+    flat::NodeId ParseStatement()  // NOLINT
     {
         const auto& tok = lexer_.CurrentToken();
 
@@ -419,30 +747,525 @@ private:
     // StatementBody -> return Expression
     //               | print ExpressionList
     //               | AssignmentOrCall
-    unique_ptr<ast::Statement> ParseSimpleStatement() {
+    flat::NodeId ParseSimpleStatement() {
         const auto& tok = lexer_.CurrentToken();
 
         if (tok.Is<TokenType::Return>()) {
             lexer_.NextToken();
-            return make_unique<ast::Return>(ParseTest());
+            return AddNode(flat::NodeKind::Return, {ParseTest()});
         }
         if (tok.Is<TokenType::Print>()) {
             lexer_.NextToken();
-            vector<unique_ptr<ast::Statement>> args;
+            const size_t mark = scratch_.size();
             if (!lexer_.CurrentToken().Is<TokenType::Newline>()) {
-                args = ParseTestList();
+                ParseTestList();
             }
-            return make_unique<ast::Print>(std::move(args));
+            return AddNode(flat::NodeKind::Print, {TakeList(mark)});
         }
         return ParseAssignmentOrCall();
     }
 
     parse::Lexer& lexer_;
+    // Для дерева, которым владеет вызывающий, указатель не владеет объектом
+    std::shared_ptr<flat::Ast> ast_ = std::make_shared<flat::Ast>();
+    // Элементы списков, которые ещё разбираются
+    vector<uint32_t> scratch_;
+    // Незавершённые операции разбираемых выражений
+    vector<PendingOperator> operators_;
     runtime::Closure declared_classes_;
+    const PredeclaredClasses* predeclared_ = nullptr;
+    size_t segment_ = 0;
+    // Отложенный разбор тел методов
+    std::shared_ptr<LazyContext> lazy_;
+    size_t visible_classes_ = 0;
+};
+
+pair<std::shared_ptr<const flat::Ast>, uint32_t> LazyMethodSource::Parse() {
+    parse::Lexer& lexer = *lazy_->lexer;
+    // Метод может быть вызван, пока анализатор программы разбирает следующие инструкции
+    struct CursorGuard {
+        parse::Lexer& lexer;
+        size_t position;
+        ~CursorGuard() {
+            lexer.Seek(position);
+        }
+    } guard{lexer, lexer.Position()};
+
+    lexer.Seek(position_);
+    return Parser{lexer, lazy_, visible_classes_}.ParseMethodBody(params_);
+}
+
+// Участок программы для параллельного анализа
+struct Segment {
+    std::string_view source;
+    std::unique_ptr<parse::Lexer> lexer;
+    // Заголовки классов участка в порядке следования: имя класса и имя базового класса
+    vector<pair<string, string>> class_headers;
+    vector<unique_ptr<runtime::Executable>> statements;
+    std::exception_ptr error;
 };
 
+// Находит в потоке лексем все заголовки определений классов: class Id ['(' Id ')']
+vector<pair<string, string>> FindClassHeaders(parse::Lexer& lexer) {
+    vector<pair<string, string>> result;
+    for (size_t offset = 0; !lexer.PeekToken(offset).Is<TokenType::Eof>(); ++offset) {
+        if (!lexer.PeekToken(offset).Is<TokenType::Class>()) {
+            continue;
+        }
+        const auto* name = lexer.PeekToken(offset + 1).TryAs<TokenType::Id>();
+        if (name == nullptr) {
+            continue;
+        }
+        string base_name;
+        if (lexer.PeekToken(offset + 2) == '(') {
+            if (const auto* base = lexer.PeekToken(offset + 3).TryAs<TokenType::Id>()) {
+                base_name = base->value;
+            }
+        }
+        result.emplace_back(name->value, std::move(base_name));
+    }
+    return result;
+}
+
+// Выполняет task(i) для i из [0, count) на thread_count потоках
+template <typename Task>
+void RunParallel(size_t count, size_t thread_count, Task task) {
+    std::atomic<size_t> next = 0;
+    auto worker = [&next, count, &task] {
+        for (size_t i = next++; i < count; i = next++) {
+            task(i);
+        }
+    };
+
+    vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(thread_count, count); ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Выбрасывает первую по порядку участков ошибку, если она есть
+void RethrowFirstError(vector<Segment>& segments) {
+    for (Segment& segment : segments) {
+        if (segment.error) {
+            std::rethrow_exception(segment.error);
+        }
+    }
+}
+
 }  // namespace
 
 unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer) {
-    return Parser{lexer}.ParseProgram();
-}
\ No newline at end of file
+    return Parser{lexer}.ParseOptimizedProgram();
+}
+
+unique_ptr<runtime::Executable> ParseProgramLazy(std::shared_ptr<parse::Lexer> lexer) {
+    auto lazy = std::make_shared<LazyContext>();
+    lazy->lexer = lexer;
+    return Parser{*lexer, std::move(lazy), 0}.ParseOptimizedProgram();
+}
+
+flat::NodeId ParseProgram(parse::Lexer& lexer, flat::Ast& ast) {
+    return Parser{lexer, ast}.ParseProgram();
+}
+
+void ParseProgram(parse::Lexer& lexer,
+                  const std::function<void(std::unique_ptr<runtime::Executable>)>& handler) {
+    Parser{lexer}.ParseStatements(handler);
+}
+
+unique_ptr<runtime::Executable> ParseProgramParallel(std::string_view source, size_t thread_count,
+                                                     const std::shared_ptr<const void>& source_owner) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Участков в несколько раз больше, чем потоков, чтобы потоки загружались равномерно
+    constexpr size_t MIN_SEGMENT_SIZE = 16 * 1024;
+    const size_t segment_size = std::max(MIN_SEGMENT_SIZE, source.size() / (thread_count * 8));
+
+    vector<Segment> segments;
+    for (std::string_view segment_source : parse::SplitTopLevel(source, segment_size)) {
+        segments.push_back({segment_source, nullptr, {}, {}, nullptr});
+    }
+
+    // Лексический анализ участков и поиск заголовков классов
+    RunParallel(segments.size(), thread_count, [&segments, &source_owner](size_t i) {
+        Segment& segment = segments[i];
+        try {
+            segment.lexer = make_unique<parse::Lexer>(segment.source, source_owner);
+            segment.class_headers = FindClassHeaders(*segment.lexer);
+        } catch (...) {
+            segment.error = std::current_exception();
+        }
+    });
+    RethrowFirstError(segments);
+
+    // Классы объявляются заранее в порядке следования, чтобы базовые классы и конструкторы
+    // из предыдущих участков были доступны анализаторам последующих. Ошибочные определения
+    // пропускаются: о них сообщит анализатор соответствующего участка
+    PredeclaredClasses predeclared;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        for (const auto& [name, base_name] : segments[i].class_headers) {
+            const runtime::Class* base_class = nullptr;
+            if (!base_name.empty()) {
+                auto base = predeclared.find(base_name);
+                if (base == predeclared.end()) {
+                    continue;
+                }
+                base_class = static_cast<const runtime::Class*>(base->second.cls.Get());  // NOLINT
+            }
+            predeclared.insert(
+                {name, {runtime::ObjectHolder::Own(runtime::Class(name, {}, base_class)), i}});
+        }
+    }
+
+    RunParallel(segments.size(), thread_count, [&segments, &predeclared](size_t i) {
+        Segment& segment = segments[i];
+        try {
+            segment.statements = Parser{*segment.lexer, predeclared, i}.ParseStatements();
+        } catch (...) {
+            segment.error = std::current_exception();
+        }
+        segment.lexer.reset();
+    });
+    RethrowFirstError(segments);
+
+    auto result = make_unique<ast::Compound>();
+    for (Segment& segment : segments) {
+        for (auto& statement : segment.statements) {
+            result->AddStatement(std::move(statement));
+        }
+    }
+    return result;
+}
+
+// Инструкция верхнего уровня вместе со следующими за ней комментариями и пустыми строками
+struct IncrementalProgram::Block {
+    // Текст блока. Строковые константы программы ссылаются на него
+    std::shared_ptr<const std::string> text;
+    // Лексемы блока. Ссылаются на text, равен nullptr при лексической ошибке
+    std::unique_ptr<parse::Lexer> lexer;
+    vector<unique_ptr<runtime::Executable>> statements;
+    // Классы, определённые в блоке
+    runtime::Closure classes;
+    std::exception_ptr error;
+    // Ключ порядка блока. Ключи возрастают вместе с номерами блоков, но не обязаны идти подряд,
+    // поэтому вставка блоков не требует перенумерации остальных
+    size_t order = 0;
+};
+
+struct IncrementalProgram::Impl {
+    // Текст программы при последнем вызове Update
+    std::string source;
+    vector<unique_ptr<Block>> blocks;
+    // Смещения начал блоков в source и размер source в конце
+    vector<size_t> offsets = {0};
+    // Классы программы вместе с ключами порядка блоков, где они определены
+    PredeclaredClasses classes;
+    // Число блоков с ошибками
+    size_t errors = 0;
+    size_t relexed = 0;
+    size_t reparsed = 0;
+};
+
+namespace {
+
+// Промежуток между ключами порядка соседних блоков после перенумерации
+constexpr size_t ORDER_STEP = size_t{1} << 32;
+
+// Проверяет, встречается ли в блоке идентификатор из names
+bool MentionsAny(parse::Lexer& lexer, const std::set<string, std::less<>>& names) {
+    lexer.Rewind();
+    for (size_t offset = 0; !lexer.PeekToken(offset).Is<TokenType::Eof>(); ++offset) {
+        const auto* id = lexer.PeekToken(offset).TryAs<TokenType::Id>();
+        if (id != nullptr && names.count(id->value.Get()) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Длина общего начала строк lhs и rhs. Сравнивает крупными блоками через memcmp
+size_t CommonPrefixSize(std::string_view lhs, std::string_view rhs) {
+    constexpr size_t CHUNK = 256;
+    const size_t size = std::min(lhs.size(), rhs.size());
+    size_t pos = 0;
+    while (pos + CHUNK <= size && std::memcmp(lhs.data() + pos, rhs.data() + pos, CHUNK) == 0) {
+        pos += CHUNK;
+    }
+    while (pos < size && lhs[pos] == rhs[pos]) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Длина общего окончания строк lhs и rhs
+size_t CommonSuffixSize(std::string_view lhs, std::string_view rhs) {
+    constexpr size_t CHUNK = 256;
+    const size_t size = std::min(lhs.size(), rhs.size());
+    size_t count = 0;
+    while (count + CHUNK <= size
+           && std::memcmp(lhs.data() + lhs.size() - count - CHUNK,
+                          rhs.data() + rhs.size() - count - CHUNK, CHUNK) == 0) {
+        count += CHUNK;
+    }
+    while (count < size && lhs[lhs.size() - count - 1] == rhs[rhs.size() - count - 1]) {
+        ++count;
+    }
+    return count;
+}
+
+}  // namespace
+
+IncrementalProgram::IncrementalProgram()
+    : impl_(make_unique<Impl>()) {
+}
+
+IncrementalProgram::~IncrementalProgram() = default;
+
+void IncrementalProgram::Update(std::string_view source) {
+    auto& blocks = impl_->blocks;
+    auto& offsets = impl_->offsets;
+    auto& classes = impl_->classes;
+    impl_->relexed = 0;
+    impl_->reparsed = 0;
+
+    // Блоки, целиком попадающие в общее начало и общее окончание старого и нового текста.
+    // Первый блок может начинаться с комментариев, поэтому в конце текста он не используется
+    const std::string_view old_source = impl_->source;
+    const size_t common_prefix = CommonPrefixSize(old_source, source);
+    const size_t common_suffix = std::min(CommonSuffixSize(old_source, source),
+                                          std::min(old_source.size(), source.size()) - common_prefix);
+    size_t prefix = std::upper_bound(offsets.begin() + 1, offsets.end(), common_prefix)
+                    - (offsets.begin() + 1);
+    size_t suffix = offsets.end() - 1
+                    - std::lower_bound(offsets.begin(), offsets.end() - 1,
+                                       old_source.size() - common_suffix);
+    suffix = std::min(suffix, blocks.size() > prefix ? blocks.size() - prefix - 1 : 0);
+
+    // Изменённый участок должен начинаться с инструкции верхнего уровня и заканчиваться
+    // концом строки, иначе он продолжает соседний блок и разбирается вместе с ним
+    std::string_view middle;
+    for (;;) {
+        const size_t prefix_size = offsets[prefix];
+        const size_t suffix_size = old_source.size() - offsets[blocks.size() - suffix];
+        middle = source.substr(prefix_size, source.size() - prefix_size - suffix_size);
+        if (prefix > 0 && !middle.empty()
+            && (source[prefix_size - 1] != '\n'
+                || !parse::IsTopLevelStatementStart(middle.substr(0, middle.find('\n'))))) {
+            --prefix;
+        } else if (suffix > 0 && !middle.empty() && middle.back() != '\n') {
+            --suffix;
+        } else {
+            break;
+        }
+    }
+    const size_t middle_begin = offsets[prefix];
+
+    // Классы удалённых блоков используются повторно, если изменённый участок снова определяет
+    // их с тем же базовым классом. Тогда инструкции, ссылающиеся на них, разбирать не нужно
+    const size_t removed_end = blocks.size() - suffix;
+    runtime::Closure removed_classes;
+    for (size_t i = prefix; i < removed_end; ++i) {
+        for (const auto& [name, cls] : blocks[i]->classes) {
+            removed_classes.emplace(name, cls);
+            if (auto it = classes.find(name);
+                it != classes.end() && it->second.segment == blocks[i]->order) {
+                classes.erase(it);
+            }
+        }
+        if (blocks[i]->error) {
+            --impl_->errors;
+        }
+    }
+
+    vector<unique_ptr<Block>> inserted;
+    vector<size_t> inserted_offsets;
+    for (std::string_view text : parse::SplitTopLevel(middle)) {
+        auto block = make_unique<Block>();
+        block->text = make_shared<const string>(text);
+        try {
+            block->lexer = make_unique<parse::Lexer>(std::string_view{*block->text}, block->text);
+        } catch (...) {
+            block->error = std::current_exception();
+            ++impl_->errors;
+        }
+        ++impl_->relexed;
+        inserted_offsets.push_back(middle_begin + static_cast<size_t>(text.data() - middle.data()));
+        inserted.push_back(std::move(block));
+    }
+
+    // Новые блоки получают ключи порядка между соседними блоками
+    const size_t inserted_end = prefix + inserted.size();
+    const size_t order_begin = prefix > 0 ? blocks[prefix - 1]->order : 0;
+    const size_t order_end = removed_end < blocks.size() ? blocks[removed_end]->order
+                                                          : order_begin + (inserted.size() + 1) * ORDER_STEP;
+    const size_t order_step = (order_end - order_begin) / (inserted.size() + 1);
+    for (size_t k = 0; k < inserted.size(); ++k) {
+        inserted[k]->order = order_begin + (k + 1) * order_step;
+    }
+    for (size_t i = removed_end; i < offsets.size(); ++i) {
+        offsets[i] = offsets[i] - old_source.size() + source.size();
+    }
+    offsets.erase(offsets.begin() + static_cast<ptrdiff_t>(prefix),
+                  offsets.begin() + static_cast<ptrdiff_t>(removed_end));
+    offsets.insert(offsets.begin() + static_cast<ptrdiff_t>(prefix), inserted_offsets.begin(),
+                   inserted_offsets.end());
+    blocks.erase(blocks.begin() + static_cast<ptrdiff_t>(prefix),
+                 blocks.begin() + static_cast<ptrdiff_t>(removed_end));
+    blocks.insert(blocks.begin() + static_cast<ptrdiff_t>(prefix),
+                  std::make_move_iterator(inserted.begin()), std::make_move_iterator(inserted.end()));
+    impl_->source = string(source);
+    if (order_step == 0) {
+        // Промежуток между ключами исчерпан, ключи всех блоков назначаются заново
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            for (const auto& [name, cls] : blocks[i]->classes) {
+                if (auto it = classes.find(name);
+                    it != classes.end() && it->second.segment == blocks[i]->order) {
+                    it->second.segment = (i + 1) * ORDER_STEP;
+                }
+            }
+            blocks[i]->order = (i + 1) * ORDER_STEP;
+        }
+    }
+
+    // Имена классов, объекты которых изменились: инструкции, упоминающие их, разбираются заново
+    std::set<string, std::less<>> changed;
+    runtime::Closure reused;
+    for (size_t i = prefix; i < blocks.size(); ++i) {
+        if (i == inserted_end) {
+            // Определения, не восстановленные изменённым участком, удалены из программы
+            for (const auto& [name, cls] : removed_classes) {
+                if (reused.count(name) == 0) {
+                    changed.insert(name);
+                }
+            }
+            if (changed.empty() && impl_->errors == 0) {
+                // Следующие блоки не зависят от изменений
+                break;
+            }
+        }
+
+        Block& block = *blocks[i];
+        const bool is_inserted = i < inserted_end;
+        if (block.lexer == nullptr
+            || !(is_inserted || block.error || (!changed.empty() && MentionsAny(*block.lexer, changed)))) {
+            continue;
+        }
+        ++impl_->reparsed;
+
+        // Классы блока, которые можно сохранить: определение с тем же именем и базовым классом
+        const runtime::Closure& candidates = is_inserted ? removed_classes : block.classes;
+        runtime::Closure kept;
+        block.lexer->Rewind();
+        for (const auto& [name, base_name] : FindClassHeaders(*block.lexer)) {
+            auto candidate = candidates.find(name);
+            auto declared = classes.find(name);
+            if (candidate == candidates.end() || reused.count(name) > 0
+                || (declared != classes.end() && declared->second.segment < block.order)) {
+                continue;
+            }
+            const runtime::Class* base_class = nullptr;
+            if (!base_name.empty()) {
+                auto base = classes.find(base_name);
+                if (base == classes.end() || base->second.segment >= block.order) {
+                    continue;
+                }
+                base_class = static_cast<const runtime::Class*>(base->second.cls.Get());  // NOLINT
+            }
+            const auto* cls = static_cast<const runtime::Class*>(candidate->second.Get());  // NOLINT
+            if (cls->GetParent() == base_class) {
+                kept.emplace(name, candidate->second);
+                classes[name] = {candidate->second, block.order};
+            }
+        }
+        if (!is_inserted) {
+            for (const auto& [name, cls] : block.classes) {
+                if (kept.count(name) > 0) {
+                    continue;
+                }
+                changed.insert(name);
+                if (auto it = classes.find(name);
+                    it != classes.end() && it->second.segment == block.order) {
+                    classes.erase(it);
+                }
+            }
+        }
+
+        block.lexer->Rewind();
+        block.statements.clear();
+        block.classes.clear();
+        if (block.error) {
+            block.error = nullptr;
+            --impl_->errors;
+        }
+        try {
+            Parser parser{*block.lexer, classes, block.order};
+            for (auto& statement : parser.ParseStatements()) {
+                block.statements.push_back(std::move(statement));
+            }
+            block.classes = parser.DeclaredClasses();
+        } catch (...) {
+            block.error = std::current_exception();
+            block.statements.clear();
+            ++impl_->errors;
+        }
+
+        for (const auto& [name, cls] : kept) {
+            if (block.classes.count(name) == 0) {
+                changed.insert(name);
+                classes.erase(name);
+            }
+        }
+        for (const auto& [name, cls] : block.classes) {
+            if (kept.count(name) > 0) {
+                if (is_inserted) {
+                    reused.emplace(name, cls);
+                }
+                continue;
+            }
+            changed.insert(name);
+            auto declared = classes.find(name);
+            if (declared == classes.end() || declared->second.segment > block.order) {
+                classes[name] = {cls, block.order};
+            }
+        }
+    }
+    RethrowFirstError();
+}
+
+void IncrementalProgram::RethrowFirstError() const {
+    if (impl_->errors == 0) {
+        return;
+    }
+    // Как и при разборе целиком, лексические ошибки обнаруживаются раньше синтаксических
+    for (bool lexer_errors : {true, false}) {
+        for (const auto& block : impl_->blocks) {
+            if (block->error && (block->lexer == nullptr) == lexer_errors) {
+                std::rethrow_exception(block->error);
+            }
+        }
+    }
+}
+
+runtime::ObjectHolder IncrementalProgram::Execute(runtime::Closure& closure,
+                                                  runtime::Context& context) {
+    RethrowFirstError();
+    for (const auto& block : impl_->blocks) {
+        for (const auto& statement : block->statements) {
+            statement->Execute(closure, context);
+        }
+    }
+    return runtime::ObjectHolder::None();
+}
+
+size_t IncrementalProgram::LastRelexed() const {
+    return impl_->relexed;
+}
+
+size_t IncrementalProgram::LastReparsed() const {
+    return impl_->reparsed;
+}
@@ -1,18 +1,78 @@
 #pragma once
 
+#include "flat_ast.h"
+#include "runtime.h"
+
+#include <functional>
 #include <memory>
 #include <stdexcept>
+#include <string_view>
 
 namespace parse {
 class Lexer;
 }
 
-namespace runtime {
-class Executable;
-}
-
 struct ParseError : std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
-std::unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer);
\ No newline at end of file
+// Разбирает программу и выполняет оптимизирующие проходы (см. passes.h)
+std::unique_ptr<runtime::Executable> ParseProgram(parse::Lexer& lexer);
+
+// Разбирает программу, откладывая разбор тела каждого метода до его первого вызова.
+// При разборе программы тела методов только пропускаются по отступам, поэтому время разбора
+// и память дерева зависят от выполняемого кода, а не от размера программы.
+// Тела разбираются из лексем lexer, поэтому лексер должен работать в режиме Eager и жить, пока
+// используются классы программы. Синтаксическая ошибка в теле метода выбрасывается при первом
+// вызове метода. Классы, определённые внутри тела метода, видны только в этом теле
+std::unique_ptr<runtime::Executable> ParseProgramLazy(std::shared_ptr<parse::Lexer> lexer);
+
+// Разбирает программу в дерево ast без оптимизирующих проходов.
+// Возвращает индекс корневой составной инструкции
+flat::NodeId ParseProgram(parse::Lexer& lexer, flat::Ast& ast);
+
+// Передаёт handler каждую инструкцию верхнего уровня сразу после её разбора, не дожидаясь
+// конца программы. Вместе с LexerMode::Pipelined позволяет выполнять программу по мере чтения.
+// Константы и методы классов принадлежат дереву программы (flat::Ast), которым совместно
+// владеют инструкции, поэтому handler должен хранить их до конца выполнения программы
+void ParseProgram(parse::Lexer& lexer,
+                  const std::function<void(std::unique_ptr<runtime::Executable>)>& handler);
+
+// Разбирает программу source на thread_count потоках (0 - по числу ядер процессора).
+// Текст делится на участки по инструкциям верхнего уровня, участки разбираются независимо,
+// а результат объединяется в одну составную инструкцию в исходном порядке.
+// Результат и ошибки совпадают с последовательным разбором source.
+// Если задан source_owner, владеющий буфером source, строковые константы ссылаются на буфер
+std::unique_ptr<runtime::Executable> ParseProgramParallel(
+    std::string_view source, size_t thread_count = 0,
+    const std::shared_ptr<const void>& source_owner = nullptr);
+
+// Программа, разобранная по инструкциям верхнего уровня. При замене текста повторно
+// разбираются на лексемы только изменившиеся инструкции, а синтаксически разбираются ещё
+// и инструкции, упоминающие классы, определения которых изменили имя или базовый класс
+class IncrementalProgram : public runtime::Executable {
+public:
+    IncrementalProgram();
+    ~IncrementalProgram() override;
+
+    // Заменяет текст программы на source. Выбрасывает то же исключение, что и разбор source целиком.
+    // После ошибки программа соответствует новому тексту, следующий вызов Update разберёт
+    // ошибочные инструкции заново
+    void Update(std::string_view source);
+
+    // Выполняет программу. Если текст программы содержит ошибку, выбрасывает её
+    runtime::ObjectHolder Execute(runtime::Closure& closure, runtime::Context& context) override;
+
+    // Число инструкций верхнего уровня, разобранных на лексемы при последнем вызове Update
+    [[nodiscard]] size_t LastRelexed() const;
+    // Число инструкций верхнего уровня, синтаксически разобранных при последнем вызове Update
+    [[nodiscard]] size_t LastReparsed() const;
+
+private:
+    struct Block;
+    struct Impl;
+
+    void RethrowFirstError() const;
+
+    std::unique_ptr<Impl> impl_;
+};
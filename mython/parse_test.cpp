@@ -31,6 +31,29 @@ print x + y, z + n
     ASSERT_EQUAL(context.output.str(), "9 hello, world\n"s);
 }
 
+void TestUtf8Program() {
+    const string program = R"(
+class Точка:
+  def __init__(икс, игрек):
+    self.икс = икс
+    self.игрек = игрек
+
+  def __str__():
+    return 'Точка(' + str(self.икс) + '; ' + str(self.игрек) + ')'
+
+начало = Точка(0, 1)
+print начало, "арбуз" < "яблоко"
+)"s;
+
+    runtime::DummyContext context;
+
+    runtime::Closure closure;
+    auto tree = ParseProgramFromString(program);
+    tree->Execute(closure, context);
+
+    ASSERT_EQUAL(context.output.str(), "Точка(0; 1) True\n"s);
+}
+
 void TestProgramWithClasses() {
     const string program = R"(
 program_name = "Classes test"
@@ -266,6 +289,336 @@ x = X(xh)
     ASSERT_EQUAL(xh->Fields().at("x"s).Get(), closure.at("x"s).Get());
 }
 
+
+void TestStreamingLexerProgram() {
+    const string program = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add():
+    self.value = self.value + 1
+
+x = Counter()
+x.add()
+x.add()
+print x.value
+)"s;
+
+    istringstream is(program);
+    parse::Lexer lexer(is, parse::LexerMode::Streaming);
+    auto tree = ParseProgram(lexer);
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    tree->Execute(closure, context);
+
+    ASSERT_EQUAL(context.output.str(), "2\n"s);
+}
+
+void TestPipelinedProgram() {
+    // Инструкции выполняются до того, как лексер дойдёт до ошибки в конце программы
+    istringstream is(R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add():
+    self.value = self.value + 1
+
+x = Counter()
+x.add()
+print x.value
+x.add()
+print x.value
+y = 'unterminated
+)"s);
+    parse::Lexer lexer(is, parse::LexerMode::Pipelined);
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    vector<unique_ptr<runtime::Executable>> executed;
+    ASSERT_THROWS(ParseProgram(lexer,
+                               [&](unique_ptr<runtime::Executable> statement) {
+                                   statement->Execute(closure, context);
+                                   executed.push_back(std::move(statement));
+                               }),
+                  std::logic_error);
+
+    ASSERT_EQUAL(executed.size(), 6u);
+    ASSERT_EQUAL(context.output.str(), "1\n2\n"s);
+}
+
+// Выполняет программу и возвращает её вывод либо текст ошибки
+template <typename Program>
+string RunOrError(Program&& program) {
+    try {
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        program()->Execute(closure, context);
+        return context.output.str();
+    } catch (const std::exception& e) {
+        return "error: "s + e.what();
+    }
+}
+
+void TestStringConstantsShareSource() {
+    auto source = make_shared<const string>("x = 'shared literal'\ny = 'line\\n'\nz = x\n"s);
+    const weak_ptr<const string> weak = source;
+
+    unique_ptr<runtime::Executable> tree;
+    {
+        parse::Lexer lexer(*source, source);
+        tree = ParseProgram(lexer);
+    }
+    source.reset();
+
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    tree->Execute(closure, context);
+
+    // Константа без escape-последовательностей ссылается на текст программы,
+    // дерево разбора удерживает его после уничтожения лексера
+    const auto x = closure.at("x"s).TryAs<runtime::String>()->GetValue();
+    ASSERT_EQUAL(x, "shared literal"s);
+    ASSERT(!weak.expired());
+    const string& text = *weak.lock();
+    ASSERT(x.data() >= text.data() && x.data() < text.data() + text.size());
+    ASSERT(closure.at("z"s).TryAs<runtime::String>()->GetValue().data() == x.data());
+
+    // Константа с escape-последовательностью раскодируется в собственную строку
+    const auto y = closure.at("y"s).TryAs<runtime::String>()->GetValue();
+    ASSERT_EQUAL(y, "line\n"s);
+    ASSERT(y.data() < text.data() || y.data() >= text.data() + text.size());
+}
+
+void TestIncrementalProgram() {
+    const string shapes = R"(class Shape:
+  def __init__(w):
+    self.w = w
+
+  def area():
+    return self.w * self.w
+
+class Square(Shape):
+  def name():
+    return 'square'
+
+s = Square(3)
+print s.name(), s.area()
+)"s;
+
+    IncrementalProgram program;
+    program.Update(shapes);
+    ASSERT_EQUAL(program.LastRelexed(), 4u);
+    ASSERT_EQUAL(RunOrError([&] { return &program; }), "square 9\n"s);
+
+    // Правка тела метода затрагивает только блок класса, объект класса сохраняется
+    string edited = shapes;
+    edited.replace(edited.find("self.w * self.w"s), 15, "self.w + 1"s);
+    program.Update(edited);
+    ASSERT_EQUAL(program.LastRelexed(), 1u);
+    ASSERT_EQUAL(program.LastReparsed(), 1u);
+    ASSERT_EQUAL(RunOrError([&] { return &program; }), "square 4\n"s);
+
+    // Ветка else присоединяется к инструкции if в конце программы
+    program.Update(edited + "if s.area() > 10:\n  print 'big'\n"s);
+    ASSERT_EQUAL(program.LastRelexed(), 1u);
+    const string with_else = edited + "if s.area() > 10:\n  print 'big'\nelse:\n  print 'small'\n"s;
+    program.Update(with_else);
+    ASSERT_EQUAL(program.LastRelexed(), 1u);
+    ASSERT_EQUAL(RunOrError([&] { return &program; }), "square 4\nsmall\n"s);
+
+    // Смена базового класса требует разобрать инструкции, которые используют класс
+    string rebased = with_else;
+    rebased.replace(rebased.find("class Square(Shape)"s), 19, "class Square"s);
+    program.Update(rebased);
+    ASSERT_EQUAL(program.LastRelexed(), 1u);
+    ASSERT_EQUAL(program.LastReparsed(), 2u);
+    ASSERT(RunOrError([&] { return &program; }).substr(0, 7) == "error: "s);
+
+    // Ошибка сохраняется до исправления текста
+    ASSERT_THROWS(program.Update("class Shape:\n  def f():\n    return 1\n"s + rebased), ParseError);
+    program.Update(edited);
+    ASSERT_EQUAL(RunOrError([&] { return &program; }), "square 4\n"s);
+
+    // Последовательность правок даёт тот же результат, что и разбор текста целиком
+    const vector<string> versions = {
+        ""s,
+        "x = 1"s,
+        "x = 1y = 2\nprint y\n"s,
+        "x = 1\ny = 2\nprint x, y\n"s,
+        "# comment\nx = 1\n  y = 2\nprint x\n"s,
+        "# comment\nx = 1\nprint x\n"s,
+        "class A:\n  def f():\n    return 1\na = A()\nprint a.f()\n"s,
+        "a = A()\nclass A:\n  def f():\n    return 1\nprint a.f()\n"s,
+        "class A:\n  def f():\n    return 2\nclass B(A):\n  def g():\n    return 3\nb = B()\nprint b.f(), b.g()\n"s,
+        "class A:\n  def f():\n    return 2\nclass A:\n  def g():\n    return 3\nb = A()\nprint b.g()\n"s,
+        "class C:\n  def f():\n    return 2\nclass A:\n  def g():\n    return 3\nb = A()\nprint b.g()\n"s,
+        "class B:\n  def f():\n    return 4\nclass C(B):\n  def g():\n    return 3\nb = C()\nprint b.f(), b.g()\n"s,
+        "class C(B):\n  def g():\n    return 3\nb = C()\nprint b.f(), b.g()\n"s,
+        "class B:\n  def f():\n    return 5\nclass C(B):\n  def g():\n    return 3\nb = C()\nprint b.f(), b.g()\n"s,
+        "x = 'unterminated\nprint 1\n"s,
+        "x = 'terminated'\nprint x\nif x == 'terminated':\n  print 1\nelse:\n  print 2\n"s,
+    };
+    IncrementalProgram incremental;
+    for (const string& version : versions) {
+        const string expected = RunOrError([&] { return ParseProgramFromString(version); });
+        const string actual = RunOrError([&] {
+            incremental.Update(version);
+            return &incremental;
+        });
+        ASSERT_EQUAL(actual, expected);
+    }
+}
+
+void TestParallelParse() {
+    ostringstream program;
+    program << "class Base:\n  def value():\n    return 1\n\n"s;
+    // Программа длиннее минимального участка, поэтому разбирается по частям
+    for (int i = 0; i < 400; ++i) {
+        program << "# class "s << i << "\nclass Shape"s << i << "(Base):\n"s
+                << "  def __init__(n):\n    self.n = n\n"s
+                << "  def value():\n    return self.n + "s << i << "\n"s
+                << "s"s << i << " = Shape"s << i << "("s << i << ")\n"s
+                << "if s"s << i << ".value() > 50:\n  print 'big', s"s << i << ".value()\n"s
+                << "else:\n  b = Base()\n  print b.value()\n"s;
+    }
+    const string source = program.str();
+    ASSERT(SplitTopLevel(source, 16 * 1024).size() > 1);
+
+    runtime::DummyContext expected;
+    {
+        runtime::Closure closure;
+        ParseProgramFromString(source)->Execute(closure, expected);
+    }
+    for (size_t threads : {1u, 4u}) {
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        auto tree = ParseProgramParallel(source, threads);
+        tree->Execute(closure, context);
+        ASSERT_EQUAL(context.output.str(), expected.output.str());
+    }
+
+    // Ошибки совпадают с последовательным разбором, даже если классы в разных участках
+    const string padding(20 * 1024, '\n');
+    ASSERT_THROWS(ParseProgramParallel("x = A()\n"s + padding + "class A:\n  def f():\n    return 1\n"s, 2),
+                  ParseError);
+    ASSERT_THROWS(ParseProgramParallel("class B(A):\n  def f():\n    return 1\n"s + padding
+                                           + "class A:\n  def f():\n    return 1\n"s, 2),
+                  ParseError);
+    ASSERT_THROWS(ParseProgramParallel("class A:\n  def f():\n    return 1\n"s + padding
+                                           + "class A:\n  def f():\n    return 1\n"s, 2),
+                  ParseError);
+    ASSERT_THROWS(ParseProgramParallel("x = 1\n"s + padding + "y = 'unterminated\n"s, 2),
+                  std::logic_error);
+}
+
+void TestLazyMethods() {
+    const string classes = R"(
+class Shape:
+  def __init__(name):
+    self.name = name
+  def describe():
+    if self.name == 'square':
+      return 'four sides'
+    return 'unknown'
+  def broken():
+    return self.name +
+
+class Square(Shape):
+  def __init__():
+    self.name = 'square'
+  def make_shape(name):
+    return Shape(name)
+  def make_later():
+    return Later()
+  def count(n):
+    if n > 0:
+      return self.count(n - 1) + 1
+    return 0
+
+class Later:
+  def value():
+    return 1
+
+s = Square()
+t = s.make_shape('inner')
+)"s;
+    const auto run = [&classes](const string& statements) {
+        return RunOrError([&]() {
+            auto source = std::make_shared<const string>(classes + statements);
+            auto lexer = std::make_shared<parse::Lexer>(*source, source);
+            return ParseProgramLazy(lexer);
+        });
+    };
+
+    ASSERT_EQUAL(run("print s.describe(), t.describe(), t.name, s.count(5)\n"s),
+                 "four sides unknown inner 5\n"s);
+    // Ошибки в телах методов обнаруживаются только при их вызове
+    ASSERT_EQUAL(run("print s.broken()\n"s), "error: parse::Expect is not valid"s);
+    // Тело видит только классы, объявленные до метода, как и при обычном разборе
+    ASSERT_EQUAL(run("l = Later()\nprint l.value()\nprint s.make_later()\n"s),
+                 "error: Unknown call to Later()"s);
+    ASSERT_THROWS(ParseProgramFromString(classes), std::runtime_error);
+
+    // Синтаксическая ошибка в структуре отступов обнаруживается при разборе программы
+    ASSERT_EQUAL(run("class Bad:\n  def f():\n"s), "error: parse::Expect is not valid"s);
+}
+
+void TestOperatorPrecedence() {
+    const auto run = [](const string& program) {
+        return RunOrError([&program]() {
+            return ParseProgramFromString(program);
+        });
+    };
+    ASSERT_EQUAL(run("print 10 - 2 - 3, 2 + 3 * 4 - 6 / 2, -2 * 3 + 4, -(2 + 3) * 2, 2 - -1\n"s),
+                 "5 11 -2 -10 3\n"s);
+    ASSERT_EQUAL(run("x = 0\nprint not x < 1 and 3, not x or x, (1 < 2) == True, not (x)\n"s),
+                 "False True True True\n"s);
+    ASSERT_EQUAL(run("print str(1 + 2) + str(str(3) + 'x'), str((4))\n"s), "33x 4\n"s);
+    // Сравнения не объединяются в цепочки, а NOT не может быть операндом арифметики
+    ASSERT(run("print 1 < 2 < 3\n"s).find("error: "s) == 0);
+    ASSERT(run("print 1 + not 2\n"s).find("error: "s) == 0);
+    ASSERT(run("print (1 + 2\n"s).find("error: "s) == 0);
+}
+
+void TestLongAndDeepExpressions() {
+    const size_t terms = 1'000'000;
+    const size_t depth = 100'000;
+    const auto repeat = [](string_view text, size_t count) {
+        string result;
+        result.reserve(text.size() * count);
+        for (size_t i = 0; i < count; ++i) {
+            result += text;
+        }
+        return result;
+    };
+
+    // Левоассоциативная сумма из миллиона слагаемых
+    string sum = "x = 1"s + repeat(" + x"sv, terms - 1) + "\n"s;
+    {
+        parse::Lexer lexer{string_view{sum}};
+        flat::Ast ast;
+        ParseProgram(lexer, ast);
+        // Переменные, операции сложения, присваивание и корневая инструкция
+        ASSERT_EQUAL(ast.NodeCount(), 2 * terms + 1);
+    }
+
+    // Глубоко вложенные скобки, унарные минусы, вызовы и логические операции
+    string program = "x = 1"s + repeat(" + 1"sv, terms - 1) + "\nprint x\n"s;
+    program += "print "s + repeat("("sv, depth) + "1"s + repeat(")"sv, depth) + "\n"s;
+    program += "print "s + repeat("-("sv, depth) + "1"s + repeat(")"sv, depth) + "\n"s;
+    program += "print "s + repeat("(1 + "sv, depth) + "1"s + repeat(")"sv, depth) + "\n"s;
+    program += "print "s + repeat("str("sv, depth) + "1"s + repeat(")"sv, depth) + "\n"s;
+    program += "print "s + repeat("not "sv, depth + 1) + "1\n"s;
+    ASSERT_EQUAL(RunOrError([&program]() {
+                     parse::Lexer lexer{string_view{program}};
+                     return ParseProgram(lexer);
+                 }),
+                 "1000000\n1\n1\n100001\n1\nFalse\n"s);
+}
+
 }  // namespace parse
 
 void TestParseProgram(TestRunner& tr) {
@@ -278,4 +631,13 @@ void TestParseProgram(TestRunner& tr) {
     RUN_TEST(tr, parse::TestComplexLogicalExpression);
     RUN_TEST(tr, parse::TestClassicalPolymorphism);
     RUN_TEST(tr, parse::TestSelfInConstructor);
+    RUN_TEST(tr, parse::TestStreamingLexerProgram);
+    RUN_TEST(tr, parse::TestPipelinedProgram);
+    RUN_TEST(tr, parse::TestUtf8Program);
+    RUN_TEST(tr, parse::TestStringConstantsShareSource);
+    RUN_TEST(tr, parse::TestIncrementalProgram);
+    RUN_TEST(tr, parse::TestParallelParse);
+    RUN_TEST(tr, parse::TestLazyMethods);
+    RUN_TEST(tr, parse::TestOperatorPrecedence);
+    RUN_TEST(tr, parse::TestLongAndDeepExpressions);
 }
\ No newline at end of file
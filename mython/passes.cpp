@@ -0,0 +1,2125 @@
+#include "passes.h"
+
+#include <array>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+namespace flat {
+
+using runtime::ObjectHolder;
+
+namespace {
+
+// Значение узла, известное до выполнения: константа либо None
+optional<ObjectHolder> KnownValue(const Ast& ast, NodeId node) {
+    switch (ast.Kind(node)) {
+    case NodeKind::Constant:
+        return ast.Constant(ast.GetOperands(node).a);
+    case NodeKind::None:
+        return ObjectHolder::None();
+    default:
+        return nullopt;
+    }
+}
+
+// Результат арифметической операции над числами, если он определён и помещается в int.
+// Деление на ноль остаётся ошибкой времени выполнения
+optional<int> FoldArithmetic(NodeKind kind, int64_t lhs, int64_t rhs) {
+    int64_t result = 0;
+    switch (kind) {
+    case NodeKind::Add:
+        result = lhs + rhs;
+        break;
+    case NodeKind::Sub:
+        result = lhs - rhs;
+        break;
+    case NodeKind::Mult:
+        result = lhs * rhs;
+        break;
+    case NodeKind::Div:
+        if (rhs == 0) {
+            return nullopt;
+        }
+        result = lhs / rhs;
+        break;
+    default:
+        return nullopt;
+    }
+    if (result < numeric_limits<int>::min() || result > numeric_limits<int>::max()) {
+        return nullopt;
+    }
+    return static_cast<int>(result);
+}
+
+optional<ObjectHolder> FoldBinary(NodeKind kind, const ObjectHolder& lhs, const ObjectHolder& rhs) {
+    const auto* n_lhs = lhs.TryAs<runtime::Number>();
+    const auto* n_rhs = rhs.TryAs<runtime::Number>();
+    if (n_lhs != nullptr && n_rhs != nullptr) {
+        if (auto result = FoldArithmetic(kind, n_lhs->GetValue(), n_rhs->GetValue())) {
+            return ObjectHolder::Own(runtime::Number(*result));
+        }
+    }
+    if (kind == NodeKind::Add) {
+        const auto* s_lhs = lhs.TryAs<runtime::String>();
+        const auto* s_rhs = rhs.TryAs<runtime::String>();
+        if (s_lhs != nullptr && s_rhs != nullptr) {
+            string result;
+            result.reserve(s_lhs->GetValue().size() + s_rhs->GetValue().size());
+            result.append(s_lhs->GetValue()).append(s_rhs->GetValue());
+            return ObjectHolder::Own(runtime::String(std::move(result)));
+        }
+    }
+    return nullopt;
+}
+
+optional<ObjectHolder> FoldComparison(NodeKind kind, const ObjectHolder& lhs,
+                                      const ObjectHolder& rhs) {
+    // Константы - числа, строки, логические значения и None, их сравнение не вызывает методов.
+    // Несравнимые значения оставляются ошибке времени выполнения
+    runtime::DummyContext context;
+    try {
+        bool result = false;
+        switch (kind) {
+        case NodeKind::Less:
+            result = runtime::Less(lhs, rhs, context);
+            break;
+        case NodeKind::Greater:
+            result = runtime::Greater(lhs, rhs, context);
+            break;
+        case NodeKind::Equal:
+            result = runtime::Equal(lhs, rhs, context);
+            break;
+        case NodeKind::NotEqual:
+            result = runtime::NotEqual(lhs, rhs, context);
+            break;
+        case NodeKind::LessOrEqual:
+            result = runtime::LessOrEqual(lhs, rhs, context);
+            break;
+        case NodeKind::GreaterOrEqual:
+            result = runtime::GreaterOrEqual(lhs, rhs, context);
+            break;
+        default:
+            return nullopt;
+        }
+        return ObjectHolder::Own(runtime::Bool(result));
+    } catch (const runtime_error&) {
+        return nullopt;
+    }
+}
+
+ObjectHolder FoldStringify(const ObjectHolder& value) {
+    if (!value) {
+        return ObjectHolder::Own(runtime::String("None"s));
+    }
+    runtime::DummyContext context;
+    value->Print(context.output, context);
+    return ObjectHolder::Own(runtime::String(context.output.str()));
+}
+
+// Значение узла node после свёртки его аргументов либо nullopt, если узел не сворачивается
+optional<ObjectHolder> Fold(const Ast& ast, NodeId node) {
+    const NodeKind kind = ast.Kind(node);
+    const Operands& op = ast.GetOperands(node);
+    switch (kind) {
+    case NodeKind::Add:
+    case NodeKind::Sub:
+    case NodeKind::Mult:
+    case NodeKind::Div: {
+        const auto lhs = KnownValue(ast, op.a);
+        const auto rhs = lhs ? KnownValue(ast, op.b) : nullopt;
+        return rhs ? FoldBinary(kind, *lhs, *rhs) : nullopt;
+    }
+    case NodeKind::Less:
+    case NodeKind::Greater:
+    case NodeKind::Equal:
+    case NodeKind::NotEqual:
+    case NodeKind::LessOrEqual:
+    case NodeKind::GreaterOrEqual: {
+        const auto lhs = KnownValue(ast, op.a);
+        const auto rhs = lhs ? KnownValue(ast, op.b) : nullopt;
+        return rhs ? FoldComparison(kind, *lhs, *rhs) : nullopt;
+    }
+    case NodeKind::Not:
+        if (const auto value = KnownValue(ast, op.a)) {
+            return ObjectHolder::Own(runtime::Bool(IsFalseValue(*value)));
+        }
+        return nullopt;
+    case NodeKind::Or:
+    case NodeKind::And: {
+        // Результат известен по левому аргументу, если правый не вычисляется.
+        // Иначе нужен и правый аргумент: результатом or и and всегда является Bool
+        const auto lhs = KnownValue(ast, op.a);
+        if (!lhs) {
+            return nullopt;
+        }
+        const bool lhs_true = runtime::IsTrue(*lhs);
+        if (lhs_true == (kind == NodeKind::Or)) {
+            return ObjectHolder::Own(runtime::Bool(lhs_true));
+        }
+        if (const auto rhs = KnownValue(ast, op.b)) {
+            return ObjectHolder::Own(runtime::Bool(runtime::IsTrue(*rhs)));
+        }
+        return nullopt;
+    }
+    case NodeKind::Stringify:
+        if (const auto value = KnownValue(ast, op.a)) {
+            return FoldStringify(*value);
+        }
+        return nullopt;
+    default:
+        return nullopt;
+    }
+}
+
+// Вызывает visit для каждого дочернего узла node
+template <typename Visitor>
+void ForEachChild(const Ast& ast, NodeId node, Visitor&& visit) {
+    const Operands& op = ast.GetOperands(node);
+    switch (ast.Kind(node)) {
+    case NodeKind::Constant:
+    case NodeKind::None:
+    case NodeKind::Variable:
+    case NodeKind::LocalVariable:
+    case NodeKind::ClassDefinition:
+    case NodeKind::ReturnLocal:
+        break;
+    case NodeKind::Assignment:
+    case NodeKind::LocalAssignment:
+    case NodeKind::ScratchAssignment:
+    case NodeKind::LocalIncrement:
+        visit(op.b);
+        break;
+    case NodeKind::FieldAssignment:
+    case NodeKind::FieldIncrement:
+        visit(op.a);
+        visit(op.c);
+        break;
+    case NodeKind::Print:
+    case NodeKind::Compound:
+        for (NodeId child : ast.List(op.a)) {
+            visit(child);
+        }
+        break;
+    case NodeKind::MethodCall:
+    case NodeKind::BoundMethodCall:
+        visit(op.a);
+        for (NodeId child : ast.List(op.c)) {
+            visit(child);
+        }
+        break;
+    case NodeKind::NewInstance:
+        for (NodeId child : ast.List(op.b)) {
+            visit(child);
+        }
+        break;
+    case NodeKind::Stringify:
+    case NodeKind::Not:
+    case NodeKind::Return:
+        visit(op.a);
+        break;
+    case NodeKind::IfElse:
+        visit(op.a);
+        visit(op.b);
+        if (op.c != NO_NODE) {
+            visit(op.c);
+        }
+        break;
+    default:
+        // Бинарные операции, сравнения и встроенный вызов: исходный вызов и копия тела
+        visit(op.a);
+        visit(op.b);
+        break;
+    }
+}
+
+// Число узлов поддерева node. Обход без рекурсии, так как вложенность может быть большой
+size_t SubtreeSize(const Ast& ast, NodeId node) {
+    size_t size = 0;
+    vector<NodeId> stack{node};
+    while (!stack.empty()) {
+        const NodeId current = stack.back();
+        stack.pop_back();
+        ++size;
+        ForEachChild(ast, current, [&stack](NodeId child) {
+            stack.push_back(child);
+        });
+    }
+    return size;
+}
+
+// Выполнение инструкции node всегда завершается инструкцией return.
+// Вложенные инструкции уже обработаны, поэтому return может быть только последней инструкцией
+bool AlwaysReturns(const Ast& ast, NodeId node) {
+    const Operands& op = ast.GetOperands(node);
+    switch (ast.Kind(node)) {
+    case NodeKind::Return:
+    case NodeKind::ReturnLocal:
+        return true;
+    case NodeKind::Compound: {
+        const ListView statements = ast.List(op.a);
+        return !statements.empty() && AlwaysReturns(ast, statements[statements.size() - 1]);
+    }
+    case NodeKind::IfElse:
+        return op.c != NO_NODE && AlwaysReturns(ast, op.b) && AlwaysReturns(ast, op.c);
+    default:
+        return false;
+    }
+}
+
+bool IsEmptyCompound(const Ast& ast, NodeId node) {
+    return ast.Kind(node) == NodeKind::Compound && ast.List(ast.GetOperands(node).a).empty();
+}
+
+// Заменяет условную инструкцию с константным условием выполняемой веткой.
+// Возвращает число узлов, ставших недостижимыми
+size_t EliminateBranch(Ast& ast, NodeId node) {
+    const Operands op = ast.GetOperands(node);
+    const auto condition = KnownValue(ast, op.a);
+    if (!condition) {
+        return 0;
+    }
+    const bool taken_if = runtime::IsTrue(*condition);
+    const NodeId taken = taken_if ? op.b : op.c;
+    const NodeId dropped = taken_if ? op.c : op.b;
+    size_t removed = SubtreeSize(ast, op.a) + (dropped != NO_NODE ? SubtreeSize(ast, dropped) : 0);
+    if (taken == NO_NODE) {
+        ast.SetNode(node, NodeKind::Compound, {ast.AddList(nullptr, nullptr)});
+    } else {
+        // Узел ветки копируется на место условной инструкции, сам узел ветки становится недостижим
+        ast.SetNode(node, ast.Kind(taken), ast.GetOperands(taken));
+        ++removed;
+    }
+    return removed;
+}
+
+// Удаляет из составной инструкции пустые составные инструкции, оставшиеся от удалённых веток,
+// и инструкции после return. Возвращает число удалённых узлов
+size_t PruneCompound(Ast& ast, NodeId node) {
+    const ListId list = ast.GetOperands(node).a;
+    const ListView statements = ast.List(list);
+    vector<NodeId> kept;
+    size_t removed = 0;
+    for (size_t i = 0; i < statements.size(); ++i) {
+        const NodeId statement = statements[i];
+        if (IsEmptyCompound(ast, statement)) {
+            ++removed;
+            continue;
+        }
+        kept.push_back(statement);
+        if (AlwaysReturns(ast, statement)) {
+            for (size_t j = i + 1; j < statements.size(); ++j) {
+                removed += SubtreeSize(ast, statements[j]);
+            }
+            break;
+        }
+    }
+    if (removed > 0) {
+        ast.SetList(list, kept.data(), kept.data() + kept.size());
+    }
+    return removed;
+}
+
+// Размещает переменные метода в ячейках. Возвращает число заменённых обращений
+// либо nullopt, если метод нельзя перевести на ячейки
+optional<size_t> ResolveMethod(Ast& ast, uint32_t method) {
+    const MethodInfo& info = ast.Method(method);
+    vector<NodeId> nodes;
+    vector<NodeId> stack{info.body};
+    while (!stack.empty()) {
+        const NodeId node = stack.back();
+        stack.pop_back();
+        if (ast.Kind(node) == NodeKind::ClassDefinition) {
+            return nullopt;
+        }
+        nodes.push_back(node);
+        ForEachChild(ast, node, [&stack](NodeId child) {
+            stack.push_back(child);
+        });
+    }
+
+    unordered_map<uint32_t, uint32_t> slots;
+    slots[ast.AddName("self"sv)] = 0;
+    for (size_t i = 0; i < info.params.size(); ++i) {
+        // При повторе имени параметра, как и в Closure, действует последний
+        slots[info.params[i]] = static_cast<uint32_t>(i + 1);
+    }
+    auto slot_count = static_cast<uint32_t>(info.params.size() + 1);
+    // Переменная, которой метод не присваивает значение, тоже получает ячейку,
+    // чтобы обращение к ней, как и прежде, вызывало ошибку при выполнении
+    const auto slot_of = [&](uint32_t name) {
+        auto [it, inserted] = slots.try_emplace(name, slot_count);
+        if (inserted) {
+            ++slot_count;
+        }
+        return it->second;
+    };
+
+    size_t resolved = 0;
+    for (NodeId node : nodes) {
+        const Operands op = ast.GetOperands(node);
+        if (ast.Kind(node) == NodeKind::Variable) {
+            ast.SetNode(node, NodeKind::LocalVariable, {op.a, slot_of(ast.List(op.a)[0])});
+            ++resolved;
+        } else if (ast.Kind(node) == NodeKind::Assignment) {
+            ast.SetNode(node, NodeKind::LocalAssignment, {op.a, op.b, slot_of(op.a)});
+            ++resolved;
+        }
+    }
+    ast.SetSlotCount(method, slot_count);
+    return resolved;
+}
+
+// Иерархия классов, определённых в обрабатываемой части дерева
+class ClassHierarchy {
+public:
+    ClassHierarchy(const Ast& ast, NodeId first) {
+        for (auto node = first; node < ast.NodeCount(); ++node) {
+            if (ast.Kind(node) != NodeKind::ClassDefinition) {
+                continue;
+            }
+            const auto* cls = ast.Constant(ast.GetOperands(node).a).TryAs<runtime::Class>();
+            if (!known_.insert(cls).second) {
+                continue;
+            }
+            classes_.push_back(cls);
+            for (const runtime::Method& method : cls->GetMethods()) {
+                implementations_[method.name].push_back(cls);
+                // Базовый класс задаётся при создании класса, поэтому цепочку предков читать безопасно
+                for (const runtime::Class* base = cls->GetParent(); base != nullptr;
+                     base = base->GetParent()) {
+                    overridden_[method.name].insert(base);
+                }
+            }
+        }
+    }
+
+    // Классы в порядке определения
+    [[nodiscard]] const vector<const runtime::Class*>& Classes() const {
+        return classes_;
+    }
+
+    // Метод name класса cls либо nullptr, если его нельзя найти, не выходя за известные классы
+    [[nodiscard]] const runtime::Method* Resolve(const runtime::Class* cls, const string& name) const {
+        for (; cls != nullptr && known_.count(cls) > 0; cls = cls->GetParent()) {
+            for (const runtime::Method& method : cls->GetMethods()) {
+                if (method.name == name) {
+                    return &method;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Переопределяет ли метод name известный потомок класса cls
+    [[nodiscard]] bool IsOverridden(const runtime::Class* cls, const string& name) const {
+        const auto it = overridden_.find(name);
+        return it != overridden_.end() && it->second.count(cls) > 0;
+    }
+
+    // Единственный известный класс, определяющий метод name, либо nullptr
+    [[nodiscard]] const runtime::Class* UniqueImplementation(const string& name) const {
+        const auto it = implementations_.find(name);
+        return it != implementations_.end() && it->second.size() == 1 ? it->second.front() : nullptr;
+    }
+
+private:
+    vector<const runtime::Class*> classes_;
+    unordered_set<const runtime::Class*> known_;
+    unordered_map<string, vector<const runtime::Class*>> implementations_;
+    // Классы, метод которых переопределяет известный потомок, по имени метода
+    unordered_map<string, unordered_set<const runtime::Class*>> overridden_;
+};
+
+// Узел - обращение к переменной self без полей
+bool IsSelf(const Ast& ast, NodeId node, uint32_t self_name) {
+    const NodeKind kind = ast.Kind(node);
+    if (kind != NodeKind::Variable && kind != NodeKind::LocalVariable) {
+        return false;
+    }
+    const ListView names = ast.List(ast.GetOperands(node).a);
+    return names.size() == 1 && names[0] == self_name;
+}
+
+// Добавляет в self_calls вызовы методов через self из методов класса cls, тела которых
+// находятся в дереве. Методы, присваивающие self другое значение, пропускаются
+void FindSelfCalls(const Ast& ast, const runtime::Class* cls, uint32_t self_name,
+                   unordered_map<NodeId, const runtime::Class*>& self_calls) {
+    vector<NodeId> calls;
+    vector<NodeId> stack;
+    for (const runtime::Method& method : cls->GetMethods()) {
+        const auto* body = dynamic_cast<const MethodBody*>(method.body.get());
+        if (body == nullptr || body->Tree() != &ast) {
+            continue;
+        }
+        calls.clear();
+        stack.assign(1, ast.Method(body->MethodIndex()).body);
+        bool assigns_self = false;
+        while (!stack.empty()) {
+            const NodeId node = stack.back();
+            stack.pop_back();
+            const NodeKind kind = ast.Kind(node);
+            if ((kind == NodeKind::Assignment || kind == NodeKind::LocalAssignment
+                 || kind == NodeKind::ScratchAssignment || kind == NodeKind::LocalIncrement)
+                && ast.GetOperands(node).a == self_name) {
+                assigns_self = true;
+                break;
+            }
+            if (kind == NodeKind::MethodCall && IsSelf(ast, ast.GetOperands(node).a, self_name)) {
+                calls.push_back(node);
+            }
+            ForEachChild(ast, node, [&stack](NodeId child) {
+                stack.push_back(child);
+            });
+        }
+        if (!assigns_self) {
+            for (NodeId call : calls) {
+                self_calls.emplace(call, cls);
+            }
+        }
+    }
+}
+
+// Объект или аргумент встраиваемого вызова: константа, None либо переменная без полей
+bool IsPlainValue(const Ast& ast, NodeId node) {
+    switch (ast.Kind(node)) {
+    case NodeKind::Constant:
+    case NodeKind::None:
+        return true;
+    case NodeKind::Variable:
+    case NodeKind::LocalVariable:
+        return ast.List(ast.GetOperands(node).a).size() == 1;
+    default:
+        return false;
+    }
+}
+
+// Копирует тело метода на место вызова, заменяя self и параметры объектом и аргументами
+class Inliner {
+public:
+    Inliner(Ast& ast, uint32_t self_name)
+        : ast_(ast)
+        , self_name_(self_name) {
+    }
+
+    // Копия тела метода site для вызова call либо nullopt, если вызов не встраивается
+    optional<NodeId> Inline(const CallSite& site, const Operands& call, size_t max_nodes) {
+        const MethodInfo& info = ast_.Method(site.body->MethodIndex());
+        const ListView args = ast_.List(call.c);
+        if (!IsVariable(call.a) || !IsPlainValue(ast_, call.a) || args.size() != info.params.size()
+            || SubtreeSize(ast_, info.body) > max_nodes) {
+            return nullopt;
+        }
+        substitutions_.clear();
+        substitutions_[self_name_] = call.a;
+        receiver_ = call.a;
+        // Номер аргумента, который является выражением общего вида
+        optional<size_t> computed;
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (!IsPlainValue(ast_, args[i])) {
+                if (computed) {
+                    return nullopt;
+                }
+                computed = i;
+            }
+            // При повторе имени параметра, как и в Closure, действует последний
+            substitutions_[info.params[i]] = args[i];
+        }
+
+        // Тело из одной инструкции return заменяется её значением
+        NodeId body = info.body;
+        if (ast_.Kind(body) == NodeKind::Compound) {
+            const ListView statements = ast_.List(ast_.GetOperands(body).a);
+            if (statements.size() == 1 && ast_.Kind(statements[0]) == NodeKind::Return) {
+                body = ast_.GetOperands(statements[0]).a;
+            }
+        }
+        if (!CanCopy(body, site.name)) {
+            return nullopt;
+        }
+        // Выражение вычисляется в копии тела на месте единственного обращения к параметру
+        if (computed && uses_[info.params[*computed]] != 1) {
+            return nullopt;
+        }
+        // Вызов вычисляет аргументы раньше тела, а чтение неопределённой переменной - ошибка.
+        // Поэтому в копии тела аргументы-переменные и выражение должны вычисляться в порядке
+        // аргументов и до побочных эффектов и чтения полей: до обращения к параметру тело может
+        // только читать константы и параметры предыдущих таких аргументов
+        ordered_.clear();
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (IsVariable(args[i]) || i == computed) {
+                if (substitutions_[info.params[i]] != args[i]) {
+                    return nullopt;
+                }
+                ordered_.push_back(info.params[i]);
+            }
+        }
+        for (size_t i = 0; i < ordered_.size(); ++i) {
+            next_ordered_ = i + 1;
+            if (FindFirst(body, ordered_[i]) != Order::Found) {
+                return nullopt;
+            }
+        }
+        return Copy(body);
+    }
+
+private:
+    // Результат поиска обращения к параметру в порядке вычисления
+    enum class Order {
+        // Поддерево вычислено без побочных эффектов и чтения полей, обращение не найдено
+        Pure,
+        // Обращение вычисляется до побочных эффектов и чтения полей
+        Found,
+        // Обращению предшествует действие, которое может зависеть от вычисления аргумента
+        // или повлиять на него, либо обращение выполняется не всегда
+        Impure,
+    };
+
+    // Ищет обращение к параметру name в поддереве node в порядке вычисления узлов
+    Order FindFirst(NodeId node, uint32_t name) const {
+        const Operands& op = ast_.GetOperands(node);
+        // Вычисляет операнды по порядку. Действие самого узла выполняется после операндов
+        const auto sequence = [this, name](auto begin, auto end) {
+            for (; begin != end; ++begin) {
+                if (const Order order = FindFirst(*begin, name); order != Order::Pure) {
+                    return order;
+                }
+            }
+            return Order::Impure;
+        };
+        switch (ast_.Kind(node)) {
+        case NodeKind::Constant:
+        case NodeKind::None:
+            return Order::Pure;
+        case NodeKind::Variable:
+        case NodeKind::LocalVariable: {
+            const ListView names = ast_.List(op.a);
+            if (names[0] == name) {
+                return Order::Found;
+            }
+            // Параметр следующего аргумента вычислялся бы раньше параметра name
+            if (find(ordered_.begin() + next_ordered_, ordered_.end(), names[0]) != ordered_.end()) {
+                return Order::Impure;
+            }
+            return names.size() == 1 ? Order::Pure : Order::Impure;
+        }
+        case NodeKind::Compound: {
+            for (NodeId statement : ast_.List(op.a)) {
+                if (const Order order = FindFirst(statement, name); order != Order::Pure) {
+                    return order;
+                }
+            }
+            return Order::Pure;
+        }
+        case NodeKind::FieldAssignment: {
+            const array<NodeId, 2> operands{op.a, op.c};
+            return sequence(operands.begin(), operands.end());
+        }
+        case NodeKind::Print: {
+            // Значения печатаются по мере вычисления, поэтому после первого аргумента
+            // выполняется вывод
+            const ListView args = ast_.List(op.a);
+            return sequence(args.begin(), args.begin() + min<size_t>(args.size(), 1));
+        }
+        case NodeKind::NewInstance: {
+            const ListView args = ast_.List(op.b);
+            return sequence(args.begin(), args.end());
+        }
+        case NodeKind::MethodCall:
+        case NodeKind::BoundMethodCall: {
+            // Как и при выполнении, аргументы вычисляются раньше объекта
+            vector<NodeId> operands(ast_.List(op.c).begin(), ast_.List(op.c).end());
+            operands.push_back(op.a);
+            return sequence(operands.begin(), operands.end());
+        }
+        case NodeKind::Stringify:
+        case NodeKind::Not:
+            return sequence(&op.a, &op.a + 1);
+        case NodeKind::FieldIncrement:
+            // Поле объекта читается до вычисления слагаемого
+            return sequence(&op.a, &op.a + 1);
+        case NodeKind::Add:
+        case NodeKind::Sub:
+        case NodeKind::Mult:
+        case NodeKind::Div:
+        case NodeKind::Less:
+        case NodeKind::Greater:
+        case NodeKind::Equal:
+        case NodeKind::NotEqual:
+        case NodeKind::LessOrEqual:
+        case NodeKind::GreaterOrEqual: {
+            const array<NodeId, 2> operands{op.a, op.b};
+            return sequence(operands.begin(), operands.end());
+        }
+        default:
+            // Условные инструкции, and, or и встроенные вызовы вычисляют часть операндов
+            // не всегда
+            return Order::Impure;
+        }
+    }
+
+    [[nodiscard]] bool IsVariable(NodeId node) const {
+        const NodeKind kind = ast_.Kind(node);
+        return kind == NodeKind::Variable || kind == NodeKind::LocalVariable;
+    }
+
+    // Тело можно скопировать на место вызова: оно обращается только к self и параметрам,
+    // не присваивает переменным, не содержит return и не вызывает метод с именем name
+    bool CanCopy(NodeId body, uint32_t name) {
+        uses_.clear();
+        vector<NodeId> stack{body};
+        while (!stack.empty()) {
+            const NodeId node = stack.back();
+            stack.pop_back();
+            const Operands& op = ast_.GetOperands(node);
+            switch (ast_.Kind(node)) {
+            case NodeKind::Assignment:
+            case NodeKind::LocalAssignment:
+            case NodeKind::ScratchAssignment:
+            case NodeKind::LocalIncrement:
+            case NodeKind::Return:
+            case NodeKind::ReturnLocal:
+            case NodeKind::ClassDefinition:
+                return false;
+            case NodeKind::Variable:
+            case NodeKind::LocalVariable: {
+                // Поля читаются только у объекта вызова: он проверен встроенным вызовом,
+                // а ошибка чтения поля аргумента называла бы переменную вызывающего метода
+                const ListView names = ast_.List(op.a);
+                const auto it = substitutions_.find(names[0]);
+                if (it == substitutions_.end() || (names.size() > 1 && it->second != receiver_)) {
+                    return false;
+                }
+                ++uses_[names[0]];
+                break;
+            }
+            case NodeKind::MethodCall:
+                if (op.b == name) {
+                    return false;
+                }
+                break;
+            case NodeKind::BoundMethodCall:
+                if (ast_.GetCallSite(op.b).name == name) {
+                    return false;
+                }
+                break;
+            default:
+                break;
+            }
+            ForEachChild(ast_, node, [&stack](NodeId child) {
+                stack.push_back(child);
+            });
+        }
+        return true;
+    }
+
+    // Копирует поддерево node. Дочерние узлы копии добавляются раньше родительских.
+    // Если substitute, обращения к self и параметрам заменяются объектом и аргументами вызова.
+    // Размер тела ограничен, а аргумент общего вида - выражение, поэтому глубина рекурсии невелика
+    NodeId Copy(NodeId node, bool substitute = true) {
+        const NodeKind kind = ast_.Kind(node);
+        const Operands op = ast_.GetOperands(node);
+        switch (kind) {
+        case NodeKind::Constant:
+        case NodeKind::None:
+            return ast_.AddNode(kind, op);
+        case NodeKind::Variable:
+        case NodeKind::LocalVariable:
+            return substitute ? Substitute(node) : ast_.AddNode(kind, op);
+        case NodeKind::FieldAssignment:
+        case NodeKind::FieldIncrement:
+            return ast_.AddNode(kind, {Copy(op.a, substitute), op.b, Copy(op.c, substitute)});
+        case NodeKind::Print:
+        case NodeKind::Compound:
+            return ast_.AddNode(kind, {CopyList(op.a, substitute)});
+        case NodeKind::MethodCall:
+        case NodeKind::BoundMethodCall:
+            return ast_.AddNode(kind, {Copy(op.a, substitute), op.b, CopyList(op.c, substitute)});
+        case NodeKind::NewInstance:
+            return ast_.AddNode(kind, {op.a, CopyList(op.b, substitute)});
+        case NodeKind::Stringify:
+        case NodeKind::Not:
+            return ast_.AddNode(kind, {Copy(op.a, substitute)});
+        case NodeKind::IfElse:
+            return ast_.AddNode(kind, {Copy(op.a, substitute), Copy(op.b, substitute),
+                                       op.c != NO_NODE ? Copy(op.c, substitute) : NO_NODE});
+        case NodeKind::InlinedCall:
+            return ast_.AddNode(kind, {Copy(op.a, substitute), Copy(op.b, substitute), op.c});
+        default:
+            // Бинарные операции и сравнения
+            return ast_.AddNode(kind, {Copy(op.a, substitute), Copy(op.b, substitute)});
+        }
+    }
+
+    ListId CopyList(ListId list, bool substitute) {
+        // Добавление узлов и списков перемещает массив списков, поэтому элементы копируются заранее
+        const ListView items = ast_.List(list);
+        vector<uint32_t> copies(items.begin(), items.end());
+        for (uint32_t& item : copies) {
+            item = Copy(item, substitute);
+        }
+        return ast_.AddList(copies.data(), copies.data() + copies.size());
+    }
+
+    // Обращение к self или параметру заменяется объектом или аргументом вызова.
+    // Аргумент общего вида используется в теле один раз. Копия тела получает свою копию
+    // аргумента: проходы изменяют узлы на месте и считают дерево деревом, а не графом
+    // с общими узлами
+    NodeId Substitute(NodeId node) {
+        const ListView names = ast_.List(ast_.GetOperands(node).a);
+        const NodeId value = substitutions_.at(names[0]);
+        if (names.size() == 1 && !IsPlainValue(ast_, value)) {
+            return Copy(value, false);
+        }
+        Operands op = ast_.GetOperands(value);
+        if (names.size() > 1) {
+            const ListView prefix = ast_.List(op.a);
+            vector<uint32_t> chain(prefix.begin(), prefix.end());
+            chain.insert(chain.end(), names.begin() + 1, names.end());
+            op.a = ast_.AddList(chain.data(), chain.data() + chain.size());
+        }
+        return ast_.AddNode(ast_.Kind(value), op);
+    }
+
+    Ast& ast_;
+    const uint32_t self_name_;
+    NodeId receiver_ = NO_NODE;
+    // Узлы объекта и аргументов вызова по индексам имён self и параметров
+    unordered_map<uint32_t, NodeId> substitutions_;
+    // Число обращений к self и параметрам в теле
+    unordered_map<uint32_t, size_t> uses_;
+    // Параметры аргументов-переменных и выражения в порядке аргументов. Поиск обращения
+    // к параметру считает ошибкой чтение параметров с номерами от next_ordered_
+    vector<uint32_t> ordered_;
+    size_t next_ordered_ = 0;
+};
+
+// Проход добавил узлы в конец дерева после корня обрабатываемой части [first, end).
+// Копия корня снова делает его последним узлом
+void KeepRootLast(Ast& ast, NodeId end) {
+    ast.AddNode(ast.Kind(end - 1), ast.GetOperands(end - 1));
+}
+
+// Повторные чтения полей в методе с переменными в ячейках. Обходит тело в порядке выполнения
+// и находит чтения цепочки x.f1...fn, значение которой уже вычислено на каждом пути выполнения
+// и с тех пор не могло измениться. Первое чтение сохраняет значение во временную ячейку кадра,
+// повторные читают ячейку, а более длинные цепочки читают из неё оставшиеся поля
+class LoadEliminator {
+public:
+    explicit LoadEliminator(Ast& ast)
+        : ast_(ast) {
+    }
+
+    // Возвращает число чтений, заменённых обращением к временной ячейке
+    size_t Run(uint32_t method) {
+        entries_.clear();
+        available_.clear();
+        snapshots_.clear();
+        loads_.clear();
+        position_ = 0;
+        Walk(ast_.Method(method).body);
+        return Rewrite(method);
+    }
+
+private:
+    // Шаг обхода. Действие узла выполняется после вычисления его операндов
+    enum class Step {
+        Visit,
+        // Вызов метода либо операция, которая может вызвать метод и изменить любые поля
+        Barrier,
+        // Присваивание переменной в ячейке node
+        Assign,
+        // Присваивание полю с индексом имени node
+        Store,
+        // Начало, переход к другой ветке и конец условно выполняемой части
+        Save,
+        Restore,
+        Drop,
+    };
+
+    // Вычисленная цепочка: ячейка переменной, затем индексы имён полей
+    struct Entry {
+        vector<uint32_t> key;
+        NodeId first = NO_NODE;
+        size_t first_position = 0;
+        size_t last_use = 0;
+        // Чтения, использующие значение цепочки, и длины их совпадающих начал
+        vector<pair<NodeId, size_t>> users;
+        bool valid = true;
+        uint32_t slot = 0;
+    };
+
+    void Walk(NodeId body) {
+        vector<pair<Step, NodeId>> stack{{Step::Visit, body}};
+        vector<pair<Step, NodeId>> steps;
+        while (!stack.empty()) {
+            const auto [step, node] = stack.back();
+            stack.pop_back();
+            switch (step) {
+            case Step::Visit:
+                steps.clear();
+                Schedule(node, steps);
+                stack.insert(stack.end(), steps.rbegin(), steps.rend());
+                break;
+            case Step::Barrier:
+                for (const auto& [key, entry] : available_) {
+                    entries_[entry].valid = false;
+                }
+                available_.clear();
+                break;
+            case Step::Assign:
+                Invalidate([node = node](const vector<uint32_t>& key) {
+                    return key[0] == node;
+                });
+                break;
+            case Step::Store:
+                Invalidate([node = node](const vector<uint32_t>& key) {
+                    return find(key.begin() + 1, key.end(), node) != key.end();
+                });
+                break;
+            case Step::Save:
+                snapshots_.push_back(available_);
+                break;
+            case Step::Restore:
+                available_ = snapshots_.back();
+                for (auto it = available_.begin(); it != available_.end();) {
+                    it = entries_[it->second].valid ? next(it) : available_.erase(it);
+                }
+                break;
+            case Step::Drop:
+                snapshots_.pop_back();
+                break;
+            }
+        }
+    }
+
+    // Добавляет в steps шаги выполнения узла node в порядке выполнения
+    void Schedule(NodeId node, vector<pair<Step, NodeId>>& steps) {
+        const Operands& op = ast_.GetOperands(node);
+        const auto visit = [&steps](NodeId child) {
+            steps.emplace_back(Step::Visit, child);
+        };
+        const auto visit_list = [this, &visit](ListId list) {
+            for (NodeId child : ast_.List(list)) {
+                visit(child);
+            }
+        };
+        // Условно выполняемые части: каждая видит только значения, вычисленные до неё
+        const auto branches = [&steps, &visit](std::initializer_list<NodeId> parts) {
+            steps.emplace_back(Step::Save, NO_NODE);
+            for (NodeId part : parts) {
+                visit(part);
+                steps.emplace_back(Step::Restore, NO_NODE);
+            }
+            steps.emplace_back(Step::Drop, NO_NODE);
+        };
+        switch (ast_.Kind(node)) {
+        case NodeKind::LocalVariable:
+            Load(node);
+            break;
+        case NodeKind::LocalAssignment:
+        case NodeKind::ScratchAssignment:
+            visit(op.b);
+            steps.emplace_back(Step::Assign, op.c);
+            break;
+        case NodeKind::FieldAssignment:
+            visit(op.a);
+            visit(op.c);
+            steps.emplace_back(Step::Store, op.b);
+            break;
+        case NodeKind::FieldIncrement:
+            // Сложение может вызвать __add__ значения поля
+            visit(op.a);
+            visit(op.c);
+            steps.emplace_back(Step::Barrier, NO_NODE);
+            steps.emplace_back(Step::Store, op.b);
+            break;
+        case NodeKind::LocalIncrement:
+            visit(op.b);
+            steps.emplace_back(Step::Barrier, NO_NODE);
+            steps.emplace_back(Step::Assign, op.c);
+            break;
+        case NodeKind::Print:
+            // Значения печатаются по мере вычисления аргументов
+            for (NodeId child : ast_.List(op.a)) {
+                visit(child);
+                steps.emplace_back(Step::Barrier, NO_NODE);
+            }
+            break;
+        case NodeKind::MethodCall:
+        case NodeKind::BoundMethodCall:
+            visit_list(op.c);
+            visit(op.a);
+            steps.emplace_back(Step::Barrier, NO_NODE);
+            break;
+        case NodeKind::NewInstance:
+            visit_list(op.b);
+            steps.emplace_back(Step::Barrier, NO_NODE);
+            break;
+        case NodeKind::InlinedCall:
+            // Объект - переменная без полей, затем выполняется копия тела либо исходный вызов
+            branches({op.b, op.a});
+            break;
+        case NodeKind::Compound:
+            visit_list(op.a);
+            break;
+        case NodeKind::IfElse:
+            visit(op.a);
+            if (op.c != NO_NODE) {
+                branches({op.b, op.c});
+            } else {
+                branches({op.b});
+            }
+            break;
+        case NodeKind::Or:
+        case NodeKind::And:
+            visit(op.a);
+            branches({op.b});
+            break;
+        case NodeKind::Not:
+        case NodeKind::Return:
+            visit(op.a);
+            break;
+        case NodeKind::Sub:
+        case NodeKind::Mult:
+        case NodeKind::Div:
+            // Операции только над числами
+            visit(op.a);
+            visit(op.b);
+            break;
+        case NodeKind::Stringify:
+            // Вызывает __str__ экземпляра класса
+            visit(op.a);
+            if (!IsNeverInstance(op.a)) {
+                steps.emplace_back(Step::Barrier, NO_NODE);
+            }
+            break;
+        case NodeKind::Add:
+        case NodeKind::Less:
+        case NodeKind::Greater:
+        case NodeKind::Equal:
+        case NodeKind::NotEqual:
+        case NodeKind::LessOrEqual:
+        case NodeKind::GreaterOrEqual:
+            // Вызывают __add__, __eq__ или __lt__, если левый аргумент - экземпляр класса
+            visit(op.a);
+            visit(op.b);
+            if (!IsNeverInstance(op.a)) {
+                steps.emplace_back(Step::Barrier, NO_NODE);
+            }
+            break;
+        default:
+            // Константы. Переменные в Closure и определения классов в методах с ячейками не встречаются
+            break;
+        }
+    }
+
+    // Значение узла - число, строка, логическое значение или None, но не экземпляр класса
+    [[nodiscard]] bool IsNeverInstance(NodeId node) const {
+        // Сумма - экземпляр класса, только если левое слагаемое - экземпляр
+        while (ast_.Kind(node) == NodeKind::Add) {
+            node = ast_.GetOperands(node).a;
+        }
+        switch (ast_.Kind(node)) {
+        case NodeKind::Constant:
+        case NodeKind::None:
+        case NodeKind::Sub:
+        case NodeKind::Mult:
+        case NodeKind::Div:
+        case NodeKind::Or:
+        case NodeKind::And:
+        case NodeKind::Not:
+        case NodeKind::Less:
+        case NodeKind::Greater:
+        case NodeKind::Equal:
+        case NodeKind::NotEqual:
+        case NodeKind::LessOrEqual:
+        case NodeKind::GreaterOrEqual:
+        case NodeKind::Stringify:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void Load(NodeId node) {
+        const Operands& op = ast_.GetOperands(node);
+        const ListView names = ast_.List(op.a);
+        if (names.size() < 2) {
+            return;
+        }
+        ++loads_[node];
+        vector<uint32_t> key(names.begin(), names.end());
+        key[0] = op.b;
+        const size_t position = ++position_;
+        // Самое длинное вычисленное начало цепочки
+        for (size_t length = key.size(); length >= 2; --length) {
+            vector<uint32_t> prefix(key.begin(), key.begin() + static_cast<ptrdiff_t>(length));
+            const auto it = available_.find(prefix);
+            if (it == available_.end()) {
+                continue;
+            }
+            Entry& entry = entries_[it->second];
+            entry.users.emplace_back(node, length);
+            entry.last_use = position;
+            if (length == key.size()) {
+                return;
+            }
+            break;
+        }
+        available_.emplace(key, entries_.size());
+        entries_.push_back({std::move(key), node, position, position, {}, true, 0});
+    }
+
+    template <typename Predicate>
+    void Invalidate(Predicate affected) {
+        for (auto it = available_.begin(); it != available_.end();) {
+            if (affected(it->first)) {
+                entries_[it->second].valid = false;
+                it = available_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Назначает временные ячейки и заменяет чтения. Порядок выполнения совпадает с порядком
+    // обхода, поэтому ячейку цепочки, которая больше не читается, может занять следующая
+    size_t Rewrite(uint32_t method) {
+        const uint32_t first_slot = ast_.Method(method).slot_count;
+        uint32_t slot_count = first_slot;
+        // Последнее чтение и ячейка занятых временных ячеек
+        vector<pair<size_t, uint32_t>> busy;
+        vector<uint32_t> free_slots;
+        size_t replaced = 0;
+        for (Entry& entry : entries_) {
+            // Узел, достижимый по нескольким путям, не заменяется: на каждом пути он мог бы
+            // получить свою замену. Без первого чтения значение не попадает в ячейку
+            if (loads_[entry.first] > 1) {
+                entry.users.clear();
+            }
+            entry.users.erase(remove_if(entry.users.begin(), entry.users.end(),
+                                        [this](const pair<NodeId, size_t>& user) {
+                                            return loads_[user.first] > 1;
+                                        }),
+                              entry.users.end());
+            if (entry.users.empty()) {
+                continue;
+            }
+            for (auto it = busy.begin(); it != busy.end();) {
+                if (it->first < entry.first_position) {
+                    free_slots.push_back(it->second);
+                    it = busy.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (free_slots.empty()) {
+                entry.slot = slot_count++;
+            } else {
+                entry.slot = free_slots.back();
+                free_slots.pop_back();
+            }
+            busy.emplace_back(entry.last_use, entry.slot);
+            replaced += entry.users.size();
+        }
+        if (replaced == 0) {
+            return 0;
+        }
+
+        // Временная переменная называется по последнему полю цепочки, поэтому ошибки чтения
+        // её полей называют то же поле, что и без оптимизации
+        for (const Entry& entry : entries_) {
+            const uint32_t name = entry.key.back();
+            for (const auto& [user, length] : entry.users) {
+                const ListView names = ast_.List(ast_.GetOperands(user).a);
+                vector<uint32_t> chain{name};
+                chain.insert(chain.end(), names.begin() + static_cast<ptrdiff_t>(length),
+                             names.end());
+                ast_.SetNode(user, NodeKind::LocalVariable,
+                             {ast_.AddList(chain.data(), chain.data() + chain.size()), entry.slot});
+            }
+        }
+        for (const Entry& entry : entries_) {
+            if (!entry.users.empty()) {
+                const NodeId load = ast_.AddNode(NodeKind::LocalVariable, ast_.GetOperands(entry.first));
+                ast_.SetNode(entry.first, NodeKind::LocalAssignment,
+                             {entry.key.back(), load, entry.slot});
+            }
+        }
+        ast_.SetSlotCount(method, slot_count);
+        return replaced;
+    }
+
+    Ast& ast_;
+    vector<Entry> entries_;
+    // Индексы в entries_ цепочек, значения которых вычислены на текущем пути выполнения
+    map<vector<uint32_t>, size_t> available_;
+    vector<map<vector<uint32_t>, size_t>> snapshots_;
+    // Число обходов чтений цепочек
+    unordered_map<NodeId, size_t> loads_;
+    size_t position_ = 0;
+};
+
+// Вывод типов в теле метода либо в корне программы. Обходит тело в порядке выполнения
+// и отслеживает типы переменных: тип известен, если на каждом пути выполнения переменной
+// присвоено значение этого типа
+class TypeInferrer {
+public:
+    TypeInferrer(const Ast& ast, vector<NodeType>& types)
+        : ast_(ast)
+        , types_(types)
+        , reached_(types.size()) {
+    }
+
+    void Run(NodeId body) {
+        variables_.clear();
+        Walk(body);
+    }
+
+    // Узел выполняется в одном из обойдённых тел
+    [[nodiscard]] bool Reached(NodeId node) const {
+        return reached_[node];
+    }
+
+private:
+    // Шаг обхода. Тип узла вычисляется после вычисления его операндов
+    enum class Step {
+        Visit,
+        Finish,
+        // Начало, конец одного из путей и конец условно выполняемой части
+        Save,
+        Merge,
+        Join,
+    };
+
+    // Переменная в ячейке (true и номер ячейки) либо в Closure (false и индекс имени)
+    using Variable = pair<bool, uint32_t>;
+    using Variables = map<Variable, NodeType>;
+
+    // Условно выполняемая часть: типы переменных до неё и объединение типов в конце её путей
+    struct Branches {
+        Variables before;
+        optional<Variables> after;
+    };
+
+    void Walk(NodeId body) {
+        vector<pair<Step, NodeId>> stack{{Step::Visit, body}};
+        vector<pair<Step, NodeId>> steps;
+        while (!stack.empty()) {
+            const auto [step, node] = stack.back();
+            stack.pop_back();
+            switch (step) {
+            case Step::Visit:
+                steps.clear();
+                Schedule(node, steps);
+                steps.emplace_back(Step::Finish, node);
+                stack.insert(stack.end(), steps.rbegin(), steps.rend());
+                break;
+            case Step::Finish:
+                Finish(node);
+                break;
+            case Step::Save:
+                branches_.push_back({variables_, nullopt});
+                break;
+            case Step::Merge: {
+                Branches& branches = branches_.back();
+                if (branches.after) {
+                    Intersect(*branches.after, variables_);
+                } else {
+                    branches.after = std::move(variables_);
+                }
+                variables_ = branches.before;
+                break;
+            }
+            case Step::Join:
+                variables_ = std::move(*branches_.back().after);
+                branches_.pop_back();
+                break;
+            }
+        }
+    }
+
+    // Добавляет в steps шаги вычисления операндов узла node в порядке выполнения
+    void Schedule(NodeId node, vector<pair<Step, NodeId>>& steps) const {
+        const Operands& op = ast_.GetOperands(node);
+        const auto visit = [&steps](NodeId child) {
+            steps.emplace_back(Step::Visit, child);
+        };
+        const auto visit_list = [this, &visit](ListId list) {
+            for (NodeId child : ast_.List(list)) {
+                visit(child);
+            }
+        };
+        // Выполняется ровно одна из частей либо, если skippable, ни одной
+        const auto branches = [&steps, &visit](std::initializer_list<NodeId> parts,
+                                               bool skippable) {
+            steps.emplace_back(Step::Save, NO_NODE);
+            if (skippable) {
+                steps.emplace_back(Step::Merge, NO_NODE);
+            }
+            for (NodeId part : parts) {
+                visit(part);
+                steps.emplace_back(Step::Merge, NO_NODE);
+            }
+            steps.emplace_back(Step::Join, NO_NODE);
+        };
+        switch (ast_.Kind(node)) {
+        case NodeKind::Constant:
+        case NodeKind::None:
+        case NodeKind::Variable:
+        case NodeKind::LocalVariable:
+        case NodeKind::ClassDefinition:
+            break;
+        case NodeKind::Assignment:
+        case NodeKind::LocalAssignment:
+        case NodeKind::ScratchAssignment:
+            visit(op.b);
+            break;
+        case NodeKind::MethodCall:
+        case NodeKind::BoundMethodCall:
+            visit_list(op.c);
+            visit(op.a);
+            break;
+        case NodeKind::NewInstance:
+            visit_list(op.b);
+            break;
+        case NodeKind::InlinedCall:
+            branches({op.b, op.a}, false);
+            break;
+        case NodeKind::IfElse:
+            visit(op.a);
+            if (op.c != NO_NODE) {
+                branches({op.b, op.c}, false);
+            } else {
+                branches({op.b}, true);
+            }
+            break;
+        case NodeKind::Or:
+        case NodeKind::And:
+            visit(op.a);
+            branches({op.b}, true);
+            break;
+        default:
+            ForEachChild(ast_, node, visit);
+            break;
+        }
+    }
+
+    void Finish(NodeId node) {
+        const Operands& op = ast_.GetOperands(node);
+        NodeType type;
+        switch (ast_.Kind(node)) {
+        case NodeKind::Constant: {
+            const ObjectHolder& value = ast_.Constant(op.a);
+            if (value.TryAs<runtime::Number>() != nullptr) {
+                type.type = ValueType::Number;
+            } else if (value.TryAs<runtime::String>() != nullptr) {
+                type.type = ValueType::String;
+            } else if (value.TryAs<runtime::Bool>() != nullptr) {
+                type.type = ValueType::Bool;
+            } else if (!value) {
+                type.type = ValueType::None;
+            }
+            break;
+        }
+        case NodeKind::None:
+            type.type = ValueType::None;
+            break;
+        case NodeKind::Variable:
+            type = Read({false, ast_.List(op.a)[0]}, op.a);
+            break;
+        case NodeKind::LocalVariable:
+            type = Read({true, op.b}, op.a);
+            break;
+        case NodeKind::Assignment:
+            type = Write({false, op.a}, op.b);
+            break;
+        case NodeKind::LocalAssignment:
+            type = Write({true, op.c}, op.b);
+            break;
+        case NodeKind::ScratchAssignment:
+            // Инструкция, значения не имеет
+            Write({true, op.c}, op.b);
+            break;
+        case NodeKind::LocalIncrement: {
+            // Сумма двух чисел - число, тип остальных сумм не выводится
+            const auto it = variables_.find({true, op.c});
+            if (it == variables_.end() || it->second.type != ValueType::Number
+                || types_[op.b].type != ValueType::Number) {
+                variables_.erase({true, op.c});
+            }
+            break;
+        }
+        case NodeKind::ClassDefinition: {
+            // Определение класса присваивает класс переменной с его именем, тип класса не выводится
+            const auto* cls = ast_.Constant(op.a).TryAs<runtime::Class>();
+            for (auto it = variables_.begin(); it != variables_.end();) {
+                it = !it->first.first && (cls == nullptr || ast_.Name(it->first.second) == cls->GetName())
+                         ? variables_.erase(it)
+                         : next(it);
+            }
+            break;
+        }
+        case NodeKind::NewInstance:
+            type = {ValueType::Instance, ast_.Constant(op.a).TryAs<runtime::Class>()};
+            break;
+        case NodeKind::Stringify:
+            type.type = ValueType::String;
+            break;
+        case NodeKind::Add: {
+            // Сумма экземпляра класса - результат метода __add__
+            const NodeType& lhs = types_[op.a];
+            if (lhs == types_[op.b]
+                && (lhs.type == ValueType::Number || lhs.type == ValueType::String)) {
+                type = lhs;
+            }
+            break;
+        }
+        case NodeKind::Sub:
+        case NodeKind::Mult:
+        case NodeKind::Div:
+            type.type = ValueType::Number;
+            break;
+        case NodeKind::Or:
+        case NodeKind::And:
+        case NodeKind::Not:
+        case NodeKind::Less:
+        case NodeKind::Greater:
+        case NodeKind::Equal:
+        case NodeKind::NotEqual:
+        case NodeKind::LessOrEqual:
+        case NodeKind::GreaterOrEqual:
+            type.type = ValueType::Bool;
+            break;
+        default:
+            // Вызовы методов и инструкции
+            break;
+        }
+        // Узел, на который ссылаются несколько узлов, получает общий тип всех обходов
+        if (reached_[node] && types_[node] != type) {
+            type = {};
+        }
+        reached_[node] = true;
+        types_[node] = type;
+    }
+
+    [[nodiscard]] NodeType Read(Variable variable, ListId names) const {
+        if (ast_.List(names).size() != 1) {
+            return {};
+        }
+        const auto it = variables_.find(variable);
+        return it != variables_.end() ? it->second : NodeType{};
+    }
+
+    NodeType Write(Variable variable, NodeId value) {
+        const NodeType& type = types_[value];
+        if (type.type == ValueType::Unknown) {
+            variables_.erase(variable);
+        } else {
+            variables_[variable] = type;
+        }
+        return type;
+    }
+
+    // Оставляет в variables типы, совпадающие с типами в other
+    static void Intersect(Variables& variables, const Variables& other) {
+        for (auto it = variables.begin(); it != variables.end();) {
+            const auto found = other.find(it->first);
+            it = found != other.end() && found->second == it->second ? next(it)
+                                                                      : variables.erase(it);
+        }
+    }
+
+    const Ast& ast_;
+    vector<NodeType>& types_;
+    vector<bool> reached_;
+    Variables variables_;
+    vector<Branches> branches_;
+};
+
+// Корни обрабатываемой части: тела методов от first и последний узел
+template <typename Visitor>
+void ForEachRoot(const Ast& ast, NodeId first, Visitor&& visit) {
+    if (ast.NodeCount() <= first) {
+        return;
+    }
+    const auto root = static_cast<NodeId>(ast.NodeCount() - 1);
+    bool root_is_method = false;
+    for (auto method = static_cast<uint32_t>(ast.MethodCount()); method-- > 0;) {
+        const NodeId body = ast.Method(method).body;
+        if (body < first) {
+            break;
+        }
+        root_is_method = root_is_method || body == root;
+        visit(body);
+    }
+    if (!root_is_method) {
+        visit(root);
+    }
+}
+
+// Узел использует значения аргументов только для вычисления своего результата
+// либо, как LocalIncrement, суммы x + k
+bool ConsumesOperands(NodeKind kind) {
+    return (kind >= NodeKind::Add && kind <= NodeKind::GreaterOrEqual && kind != NodeKind::Or
+            && kind != NodeKind::And && kind != NodeKind::Not)
+           || kind == NodeKind::LocalIncrement;
+}
+
+// Заменяет ScratchAssignment присваивания-инструкции переменным метода, значения которых
+// читаются только аргументами арифметики и сравнений и поэтому не покидают кадр
+size_t UnboxMethod(Ast& ast, uint32_t method) {
+    const MethodInfo& info = ast.Method(method);
+    vector<bool> escapes(info.slot_count);
+    vector<NodeId> assignments;
+    vector<NodeId> stack{info.body};
+    while (!stack.empty()) {
+        const NodeId node = stack.back();
+        stack.pop_back();
+        const NodeKind kind = ast.Kind(node);
+        if (kind == NodeKind::Compound) {
+            for (NodeId statement : ast.List(ast.GetOperands(node).a)) {
+                if (ast.Kind(statement) == NodeKind::LocalAssignment) {
+                    assignments.push_back(statement);
+                }
+            }
+        } else if (kind == NodeKind::ReturnLocal) {
+            escapes[ast.GetOperands(node).b] = true;
+        }
+        ForEachChild(ast, node, [&](NodeId child) {
+            if (ast.Kind(child) == NodeKind::LocalVariable) {
+                const Operands& op = ast.GetOperands(child);
+                if (!ConsumesOperands(kind) || ast.List(op.a).size() != 1) {
+                    escapes[op.b] = true;
+                }
+            }
+            stack.push_back(child);
+        });
+    }
+
+    size_t unboxed = 0;
+    for (NodeId assignment : assignments) {
+        const Operands op = ast.GetOperands(assignment);
+        if (!escapes[op.c]) {
+            ast.SetNode(assignment, NodeKind::ScratchAssignment, op);
+            ++unboxed;
+        }
+    }
+    return unboxed;
+}
+
+// Заменяет слитым узлом инструкцию x.f = x.f + k, x = x + k либо return x.f1...fn.
+// Возвращает true, если инструкция заменена
+bool FuseStatement(Ast& ast, NodeId statement) {
+    const Operands op = ast.GetOperands(statement);
+    switch (ast.Kind(statement)) {
+    case NodeKind::FieldAssignment: {
+        const NodeKind object = ast.Kind(op.a);
+        if ((object != NodeKind::Variable && object != NodeKind::LocalVariable)
+            || ast.Kind(op.c) != NodeKind::Add) {
+            return false;
+        }
+        // Левое слагаемое читает то же поле той же переменной
+        const Operands sum = ast.GetOperands(op.c);
+        const Operands target = ast.GetOperands(op.a);
+        if (ast.Kind(sum.a) != object) {
+            return false;
+        }
+        const Operands source = ast.GetOperands(sum.a);
+        const ListView target_names = ast.List(target.a);
+        const ListView source_names = ast.List(source.a);
+        if (target_names.size() != 1 || source_names.size() != 2
+            || source_names[0] != target_names[0] || source_names[1] != op.b
+            || (object == NodeKind::LocalVariable && source.b != target.b)) {
+            return false;
+        }
+        ast.SetNode(statement, NodeKind::FieldIncrement, {op.a, op.b, sum.b});
+        return true;
+    }
+    case NodeKind::LocalAssignment:
+    case NodeKind::ScratchAssignment: {
+        if (ast.Kind(op.b) != NodeKind::Add) {
+            return false;
+        }
+        const Operands sum = ast.GetOperands(op.b);
+        if (ast.Kind(sum.a) != NodeKind::LocalVariable || ast.GetOperands(sum.a).b != op.c
+            || ast.List(ast.GetOperands(sum.a).a).size() != 1) {
+            return false;
+        }
+        ast.SetNode(statement, NodeKind::LocalIncrement, {op.a, sum.b, op.c});
+        return true;
+    }
+    case NodeKind::Return:
+        if (ast.Kind(op.a) != NodeKind::LocalVariable) {
+            return false;
+        }
+        ast.SetNode(statement, NodeKind::ReturnLocal, ast.GetOperands(op.a));
+        return true;
+    default:
+        return false;
+    }
+}
+
+}  // namespace
+
+size_t ResolveLocals(Ast& ast, NodeId first) {
+    // Методы добавляются в порядке разбора, поэтому методы с телами от first идут последними
+    size_t resolved = 0;
+    for (auto method = static_cast<uint32_t>(ast.MethodCount()); method-- > 0;) {
+        const MethodInfo& info = ast.Method(method);
+        if (info.body < first) {
+            break;
+        }
+        if (info.slot_count == 0) {
+            resolved += ResolveMethod(ast, method).value_or(0);
+        }
+    }
+    return resolved;
+}
+
+size_t EliminateDeadCode(Ast& ast, NodeId first) {
+    size_t removed = 0;
+    for (auto node = first; node < ast.NodeCount(); ++node) {
+        if (ast.Kind(node) == NodeKind::IfElse) {
+            removed += EliminateBranch(ast, node);
+        } else if (ast.Kind(node) == NodeKind::Compound) {
+            removed += PruneCompound(ast, node);
+        }
+    }
+    return removed;
+}
+
+size_t FoldConstants(Ast& ast, NodeId first) {
+    size_t folded = 0;
+    for (auto node = first; node < ast.NodeCount(); ++node) {
+        if (auto value = Fold(ast, node)) {
+            ast.SetNode(node, NodeKind::Constant, {ast.AddConstant(std::move(*value))});
+            ++folded;
+        }
+    }
+    return folded;
+}
+
+size_t DevirtualizeCalls(Ast& ast, NodeId first) {
+    const ClassHierarchy hierarchy(ast, first);
+    if (hierarchy.Classes().empty()) {
+        return 0;
+    }
+    const uint32_t self_name = ast.AddName("self"sv);
+    unordered_map<NodeId, const runtime::Class*> self_calls;
+    for (const runtime::Class* cls : hierarchy.Classes()) {
+        FindSelfCalls(ast, cls, self_name, self_calls);
+    }
+
+    size_t bound = 0;
+    for (auto node = first; node < ast.NodeCount(); ++node) {
+        if (ast.Kind(node) != NodeKind::MethodCall) {
+            continue;
+        }
+        const Operands op = ast.GetOperands(node);
+        const string& name = ast.Name(op.b);
+        const runtime::Class* cls = nullptr;
+        const runtime::Method* method = nullptr;
+        if (const auto it = self_calls.find(node);
+            it != self_calls.end() && !hierarchy.IsOverridden(it->second, name)) {
+            cls = it->second;
+            method = hierarchy.Resolve(cls, name);
+        }
+        if (method == nullptr) {
+            cls = hierarchy.UniqueImplementation(name);
+            method = cls != nullptr ? hierarchy.Resolve(cls, name) : nullptr;
+        }
+        // Вызов с другим числом аргументов, как и прежде, возвращает None
+        if (method == nullptr || method->formal_params.size() != ast.List(op.c).size()) {
+            continue;
+        }
+        const auto* body = dynamic_cast<const MethodBody*>(method->body.get());
+        ast.SetNode(node, NodeKind::BoundMethodCall,
+                    {op.a, ast.AddCallSite({op.b, cls, method, body}), op.c});
+        ++bound;
+    }
+    return bound;
+}
+
+size_t InlineCalls(Ast& ast, NodeId first, size_t max_nodes) {
+    const auto end = static_cast<NodeId>(ast.NodeCount());
+    // Индексы констант с классами, определёнными в обрабатываемой части
+    unordered_map<const runtime::Class*, uint32_t> class_constants;
+    for (auto node = first; node < end; ++node) {
+        if (ast.Kind(node) == NodeKind::ClassDefinition) {
+            const uint32_t constant = ast.GetOperands(node).a;
+            class_constants.emplace(ast.Constant(constant).TryAs<runtime::Class>(), constant);
+        }
+    }
+    if (class_constants.empty()) {
+        return 0;
+    }
+
+    Inliner inliner(ast, ast.AddName("self"sv));
+    size_t inlined = 0;
+    // Копии тел, добавленные в конец дерева, повторно не обрабатываются
+    for (auto node = first; node < end; ++node) {
+        if (ast.Kind(node) != NodeKind::BoundMethodCall) {
+            continue;
+        }
+        const Operands op = ast.GetOperands(node);
+        const CallSite site = ast.GetCallSite(op.b);
+        const auto cls = class_constants.find(site.cls);
+        if (cls == class_constants.end() || site.body == nullptr || site.body->Tree() != &ast) {
+            continue;
+        }
+        if (const auto body = inliner.Inline(site, op, max_nodes)) {
+            const NodeId call = ast.AddNode(NodeKind::BoundMethodCall, op);
+            ast.SetNode(node, NodeKind::InlinedCall, {call, *body, cls->second});
+            ++inlined;
+        }
+    }
+    if (inlined > 0) {
+        KeepRootLast(ast, end);
+    }
+    return inlined;
+}
+
+size_t EliminateCommonLoads(Ast& ast, NodeId first) {
+    const auto end = static_cast<NodeId>(ast.NodeCount());
+    LoadEliminator eliminator(ast);
+    size_t replaced = 0;
+    // Методы с телами от first идут последними, как в ResolveLocals
+    for (auto method = static_cast<uint32_t>(ast.MethodCount()); method-- > 0;) {
+        const MethodInfo& info = ast.Method(method);
+        if (info.body < first) {
+            break;
+        }
+        if (info.slot_count != 0) {
+            replaced += eliminator.Run(method);
+        }
+    }
+    if (replaced > 0) {
+        KeepRootLast(ast, end);
+    }
+    return replaced;
+}
+
+size_t UnboxLocals(Ast& ast, NodeId first) {
+    size_t unboxed = 0;
+    // Методы с телами от first идут последними, как в ResolveLocals
+    for (auto method = static_cast<uint32_t>(ast.MethodCount()); method-- > 0;) {
+        const MethodInfo& info = ast.Method(method);
+        if (info.body < first) {
+            break;
+        }
+        if (info.slot_count != 0) {
+            unboxed += UnboxMethod(ast, method);
+        }
+    }
+    return unboxed;
+}
+
+size_t FuseStatements(Ast& ast, NodeId first) {
+    size_t fused = 0;
+    for (auto node = first; node < ast.NodeCount(); ++node) {
+        if (ast.Kind(node) != NodeKind::Compound) {
+            continue;
+        }
+        for (NodeId statement : ast.List(ast.GetOperands(node).a)) {
+            fused += FuseStatement(ast, statement) ? 1 : 0;
+        }
+    }
+    return fused;
+}
+
+std::vector<NodeType> InferTypes(const Ast& ast, NodeId first) {
+    vector<NodeType> types(ast.NodeCount());
+    TypeInferrer inferrer(ast, types);
+    ForEachRoot(ast, first, [&inferrer](NodeId root) {
+        inferrer.Run(root);
+    });
+    return types;
+}
+
+size_t SpecializeOperations(Ast& ast, NodeId first, TypeCoverage* coverage) {
+    vector<NodeType> types(ast.NodeCount());
+    TypeInferrer inferrer(ast, types);
+    ForEachRoot(ast, first, [&inferrer](NodeId root) {
+        inferrer.Run(root);
+    });
+
+    size_t changed = 0;
+    TypeCoverage counted;
+    for (auto node = first; node < ast.NodeCount(); ++node) {
+        if (!inferrer.Reached(node)) {
+            continue;
+        }
+        const NodeKind kind = ast.Kind(node);
+        const Operands op = ast.GetOperands(node);
+        if (kind == NodeKind::IfElse) {
+            ++counted.operations;
+            counted.typed += types[op.a].type != ValueType::Unknown ? 1 : 0;
+            continue;
+        }
+        if (kind < NodeKind::Add || kind > NodeKind::GreaterOrEqual || kind == NodeKind::Or
+            || kind == NodeKind::And || kind == NodeKind::Not) {
+            continue;
+        }
+        // Строки только складываются и сравниваются
+        const ValueType type = types[op.a].type;
+        const bool arithmetic = kind == NodeKind::Sub || kind == NodeKind::Mult
+                                || kind == NodeKind::Div;
+        const bool proven = type == types[op.b].type
+                            && (type == ValueType::Number
+                                || (type == ValueType::String && !arithmetic));
+        const auto operand = static_cast<uint32_t>(proven ? type : ValueType::Unknown);
+        ++counted.operations;
+        counted.typed += proven ? 1 : 0;
+        if (op.c != operand) {
+            ast.SetNode(node, kind, {op.a, op.b, operand});
+            ++changed;
+        }
+    }
+    if (coverage != nullptr) {
+        coverage->operations += counted.operations;
+        coverage->typed += counted.typed;
+    }
+    return changed;
+}
+
+namespace {
+
+// Число живых узлов части дерева с индексами от first (см. PassManager::Run)
+size_t LiveNodes(const Ast& ast, NodeId first) {
+    if (ast.NodeCount() <= first) {
+        return 0;
+    }
+    size_t count = SubtreeSize(ast, static_cast<NodeId>(ast.NodeCount() - 1));
+    for (auto method = static_cast<uint32_t>(ast.MethodCount()); method-- > 0;) {
+        if (ast.Method(method).body < first) {
+            break;
+        }
+        count += SubtreeSize(ast, ast.Method(method).body);
+    }
+    return count;
+}
+
+string_view KindName(NodeKind kind) {
+    static constexpr string_view NAMES[] = {
+        "Constant"sv,   "None"sv,        "Variable"sv,     "Assignment"sv,     "FieldAssignment"sv,
+        "Print"sv,      "MethodCall"sv,  "NewInstance"sv,  "Stringify"sv,      "Add"sv,
+        "Sub"sv,        "Mult"sv,        "Div"sv,          "Or"sv,             "And"sv,
+        "Not"sv,        "Less"sv,        "Greater"sv,      "Equal"sv,          "NotEqual"sv,
+        "LessOrEqual"sv, "GreaterOrEqual"sv, "Compound"sv, "Return"sv,         "ClassDefinition"sv,
+        "IfElse"sv,     "LocalVariable"sv, "LocalAssignment"sv, "BoundMethodCall"sv, "InlinedCall"sv,
+        "ScratchAssignment"sv, "FieldIncrement"sv, "LocalIncrement"sv, "ReturnLocal"sv,
+    };
+    static_assert(size(NAMES) == static_cast<size_t>(NodeKind::ReturnLocal) + 1);
+    return NAMES[static_cast<size_t>(kind)];
+}
+
+// Печатает цепочку имён id1.id2.id3
+void PrintNames(const Ast& ast, ListId names, ostream& out) {
+    bool first = true;
+    for (uint32_t name : ast.List(names)) {
+        out << (first ? ""sv : "."sv) << ast.Name(name);
+        first = false;
+    }
+}
+
+// Печатает вид узла и его операнды, не являющиеся дочерними узлами
+void PrintNode(const Ast& ast, NodeId node, ostream& out) {
+    const Operands& op = ast.GetOperands(node);
+    out << KindName(ast.Kind(node));
+    switch (ast.Kind(node)) {
+    case NodeKind::Constant: {
+        const ObjectHolder& value = ast.Constant(op.a);
+        runtime::DummyContext context;
+        value->Print(context.output, context);
+        const bool quoted = value.TryAs<runtime::String>() != nullptr;
+        out << ' ' << (quoted ? "'"sv : ""sv) << context.output.str() << (quoted ? "'"sv : ""sv);
+        break;
+    }
+    case NodeKind::Variable:
+        out << ' ';
+        PrintNames(ast, op.a, out);
+        break;
+    case NodeKind::LocalVariable:
+    case NodeKind::ReturnLocal:
+        out << ' ';
+        PrintNames(ast, op.a, out);
+        out << " [slot "sv << op.b << ']';
+        break;
+    case NodeKind::Assignment:
+        out << ' ' << ast.Name(op.a);
+        break;
+    case NodeKind::LocalAssignment:
+    case NodeKind::ScratchAssignment:
+    case NodeKind::LocalIncrement:
+        out << ' ' << ast.Name(op.a) << " [slot "sv << op.c << ']';
+        break;
+    case NodeKind::FieldAssignment:
+    case NodeKind::FieldIncrement:
+    case NodeKind::MethodCall:
+        out << " ."sv << ast.Name(op.b);
+        break;
+    case NodeKind::BoundMethodCall: {
+        const CallSite& site = ast.GetCallSite(op.b);
+        out << " ."sv << ast.Name(site.name) << " ["sv << site.cls->GetName() << ']';
+        break;
+    }
+    case NodeKind::InlinedCall:
+        out << " ["sv << ast.Constant(op.c).TryAs<runtime::Class>()->GetName() << ']';
+        break;
+    case NodeKind::NewInstance:
+    case NodeKind::ClassDefinition:
+        out << ' ' << ast.Constant(op.a).TryAs<runtime::Class>()->GetName();
+        break;
+    case NodeKind::Add:
+    case NodeKind::Sub:
+    case NodeKind::Mult:
+    case NodeKind::Div:
+    case NodeKind::Less:
+    case NodeKind::Greater:
+    case NodeKind::Equal:
+    case NodeKind::NotEqual:
+    case NodeKind::LessOrEqual:
+    case NodeKind::GreaterOrEqual:
+        // Тип аргументов, доказанный проходом types
+        if (op.c == static_cast<uint32_t>(ValueType::Number)) {
+            out << " [Number]"sv;
+        } else if (op.c == static_cast<uint32_t>(ValueType::String)) {
+            out << " [String]"sv;
+        }
+        break;
+    default:
+        break;
+    }
+    out << '\n';
+}
+
+}  // namespace
+
+void PrintTree(const Ast& ast, NodeId root, ostream& out) {
+    // Узел либо заголовок метода, ожидающий печати. Обход без рекурсии, как в SubtreeSize
+    struct Item {
+        NodeId node = NO_NODE;
+        size_t depth = 0;
+        const runtime::Method* method = nullptr;
+    };
+    vector<Item> stack{{root, 0, nullptr}};
+    vector<NodeId> children;
+    while (!stack.empty()) {
+        const Item item = stack.back();
+        stack.pop_back();
+        out << string(item.depth * 2, ' ');
+
+        if (item.method != nullptr) {
+            out << "def "sv << item.method->name << '(';
+            bool first = true;
+            for (const string& param : item.method->formal_params) {
+                out << (first ? ""sv : ", "sv) << param;
+                first = false;
+            }
+            out << ')';
+            const auto* body = dynamic_cast<const MethodBody*>(item.method->body.get());
+            if (body == nullptr || body->Tree() != &ast) {
+                out << " <тело вне дерева>\n"sv;
+                continue;
+            }
+            const MethodInfo& info = ast.Method(body->MethodIndex());
+            if (info.slot_count != 0) {
+                out << " [slots "sv << info.slot_count << ']';
+            }
+            out << '\n';
+            stack.push_back({info.body, item.depth + 1, nullptr});
+            continue;
+        }
+
+        PrintNode(ast, item.node, out);
+        if (ast.Kind(item.node) == NodeKind::ClassDefinition) {
+            const auto& methods =
+                ast.Constant(ast.GetOperands(item.node).a).TryAs<runtime::Class>()->GetMethods();
+            for (auto it = methods.rbegin(); it != methods.rend(); ++it) {
+                stack.push_back({NO_NODE, item.depth + 1, &*it});
+            }
+            continue;
+        }
+        children.clear();
+        ForEachChild(ast, item.node, [&children](NodeId child) {
+            children.push_back(child);
+        });
+        for (auto it = children.rbegin(); it != children.rend(); ++it) {
+            stack.push_back({*it, item.depth + 1, nullptr});
+        }
+    }
+}
+
+void PassManager::Register(std::string name, Pass pass) {
+    PassStats stats;
+    stats.name = std::move(name);
+    pipeline_.push_back(passes_.size());
+    passes_.push_back({std::move(pass), std::move(stats)});
+}
+
+size_t PassManager::Find(std::string_view name) const {
+    for (size_t i = 0; i < passes_.size(); ++i) {
+        if (passes_[i].stats.name == name) {
+            return i;
+        }
+    }
+    throw invalid_argument("Unknown optimization pass: "s + string(name));
+}
+
+void PassManager::SetPipeline(std::string_view names) {
+    vector<size_t> pipeline;
+    while (!names.empty()) {
+        const size_t comma = names.find(',');
+        pipeline.push_back(Find(names.substr(0, comma)));
+        names.remove_prefix(comma == string_view::npos ? names.size() : comma + 1);
+    }
+    pipeline_ = std::move(pipeline);
+}
+
+std::string PassManager::Pipeline() const {
+    string result;
+    for (size_t pass : pipeline_) {
+        result += (result.empty() ? ""s : ","s) + passes_[pass].stats.name;
+    }
+    return result;
+}
+
+void PassManager::DumpAfter(std::string_view name, std::ostream& out) {
+    dump_after_ = Find(name);
+    dump_output_ = &out;
+}
+
+void PassManager::EnableStats() {
+    collect_stats_ = true;
+}
+
+void PassManager::Run(Ast& ast, NodeId first) {
+    if (!collect_stats_ && dump_output_ == nullptr) {
+        for (size_t pass : pipeline_) {
+            passes_[pass].pass(ast, first);
+        }
+        return;
+    }
+
+    for (size_t pass : pipeline_) {
+        const size_t nodes_before = collect_stats_ ? LiveNodes(ast, first) : 0;
+        const auto start = chrono::steady_clock::now();
+        const size_t changes = passes_[pass].pass(ast, first);
+        const auto time = chrono::steady_clock::now() - start;
+        const size_t nodes_after = collect_stats_ ? LiveNodes(ast, first) : 0;
+
+        const lock_guard lock(mutex_);
+        PassStats& stats = passes_[pass].stats;
+        ++stats.runs;
+        stats.changes += changes;
+        stats.nodes_before += nodes_before;
+        stats.nodes_after += nodes_after;
+        stats.time += chrono::duration_cast<chrono::nanoseconds>(time);
+        if (pass == dump_after_ && ast.NodeCount() > first) {
+            *dump_output_ << "=== after "sv << stats.name << " ===\n"sv;
+            PrintTree(ast, static_cast<NodeId>(ast.NodeCount() - 1), *dump_output_);
+        }
+    }
+}
+
+std::vector<PassStats> PassManager::Stats() const {
+    const lock_guard lock(mutex_);
+    vector<PassStats> result;
+    result.reserve(passes_.size());
+    for (const Entry& entry : passes_) {
+        result.push_back(entry.stats);
+    }
+    return result;
+}
+
+void PassManager::PrintStats(std::ostream& out) const {
+    out << left << setw(10) << "pass"sv << right << setw(8) << "runs"sv << setw(10) << "changes"sv
+        << setw(14) << "nodes before"sv << setw(13) << "nodes after"sv << setw(11) << "time, ms"sv
+        << '\n';
+    for (const PassStats& stats : Stats()) {
+        out << left << setw(10) << stats.name << right << setw(8) << stats.runs << setw(10)
+            << stats.changes << setw(14) << stats.nodes_before << setw(13) << stats.nodes_after
+            << setw(11) << fixed << setprecision(3)
+            << chrono::duration<double, milli>(stats.time).count() << '\n';
+    }
+}
+
+namespace {
+
+struct DefaultPassManager : PassManager {
+    DefaultPassManager() {
+        Register("fold"s, FoldConstants);
+        Register("dce"s, EliminateDeadCode);
+        Register("devirt"s, DevirtualizeCalls);
+        Register("inline"s, [this](Ast& ast, NodeId first) {
+            return InlineCalls(ast, first, inline_limit);
+        });
+        Register("locals"s, ResolveLocals);
+        Register("cse"s, EliminateCommonLoads);
+        Register("types"s, [this](Ast& ast, NodeId first) {
+            if (!report_types) {
+                return SpecializeOperations(ast, first);
+            }
+            TypeCoverage coverage;
+            const size_t changed = SpecializeOperations(ast, first, &coverage);
+            const lock_guard lock(coverage_mutex);
+            type_coverage.operations += coverage.operations;
+            type_coverage.typed += coverage.typed;
+            return changed;
+        });
+        Register("unbox"s, UnboxLocals);
+        Register("fuse"s, FuseStatements);
+    }
+
+    size_t inline_limit = INLINE_MAX_NODES;
+    bool report_types = false;
+    TypeCoverage type_coverage;
+    mutex coverage_mutex;
+};
+
+DefaultPassManager& DefaultPassManagerInstance() {
+    static DefaultPassManager passes;
+    return passes;
+}
+
+}  // namespace
+
+PassManager& DefaultPasses() {
+    return DefaultPassManagerInstance();
+}
+
+void SetInlineLimit(size_t max_nodes) {
+    DefaultPassManagerInstance().inline_limit = max_nodes;
+}
+
+void EnableTypeReport() {
+    DefaultPassManagerInstance().report_types = true;
+}
+
+void PrintTypeReport(std::ostream& out) {
+    DefaultPassManager& passes = DefaultPassManagerInstance();
+    const lock_guard lock(passes.coverage_mutex);
+    const TypeCoverage& coverage = passes.type_coverage;
+    const double percent = coverage.operations == 0
+                               ? 0.0
+                               : 100.0 * static_cast<double>(coverage.typed)
+                                     / static_cast<double>(coverage.operations);
+    out << "typed operations: "sv << coverage.typed << " of "sv << coverage.operations << " ("sv
+        << fixed << setprecision(1) << percent << "%)\n"sv;
+}
+
+void RunPasses(Ast& ast, NodeId first) {
+    DefaultPasses().Run(ast, first);
+}
+
+}  // namespace flat
@@ -0,0 +1,222 @@
+#pragma once
+
+#include "flat_ast.h"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Оптимизирующие проходы по плоскому дереву программы. Проходы изменяют узлы на месте,
+// поэтому ссылки на узлы из других узлов и из методов классов остаются действительными.
+// Поведение программы, включая ошибки времени выполнения, не меняется
+namespace flat {
+
+// Свёртка констант. Заменяет константой узлы, значение которых известно до выполнения:
+// арифметику над числами, сложение строк, сравнения, not/and/or и str() от констант,
+// а также отрицательные числа, которые анализатор записывает как x * -1.
+// Деление на ноль и операции над значениями неподходящих типов не сворачиваются,
+// чтобы ошибка возникла при выполнении, как и без оптимизации.
+// Обрабатывает узлы с индексами от first; дочерние узлы должны предшествовать родительским,
+// как в дереве, построенном анализатором. Возвращает число свёрнутых узлов
+size_t FoldConstants(Ast& ast, NodeId first = 0);
+
+// Удаление недостижимого кода. Условная инструкция с константным условием заменяется
+// выполняемой веткой, а из составной инструкции удаляются инструкции после return
+// и после условных инструкций, все ветки которых завершаются return.
+// Выполняется после свёртки констант, чтобы условия вида 1 < 2 уже были константами.
+// Обрабатывает узлы с индексами от first. Возвращает число узлов, ставших недостижимыми
+size_t EliminateDeadCode(Ast& ast, NodeId first = 0);
+
+// Размещение переменных методов в ячейках кадра. Метод видит только self, свои параметры
+// и присвоенные в нём переменные, поэтому все его имена известны при разборе: self получает
+// ячейку 0, параметры - следующие ячейки, локальные переменные - остальные. Обращения
+// к переменным заменяются узлами LocalVariable и LocalAssignment, и при вызове метода
+// переменные хранятся в массиве вместо Closure.
+// Методы, в теле которых определяется класс, не изменяются.
+// Обрабатывает методы с телами от first. Возвращает число заменённых обращений к переменным
+size_t ResolveLocals(Ast& ast, NodeId first = 0);
+
+// Девиртуализация вызовов по иерархии классов, определённых в обрабатываемой части дерева.
+// Вызов self.m() в методе класса K привязывается к методу m класса K, если ни один известный
+// потомок K не переопределяет m. Иначе вызов привязывается к методу, если метод с таким именем
+// определён только в одном известном классе. Привязанный вызов (NodeKind::BoundMethodCall)
+// проверяет, что класс объекта совпадает с классом привязки, и иначе ищет метод по имени,
+// поэтому классы, определённые вне обрабатываемой части, не нарушают поведение программы.
+// Методы классов, определённых вне обрабатываемой части, не читаются: при параллельном разборе
+// их могут заполнять другие потоки. Обрабатывает узлы с индексами от first.
+// Возвращает число привязанных вызовов
+size_t DevirtualizeCalls(Ast& ast, NodeId first = 0);
+
+// Наибольшее число узлов тела метода, встраиваемого по умолчанию
+constexpr size_t INLINE_MAX_NODES = 16;
+
+// Встраивание небольших методов. Привязанный вызов (см. DevirtualizeCalls) метода, тело которого
+// находится в дереве и содержит не больше max_nodes узлов, заменяется копией тела, в которой
+// self и параметры заменены объектом и аргументами вызова. Встраиваются тела из одной инструкции
+// return и тела без return, например методы чтения и записи полей; результат тела без return -
+// None. Тело не должно присваивать переменным и вызывать метод с тем же именем.
+// Объект вызова должен быть переменной без полей, а аргументы - переменными без полей
+// или константами. Чтение неопределённой переменной - ошибка, поэтому вызов встраивается, только
+// если копия тела читает аргументы-переменные в порядке аргументов до побочных эффектов и чтения
+// полей, и подстановка не меняет поведение. Встроенный вызов (NodeKind::InlinedCall) выполняет копию тела только для экземпляров
+// класса привязки, для остальных объектов выполняется исходный вызов.
+// Копии тел добавляются в конец дерева, поэтому после них добавляется копия корня обрабатываемой
+// части. Обрабатывает узлы с индексами от first. Возвращает число встроенных вызовов
+size_t InlineCalls(Ast& ast, NodeId first = 0, size_t max_nodes = INLINE_MAX_NODES);
+
+// Устранение повторных чтений полей в методах, переменные которых размещены в ячейках
+// (см. ResolveLocals). Цепочка x.f1...fn, которая читается повторно и между чтениями не может
+// измениться, вычисляется один раз: первое чтение сохраняет значение во временную ячейку кадра,
+// повторные читают его из ячейки, а цепочки x.f1...fn.g читают из неё оставшиеся поля.
+// Значение считается неизменным, пока не выполнено присваивание переменной x или полю с именем
+// одного из f1...fn, вызов метода или операция, которая может вызвать метод класса: +, сравнение,
+// str() или print. Значение, вычисленное в ветке условной инструкции, правом аргументе and
+// и or или во встроенном вызове, за их пределами не используется.
+// Обрабатывает методы с телами от first. Возвращает число заменённых чтений
+size_t EliminateCommonLoads(Ast& ast, NodeId first = 0);
+
+// Доказанный тип значения узла. Для экземпляра класса cls - его класс
+struct NodeType {
+    ValueType type = ValueType::Unknown;
+    const runtime::Class* cls = nullptr;
+
+    bool operator==(const NodeType& other) const {
+        return type == other.type && cls == other.cls;
+    }
+    bool operator!=(const NodeType& other) const {
+        return !(*this == other);
+    }
+};
+
+// Вывод типов. Обходит тела методов с телами от first и корень обрабатываемой части в порядке
+// выполнения. Тип известен у констант, None, результатов арифметики, сравнений, логических
+// операций, str() и создания экземпляра, а также у переменных без цепочки полей, которым
+// на каждом пути выполнения до чтения присвоено значение одного типа. Типы параметров, полей
+// и результатов вызовов не выводятся. Возвращает типы узлов по их индексам
+std::vector<NodeType> InferTypes(const Ast& ast, NodeId first = 0);
+
+// Доля операций с доказанными типами: бинарных операций, сравнений и условных инструкций
+struct TypeCoverage {
+    size_t operations = 0;
+    size_t typed = 0;
+};
+
+// Специализация операций по выведенным типам (см. InferTypes). Арифметика над двумя числами,
+// сложение и сравнение двух строк и сравнение двух чисел записывают тип аргументов в операнд c,
+// и при выполнении их типы не проверяются. Проход выполняется после проходов, меняющих дерево.
+// Обрабатывает узлы с индексами от first. Если coverage не nullptr, добавляет к нему число
+// операций, а также число специализированных операций и условных инструкций с выведенным
+// типом условия. Возвращает число узлов, тип аргументов которых изменился
+size_t SpecializeOperations(Ast& ast, NodeId first = 0, TypeCoverage* coverage = nullptr);
+
+// Анализ выхода значений переменных за пределы кадра в методах, переменные которых размещены
+// в ячейках (см. ResolveLocals). Промежуточные результаты арифметики не создают объектов
+// при любом дереве, а переменная, которая читается только аргументами арифметики и сравнений,
+// не покидает кадр: её значение не попадает в Closure, поле, аргумент вызова или return.
+// Присваивания-инструкции таким переменным заменяются узлами ScratchAssignment, которые хранят
+// число в ячейке без создания объекта. Обрабатывает методы с телами от first.
+// Возвращает число заменённых присваиваний
+size_t UnboxLocals(Ast& ast, NodeId first = 0);
+
+// Слияние инструкций частых видов. Инструкция x.f = x.f + k, где x - переменная без полей,
+// заменяется узлом NodeKind::FieldIncrement, инструкция x = x + k для переменной в ячейке -
+// узлом LocalIncrement, а return x.f1...fn для переменной в ячейке - узлом ReturnLocal.
+// Слитый узел выполняется за один переход по дереву: переменная и поле читаются один раз,
+// а число в ячейке без объекта (см. UnboxLocals) увеличивается без создания объекта.
+// Условие вида a < b условная инструкция и так вычисляет без создания объекта Bool,
+// поэтому оно не сливается. Другие проходы не ищут шаблоны в слитых узлах, поэтому проход выполняется
+// последним. Обрабатывает составные инструкции с индексами от first.
+// Возвращает число слитых инструкций
+size_t FuseStatements(Ast& ast, NodeId first = 0);
+
+// Оптимизирующий проход: обрабатывает узлы с индексами от first и возвращает число изменений
+using Pass = std::function<size_t(Ast& ast, NodeId first)>;
+
+// Статистика прохода, накопленная за все его запуски
+struct PassStats {
+    std::string name;
+    size_t runs = 0;
+    // Сумма результатов прохода: числа свёрнутых, удалённых или заменённых узлов
+    size_t changes = 0;
+    // Суммы чисел живых узлов до и после прохода (см. PassManager::Run)
+    size_t nodes_before = 0;
+    size_t nodes_after = 0;
+    std::chrono::nanoseconds time{};
+};
+
+// Конвейер оптимизирующих проходов. Проходы регистрируются по имени и выполняются в порядке
+// конвейера. При параллельном разборе Run вызывается из нескольких потоков одновременно,
+// поэтому конвейер настраивается до начала разбора
+class PassManager {
+public:
+    // Регистрирует проход name и добавляет его в конец конвейера
+    void Register(std::string name, Pass pass);
+
+    // Заменяет конвейер проходами из списка имён через запятую. Проходы выполняются в порядке
+    // списка, проход может встречаться в нём несколько раз, пустой список отключает проходы.
+    // Выбрасывает std::invalid_argument, если проход с таким именем не зарегистрирован
+    void SetPipeline(std::string_view names);
+    // Имена проходов конвейера через запятую
+    [[nodiscard]] std::string Pipeline() const;
+
+    // После каждого запуска прохода name печатает в out обработанную часть дерева
+    void DumpAfter(std::string_view name, std::ostream& out);
+    // Включает сбор статистики: времени работы проходов и числа живых узлов до и после них
+    void EnableStats();
+
+    // Выполняет проходы конвейера над узлами с индексами от first. Корнем обрабатываемой части
+    // считается её последний узел, как в дереве, построенном анализатором. Живыми считаются
+    // узлы, достижимые из корня и из тел методов, начинающихся не раньше first
+    void Run(Ast& ast, NodeId first = 0);
+
+    // Статистика зарегистрированных проходов в порядке регистрации
+    [[nodiscard]] std::vector<PassStats> Stats() const;
+    // Печатает статистику проходов таблицей
+    void PrintStats(std::ostream& out) const;
+
+private:
+    struct Entry {
+        Pass pass;
+        PassStats stats;
+    };
+
+    [[nodiscard]] size_t Find(std::string_view name) const;
+
+    std::vector<Entry> passes_;
+    // Индексы проходов конвейера в passes_
+    std::vector<size_t> pipeline_;
+    size_t dump_after_ = std::numeric_limits<size_t>::max();
+    std::ostream* dump_output_ = nullptr;
+    bool collect_stats_ = false;
+    // Защищает статистику и вывод дерева при одновременных вызовах Run
+    mutable std::mutex mutex_;
+};
+
+// Стандартный конвейер: fold (FoldConstants), dce (EliminateDeadCode), devirt (DevirtualizeCalls),
+// inline (InlineCalls), locals (ResolveLocals), cse (EliminateCommonLoads),
+// types (SpecializeOperations), unbox (UnboxLocals) и fuse (FuseStatements)
+PassManager& DefaultPasses();
+
+// Задаёт наибольшее число узлов тела метода, встраиваемого проходом inline стандартного конвейера.
+// Как и конвейер, настраивается до начала разбора
+void SetInlineLimit(size_t max_nodes);
+
+// Включает подсчёт операций с доказанными типами проходом types стандартного конвейера
+void EnableTypeReport();
+// Печатает долю операций с доказанными типами, накопленную проходом types стандартного конвейера
+void PrintTypeReport(std::ostream& out);
+
+// Выполняет стандартный конвейер над узлами с индексами от first
+void RunPasses(Ast& ast, NodeId first = 0);
+
+// Печатает поддерево root по узлу в строке с отступом по глубине. Под определением класса
+// печатаются его методы, тела которых находятся в этом же дереве
+void PrintTree(const Ast& ast, NodeId root, std::ostream& out);
+
+}  // namespace flat
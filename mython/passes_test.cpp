@@ -0,0 +1,1056 @@
+#include "lexer.h"
+#include "parse.h"
+#include "passes.h"
+#include "test_runner_p.h"
+
+using namespace std;
+
+namespace flat {
+
+namespace {
+
+// Разобранная без оптимизаций программа
+struct Program {
+    explicit Program(const string& source) {
+        parse::Lexer lexer(string_view{source});
+        root = ParseProgram(lexer, ast);
+    }
+
+    // Узел значения инструкции присваивания номер index в корне программы
+    [[nodiscard]] NodeId AssignedValue(size_t index) const {
+        const NodeId statement = ast.List(ast.GetOperands(root).a)[index];
+        return ast.GetOperands(statement).b;
+    }
+
+    string Run() {
+        runtime::DummyContext context;
+        runtime::Closure closure;
+        ast.Execute(root, closure, context);
+        return context.output.str();
+    }
+
+    Ast ast;
+    NodeId root = NO_NODE;
+};
+
+string ConstantText(const Ast& ast, NodeId node) {
+    ASSERT(ast.Kind(node) == NodeKind::Constant);
+    runtime::DummyContext context;
+    ast.Constant(ast.GetOperands(node).a)->Print(context.output, context);
+    return context.output.str();
+}
+
+void TestFoldArithmetic() {
+    Program program("a = 2*5+10/2\nb = -5\nc = -(3 - 10) * -2\nd = 'ab' + 'cd' + str(12)\n"s);
+    const size_t folded = FoldConstants(program.ast);
+    ASSERT_EQUAL(ConstantText(program.ast, program.AssignedValue(0)), "15"s);
+    ASSERT_EQUAL(ConstantText(program.ast, program.AssignedValue(1)), "-5"s);
+    ASSERT_EQUAL(ConstantText(program.ast, program.AssignedValue(2)), "-14"s);
+    ASSERT_EQUAL(ConstantText(program.ast, program.AssignedValue(3)), "abcd12"s);
+    ASSERT_EQUAL(folded, 11u);
+    // Повторный проход ничего не меняет
+    ASSERT_EQUAL(FoldConstants(program.ast), 0u);
+}
+
+void TestFoldLogic() {
+    Program program(
+        "a = 1 < 2\nb = 'x' == 'y'\nc = not 0\nd = not None\ne = 0 or 'text'\nf = 1 and None\n"
+        "g = True or x\nh = False and x\ni = 1 >= 1 and not False\n"s);
+    FoldConstants(program.ast);
+    const vector<string> expected = {"True"s,  "False"s, "True"s, "False"s, "True"s,
+                                     "False"s, "True"s,  "False"s, "True"s};
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQUAL(ConstantText(program.ast, program.AssignedValue(i)), expected[i]);
+    }
+}
+
+void TestKeepsRuntimeErrors() {
+    // Деление на ноль, операции над несовместимыми типами и выражения с переменными
+    // остаются в дереве
+    Program program("a = 1 / 0\nb = 'a' - 1\nc = 1 < 'a'\nd = x + 1 * 2\ne = 0 or x\n"s);
+    FoldConstants(program.ast);
+    ASSERT(program.ast.Kind(program.AssignedValue(0)) == NodeKind::Div);
+    ASSERT(program.ast.Kind(program.AssignedValue(1)) == NodeKind::Sub);
+    ASSERT(program.ast.Kind(program.AssignedValue(2)) == NodeKind::Less);
+    const NodeId sum = program.AssignedValue(3);
+    ASSERT(program.ast.Kind(sum) == NodeKind::Add);
+    ASSERT_EQUAL(ConstantText(program.ast, program.ast.GetOperands(sum).b), "2"s);
+    ASSERT(program.ast.Kind(program.AssignedValue(4)) == NodeKind::Or);
+
+    Program division("print 'before'\nx = 10 / (5 - 5)\n"s);
+    FoldConstants(division.ast);
+    ASSERT_THROWS(division.Run(), std::runtime_error);
+}
+
+void TestFoldedProgramOutput() {
+    const string source = R"(
+class Shape:
+  def area():
+    return -2 * -3 + 10 / 2
+
+s = Shape()
+print s.area(), 'a' + 'b', not 1 == 2, str(7) + str(None), -(-4)
+)"s;
+    Program plain(source);
+    Program folded(source);
+    ASSERT(FoldConstants(folded.ast) > 0);
+    ASSERT_EQUAL(folded.Run(), plain.Run());
+    ASSERT_EQUAL(folded.Run(), "11 ab True 7None 4\n"s);
+}
+
+// Число узлов, достижимых из node
+size_t CountNodes(const Ast& ast, NodeId node) {
+    const Operands& op = ast.GetOperands(node);
+    size_t count = 1;
+    const auto count_list = [&](ListId list) {
+        for (NodeId child : ast.List(list)) {
+            count += CountNodes(ast, child);
+        }
+    };
+    switch (ast.Kind(node)) {
+    case NodeKind::Constant:
+    case NodeKind::None:
+    case NodeKind::Variable:
+    case NodeKind::LocalVariable:
+    case NodeKind::ClassDefinition:
+        break;
+    case NodeKind::Assignment:
+    case NodeKind::LocalAssignment:
+        count += CountNodes(ast, op.b);
+        break;
+    case NodeKind::FieldAssignment:
+        count += CountNodes(ast, op.a) + CountNodes(ast, op.c);
+        break;
+    case NodeKind::NewInstance:
+        count_list(op.b);
+        break;
+    case NodeKind::Print:
+    case NodeKind::Compound:
+        count_list(op.a);
+        break;
+    case NodeKind::Return:
+    case NodeKind::Not:
+    case NodeKind::Stringify:
+        count += CountNodes(ast, op.a);
+        break;
+    case NodeKind::MethodCall:
+    case NodeKind::BoundMethodCall:
+        count += CountNodes(ast, op.a);
+        count_list(op.c);
+        break;
+    case NodeKind::IfElse:
+        count += CountNodes(ast, op.a) + CountNodes(ast, op.b);
+        if (op.c != NO_NODE) {
+            count += CountNodes(ast, op.c);
+        }
+        break;
+    default:
+        count += CountNodes(ast, op.a) + CountNodes(ast, op.b);
+        break;
+    }
+    return count;
+}
+
+void TestEliminateBranches() {
+    Program program(R"(
+if True:
+  print 'on'
+else:
+  print 'off'
+if 1 > 2:
+  print 'never'
+if None:
+  print 'never'
+else:
+  if 'yes':
+    print 'nested'
+print 'end'
+)"s);
+    const string expected = program.Run();
+    const size_t before = CountNodes(program.ast, program.root);
+    FoldConstants(program.ast);
+    const size_t after_fold = CountNodes(program.ast, program.root);
+    const size_t removed = EliminateDeadCode(program.ast);
+    ASSERT_EQUAL(CountNodes(program.ast, program.root), after_fold - removed);
+    ASSERT(removed > 0 && after_fold < before);
+
+    // Остались только инструкции print
+    const ListView statements = program.ast.List(program.ast.GetOperands(program.root).a);
+    ASSERT_EQUAL(statements.size(), 3u);
+    for (NodeId statement : statements) {
+        ASSERT(program.ast.Kind(statement) == NodeKind::Compound
+               || program.ast.Kind(statement) == NodeKind::Print);
+    }
+    ASSERT_EQUAL(program.Run(), expected);
+    ASSERT_EQUAL(expected, "on\nnested\nend\n"s);
+    ASSERT_EQUAL(EliminateDeadCode(program.ast), 0u);
+}
+
+void TestPruneAfterReturn() {
+    const string source = R"(
+class Sign:
+  def of(x):
+    if x < 0:
+      return -1
+    else:
+      if x == 0:
+        return 0
+      return 1
+      print 'unreachable'
+    print 'unreachable'
+    return 2
+
+  def first():
+    return 'first'
+    return 'second'
+
+s = Sign()
+print s.of(-5), s.of(0), s.of(7), s.first()
+if s.of(1) > 0:
+  print 'positive'
+)"s;
+    Program plain(source);
+    Program pruned(source);
+    const size_t removed = EliminateDeadCode(pruned.ast);
+    // Удаляются два print 'unreachable', return 2 и return 'second', по два узла в каждом
+    ASSERT_EQUAL(removed, 8u);
+    ASSERT_EQUAL(pruned.Run(), plain.Run());
+    ASSERT_EQUAL(pruned.Run(), "-1 0 1 first\npositive\n"s);
+}
+
+void TestDeadCodeKeepsUnknownConditions() {
+    Program program("x = 0\nif x:\n  print 'a'\nif x or True:\n  print 'b'\n"s);
+    FoldConstants(program.ast);
+    ASSERT_EQUAL(EliminateDeadCode(program.ast), 0u);
+    ASSERT_EQUAL(program.Run(), "b\n"s);
+}
+
+// Число узлов вида kind в дереве
+size_t CountKind(const Ast& ast, NodeKind kind) {
+    size_t count = 0;
+    for (NodeId node = 0; node < ast.NodeCount(); ++node) {
+        count += ast.Kind(node) == kind ? 1 : 0;
+    }
+    return count;
+}
+
+void TestResolveLocals() {
+    const string source = R"(
+class Point:
+  def __init__(x, y):
+    self.x = x
+    self.y = y
+  def __eq__(other):
+    return self.x == other.x and self.y == other.y
+  def __str__():
+    return str(self.x) + ':' + str(self.y)
+  def shifted(dx, dy):
+    nx = self.x + dx
+    ny = self.y + dy
+    if nx < 0:
+      nx = None
+    self.x = nx
+    self.y = ny
+    return self
+
+p = Point(1, 2)
+r = Point(1, 2)
+q = r.shifted(-3, 4)
+print p, q, p == Point(1, 2), q.x
+)"s;
+    Program plain(source);
+    Program resolved(source);
+    // Обращения к переменным в методах: 4 в __init__ и __eq__, 2 в __str__, 13 в shifted
+    ASSERT_EQUAL(ResolveLocals(resolved.ast), 23u);
+    for (uint32_t method = 0; method < resolved.ast.MethodCount(); ++method) {
+        ASSERT(resolved.ast.Method(method).slot_count > 0);
+    }
+    // Метод shifted: self, dx, dy, nx и ny
+    ASSERT_EQUAL(resolved.ast.Method(3).slot_count, 5u);
+    // Переменные верхнего уровня остаются в Closure
+    ASSERT_EQUAL(CountKind(resolved.ast, NodeKind::Variable), 5u);
+    ASSERT_EQUAL(resolved.Run(), plain.Run());
+    ASSERT_EQUAL(resolved.Run(), "1:2 None:6 True None\n"s);
+    ASSERT_EQUAL(ResolveLocals(resolved.ast), 0u);
+}
+
+void TestResolvedLocalsErrors() {
+    Program program(R"(
+class Broken:
+  def read_before_write():
+    y = x
+    x = 1
+  def unknown():
+    return z
+  def none_is_defined():
+    n = None
+    return n
+
+b = Broken()
+print b.none_is_defined()
+)"s);
+    ResolveLocals(program.ast);
+    ASSERT_EQUAL(program.Run(), "None\n"s);
+    for (const string& call : {"b.read_before_write()"s, "b.unknown()"s}) {
+        Program failing(R"(
+class Broken:
+  def read_before_write():
+    y = x
+    x = 1
+  def unknown():
+    return z
+
+b = Broken()
+)"s + call + "\n"s);
+        ResolveLocals(failing.ast);
+        ASSERT_THROWS(failing.Run(), std::runtime_error);
+    }
+}
+
+void TestResolveSkipsNestedClasses() {
+    Program program(R"(
+class Outer:
+  def make():
+    class Inner:
+      def get():
+        return 5
+    return Inner()
+
+o = Outer()
+i = o.make()
+print i.get()
+)"s);
+    ResolveLocals(program.ast);
+    // Тело get разобрано раньше тела make, определяющего класс Inner
+    ASSERT(program.ast.Method(0).slot_count > 0);
+    ASSERT_EQUAL(program.ast.Method(1).slot_count, 0u);
+    ASSERT_EQUAL(program.Run(), "5\n"s);
+}
+
+void TestPassManager() {
+    PassManager passes;
+    vector<string> order;
+    const auto trace = [&order](string name, Pass pass) {
+        return [&order, name = std::move(name), pass = std::move(pass)](Ast& ast, NodeId first) {
+            order.push_back(name);
+            return pass(ast, first);
+        };
+    };
+    passes.Register("fold"s, trace("fold"s, FoldConstants));
+    passes.Register("dce"s, trace("dce"s, EliminateDeadCode));
+    passes.Register("locals"s, trace("locals"s, ResolveLocals));
+    ASSERT_EQUAL(passes.Pipeline(), "fold,dce,locals"s);
+    ASSERT_THROWS(passes.SetPipeline("fold,inline"s), std::invalid_argument);
+    ASSERT_THROWS(passes.DumpAfter("unknown"s, cerr), std::invalid_argument);
+
+    // Проходы выполняются в порядке списка и могут повторяться
+    passes.SetPipeline("dce,fold,dce"s);
+    ASSERT_EQUAL(passes.Pipeline(), "dce,fold,dce"s);
+    ostringstream dump;
+    passes.DumpAfter("fold"s, dump);
+    passes.EnableStats();
+
+    Program program("if 2 * 3 > 5:\n  print 'big', -1\nelse:\n  print 'small'\n"s);
+    passes.Run(program.ast);
+    ASSERT_EQUAL(order, (vector<string>{"dce"s, "fold"s, "dce"s}));
+    ASSERT_EQUAL(program.Run(), "big -1\n"s);
+    ASSERT_EQUAL(dump.str(),
+                 "=== after fold ===\n"
+                 "Compound\n"
+                 "  IfElse\n"
+                 "    Constant True\n"
+                 "    Compound\n"
+                 "      Print\n"
+                 "        Constant 'big'\n"
+                 "        Constant -1\n"
+                 "    Compound\n"
+                 "      Print\n"
+                 "        Constant 'small'\n"s);
+
+    const vector<PassStats> stats = passes.Stats();
+    ASSERT_EQUAL(stats.size(), 3u);
+    // Первый запуск dce ничего не меняет, второй оставляет только ветку if
+    ASSERT_EQUAL(stats[1].name, "dce"s);
+    ASSERT_EQUAL(stats[1].runs, 2u);
+    ASSERT_EQUAL(stats[1].nodes_before, 16u + 10u);
+    ASSERT_EQUAL(stats[1].nodes_after, 16u + 5u);
+    ASSERT_EQUAL(stats[1].changes, 5u);
+    // Свёртка условия и отрицательного числа
+    ASSERT_EQUAL(stats[0].runs, 1u);
+    ASSERT_EQUAL(stats[0].nodes_before - stats[0].nodes_after, 6u);
+    ASSERT_EQUAL(stats[2].runs, 0u);
+
+    ostringstream table;
+    passes.PrintStats(table);
+    ASSERT(table.str().find("dce"s) != string::npos);
+
+    // Пустой список отключает проходы
+    passes.SetPipeline(""s);
+    order.clear();
+    passes.Run(program.ast);
+    ASSERT(order.empty());
+}
+
+void TestPrintTree() {
+    Program program(R"(
+class Pair:
+  def __init__(a, b):
+    self.first = a
+    x = a
+    self.second = str(x)
+p = Pair(1, None)
+p.first = not p.second
+)"s);
+    ResolveLocals(program.ast);
+    ostringstream out;
+    PrintTree(program.ast, program.root, out);
+    ASSERT_EQUAL(out.str(),
+                 "Compound\n"
+                 "  ClassDefinition Pair\n"
+                 "    def __init__(a, b) [slots 4]\n"
+                 "      Compound\n"
+                 "        FieldAssignment .first\n"
+                 "          LocalVariable self [slot 0]\n"
+                 "          LocalVariable a [slot 1]\n"
+                 "        LocalAssignment x [slot 3]\n"
+                 "          LocalVariable a [slot 1]\n"
+                 "        FieldAssignment .second\n"
+                 "          LocalVariable self [slot 0]\n"
+                 "          Stringify\n"
+                 "            LocalVariable x [slot 3]\n"
+                 "  Assignment p\n"
+                 "    NewInstance Pair\n"
+                 "      Constant 1\n"
+                 "      None\n"
+                 "  FieldAssignment .first\n"
+                 "    Variable p\n"
+                 "    Not\n"
+                 "      Variable p.second\n"s);
+}
+
+void TestDevirtualizeCalls() {
+    const string source = R"(
+class Shape:
+  def area():
+    return 0
+  def describe():
+    return 'area ' + str(self.area())
+  def twice():
+    return self.unit() * 4
+  def unit():
+    return 1
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.w = w
+    self.h = h
+  def area():
+    return self.w * self.h
+  def scaled(k):
+    return self.area() * k
+  def broken():
+    self = Shape()
+    return self.area()
+
+r = Rect(2, 3)
+s = Shape()
+print r.describe(), s.describe(), r.scaled(2), r.twice(), s.twice(), r.unit(1), r.broken()
+)"s;
+    Program plain(source);
+    Program bound(source);
+    // self.unit() и self.area() в scaled, а также вызовы верхнего уровня, кроме вызова
+    // с неверным числом аргументов. Метод area переопределён, поэтому self.area() в describe
+    // и в broken, где self заменён, не привязываются
+    ASSERT_EQUAL(DevirtualizeCalls(bound.ast), 8u);
+    ASSERT_EQUAL(CountKind(bound.ast, NodeKind::MethodCall), 3u);
+
+    ostringstream tree;
+    PrintTree(bound.ast, bound.root, tree);
+    ASSERT(tree.str().find("BoundMethodCall .area [Rect]"s) != string::npos);
+    ASSERT(tree.str().find("BoundMethodCall .unit [Shape]"s) != string::npos);
+
+    // Вызовы для экземпляров Rect методов, привязанных к Shape, проходят через поиск по имени
+    ASSERT_EQUAL(bound.Run(), plain.Run());
+    ASSERT_EQUAL(bound.Run(), "area 6 area 0 12 4 4 None 0\n"s);
+    ASSERT_EQUAL(DevirtualizeCalls(bound.ast), 0u);
+}
+
+void TestDevirtualizedCallGuard() {
+    // Инструкции разбираются и оптимизируются по одной, поэтому при анализе класса A
+    // класс B ещё неизвестен и o.get() привязывается к единственной реализации A.get
+    istringstream input(R"(
+class A:
+  def get():
+    return 'a'
+  def call_get(o):
+    return o.get()
+
+class B:
+  def get():
+    return 'b'
+
+a = A()
+print a.call_get(a), a.call_get(B()), a.call_get(1)
+)"s);
+    parse::Lexer lexer(input);
+    runtime::DummyContext context;
+    runtime::Closure closure;
+    vector<unique_ptr<runtime::Executable>> statements;
+    ParseProgram(lexer, [&](unique_ptr<runtime::Executable> statement) {
+        statement->Execute(closure, context);
+        statements.push_back(std::move(statement));
+    });
+    ASSERT_EQUAL(context.output.str(), "a b None\n"s);
+}
+
+void TestInlineCalls() {
+    const string source = R"(
+class Point:
+  def __init__(x):
+    self.x = x
+  def get():
+    return self.x
+  def set(v):
+    self.x = v
+  def add(d):
+    self.x = self.x + d
+  def bump():
+    self.x = self.x + 1
+    return self.x
+  def down(n):
+    if n > 0:
+      return self.down(n - 1)
+    return n
+
+class Labeled(Point):
+  def label():
+    return 'L'
+
+p = Point(1)
+q = Labeled(5)
+p.set(p.get() + 1)
+p.add(p.bump())
+print p.get(), q.get(), p.down(3)
+q.set(7)
+print q.get(), p.set(0)
+)"s;
+    Program plain(source);
+    Program inlined(source);
+    DevirtualizeCalls(inlined.ast);
+    // Тела get и set больше двух узлов
+    ASSERT_EQUAL(InlineCalls(inlined.ast, 0, 2), 0u);
+    // Вызовы get и set. Метод add читает поле раньше, чем вычисляется аргумент с побочным
+    // эффектом, тело bump состоит из двух инструкций, а down вызывает сам себя
+    ASSERT_EQUAL(InlineCalls(inlined.ast), 7u);
+    // Копия аргумента p.get() + 1 в теле set содержит ещё один встроенный вызов get
+    ASSERT_EQUAL(CountKind(inlined.ast, NodeKind::InlinedCall), 8u);
+    ASSERT(inlined.ast.Kind(static_cast<NodeId>(inlined.ast.NodeCount() - 1))
+           == NodeKind::Compound);
+
+    ostringstream tree;
+    PrintTree(inlined.ast, inlined.root, tree);
+    ASSERT(tree.str().find("InlinedCall [Point]\n"
+                           "    BoundMethodCall .set [Point]\n"s)
+           != string::npos);
+    ASSERT(tree.str().find("      FieldAssignment .x\n"
+                           "        Variable p\n"s)
+           != string::npos);
+
+    // Копия тела set получает свою копию аргумента p.get() + 1, а не общий с исходным
+    // вызовом узел
+    size_t computed_args = 0;
+    for (NodeId node = 0; node < inlined.ast.NodeCount(); ++node) {
+        if (inlined.ast.Kind(node) != NodeKind::InlinedCall) {
+            continue;
+        }
+        const Operands& op = inlined.ast.GetOperands(node);
+        NodeId body = op.b;
+        if (inlined.ast.Kind(body) == NodeKind::Compound) {
+            body = inlined.ast.List(inlined.ast.GetOperands(body).a)[0];
+        }
+        if (inlined.ast.Kind(body) != NodeKind::FieldAssignment) {
+            continue;
+        }
+        const NodeId value = inlined.ast.GetOperands(body).c;
+        for (NodeId arg : inlined.ast.List(inlined.ast.GetOperands(op.a).c)) {
+            ASSERT(arg != value);
+            computed_args += inlined.ast.Kind(arg) == NodeKind::Add ? 1 : 0;
+        }
+    }
+    ASSERT_EQUAL(computed_args, 1u);
+
+    // Для экземпляров Labeled выполняется исходный вызов
+    ASSERT_EQUAL(inlined.Run(), plain.Run());
+    ASSERT_EQUAL(inlined.Run(), "6 5 0\n7 None\n"s);
+
+    // Встроенные тела выполняются и после размещения переменных в ячейках
+    Program limited(source);
+    DevirtualizeCalls(limited.ast);
+    ASSERT_EQUAL(InlineCalls(limited.ast, 0, 3), 4u);
+    ASSERT(ResolveLocals(limited.ast) > 0);
+    ASSERT_EQUAL(limited.Run(), "6 5 0\n7 None\n"s);
+}
+
+void TestInlinedCallErrors() {
+    // Аргументы встроенного вызова, как и прежде, вычисляются раньше объекта,
+    // а печать не начинается до вычисления аргумента
+    const string source = R"(
+class Box:
+  def __init__():
+    self.v = 1
+  def show(a, b):
+    print a, b
+  def first(a, b):
+    return a
+  def put(v):
+    self.v = v
+  def field(o):
+    return o.v
+  def swap(a, b):
+    print b, a
+  def announce(a):
+    print 'before'
+    print a
+)"s;
+    // Встроенный announce напечатал бы строку до ошибки чтения аргумента
+    Program announced(source + "b = Box()\nb.announce(undefined)"s);
+    DevirtualizeCalls(announced.ast);
+    ASSERT_EQUAL(InlineCalls(announced.ast), 0u);
+
+    for (const string& statement : {"b = Box()\nb.show('x', b.v + 'y')"s,
+                                    "b = Box()\nprint b.first(b.v, undefined)"s,
+                                    "b = Box()\nb.swap(first_undefined, second_undefined)"s,
+                                    "missing.put(1 + 'a')"s, "b = Box()\nprint b.field(1)"s}) {
+        Program plain(source + statement);
+        Program inlined(source + statement);
+        DevirtualizeCalls(inlined.ast);
+        InlineCalls(inlined.ast);
+        ResolveLocals(inlined.ast);
+        string expected;
+        try {
+            plain.Run();
+        } catch (const runtime_error& error) {
+            expected = error.what();
+        }
+        ASSERT(!expected.empty());
+        try {
+            inlined.Run();
+            ASSERT(false);
+        } catch (const runtime_error& error) {
+            ASSERT_EQUAL(string(error.what()), expected);
+        }
+    }
+}
+
+void TestEliminateCommonLoads() {
+    const string source = R"(
+class Pos:
+  def __init__():
+    self.x = 1
+    self.y = 2
+
+class Rect:
+  def __init__(w, h):
+    self.w = w
+    self.h = h
+    self.pos = Pos()
+  def area():
+    return self.w * self.h + self.w
+  def moved(dx):
+    self.pos.x = self.pos.x + dx
+    self.pos.y = self.pos.y + self.pos.x
+    return self.pos.x * self.pos.y - self.w * self.w
+  def ratio(k):
+    if k > self.w:
+      return self.w - self.h
+    return self.h / self.w
+
+r = Rect(3, 4)
+print r.area(), r.moved(5), r.ratio(1), r.ratio(10)
+)"s;
+    Program plain(source);
+    Program optimized(source);
+    ResolveLocals(optimized.ast);
+    const uint32_t slots = optimized.ast.Method(2).slot_count;
+    // area: второе чтение self.w. moved: self.pos.x и self.pos.y в первых двух инструкциях
+    // и второе чтение self.w. Сравнение и сложение с полем могут вызвать метод, поэтому
+    // self.pos читается заново после каждого сложения, а в ratio замен нет
+    ASSERT_EQUAL(EliminateCommonLoads(optimized.ast), 5u);
+    // Временная ячейка для self.w
+    ASSERT_EQUAL(optimized.ast.Method(2).slot_count, slots + 1);
+    ASSERT_EQUAL(optimized.Run(), plain.Run());
+    ASSERT_EQUAL(optimized.Run(), "15 39 1 -1\n"s);
+    ASSERT_EQUAL(EliminateCommonLoads(optimized.ast), 0u);
+
+    // Методы с переменными в Closure не обрабатываются
+    Program unresolved(source);
+    ASSERT_EQUAL(EliminateCommonLoads(unresolved.ast), 0u);
+}
+
+void TestCommonLoadsBarriers() {
+    // Вызов метода, в том числе неявный в + и сравнении экземпляра, может изменить поле
+    const string source = R"(
+class Cell:
+  def __init__():
+    self.v = 1
+  def bump():
+    self.v = self.v + 1
+  def __add__(o):
+    self.v = self.v * 10
+    return o
+  def __lt__(o):
+    self.v = 0
+    return True
+
+class User:
+  def __init__():
+    self.c = Cell()
+  def call():
+    a = self.c.v
+    self.c.bump()
+    return a + self.c.v
+  def add():
+    a = self.c.v
+    b = self.c + 1
+    return a + b + self.c.v
+  def less():
+    a = self.c.v
+    if self.c < 1:
+      a = a + self.c.v
+    return a
+  def assign(u):
+    a = self.c.v
+    u.c.v = 5
+    b = self.c.v
+    self = u
+    return a + b + self.c.v
+
+u = User()
+print u.call(), u.add(), u.less(), u.call()
+w = User()
+print u.assign(w), u.assign(u)
+)"s;
+    Program plain(source);
+    Program optimized(source);
+    ResolveLocals(optimized.ast);
+    EliminateCommonLoads(optimized.ast);
+    ASSERT_EQUAL(optimized.Run(), plain.Run());
+    ASSERT_EQUAL(optimized.Run(), "3 23 20 1\n7 11\n"s);
+}
+
+void TestCommonLoadsInInlinedArguments() {
+    const string source = R"(
+class P:
+  def __init__():
+    self.c = 2
+    self.a = self.c * 3
+    self.set(self.c * 5)
+  def set(v):
+    self.b = v
+
+p = P()
+print p.a, p.b
+)"s;
+    Program plain(source);
+    Program optimized(source);
+    RunPasses(optimized.ast);
+    ASSERT_EQUAL(plain.Run(), "6 10\n"s);
+    ASSERT_EQUAL(optimized.Run(), plain.Run());
+
+    // Узел, общий для копии тела и исходного вызова, читает self.c сам, а не из ячейки:
+    // иначе он был бы заменён дважды
+    Program shared(source);
+    DevirtualizeCalls(shared.ast);
+    ASSERT_EQUAL(InlineCalls(shared.ast), 1u);
+    ResolveLocals(shared.ast);
+    for (NodeId node = 0; node < shared.ast.NodeCount(); ++node) {
+        if (shared.ast.Kind(node) == NodeKind::InlinedCall) {
+            const Operands& op = shared.ast.GetOperands(node);
+            const NodeId body = shared.ast.List(shared.ast.GetOperands(op.b).a)[0];
+            const NodeId value = shared.ast.GetOperands(body).c;
+            shared.ast.SetList(shared.ast.GetOperands(op.a).c, &value, &value + 1);
+        }
+    }
+    // Единственное повторное чтение self.c - общий узел, поэтому замен нет
+    ASSERT_EQUAL(EliminateCommonLoads(shared.ast), 0u);
+    ASSERT_EQUAL(shared.Run(), plain.Run());
+}
+
+void TestInferTypes() {
+    Program program(R"(
+class P:
+  def __init__():
+    self.v = 1
+a = 1
+b = 'x' + 'y'
+c = a < 2
+d = None
+e = P()
+f = e + 1
+g = a * e.v
+if c:
+  a = 's'
+h = a
+if c:
+  b = 'z'
+else:
+  b = str(a)
+k = b
+)"s);
+    const vector<NodeType> types = InferTypes(program.ast);
+    // Инструкция 0 - определение класса
+    const auto type_of = [&](size_t statement) {
+        return types[program.AssignedValue(statement)].type;
+    };
+    ASSERT(type_of(1) == ValueType::Number);
+    ASSERT(type_of(2) == ValueType::String);
+    ASSERT(type_of(3) == ValueType::Bool);
+    ASSERT(type_of(4) == ValueType::None);
+    ASSERT(type_of(5) == ValueType::Instance);
+    ASSERT_EQUAL(types[program.AssignedValue(5)].cls->GetName(), "P"s);
+    // Сложение с экземпляром вызывает __add__, а поля не отслеживаются
+    ASSERT(type_of(6) == ValueType::Unknown);
+    ASSERT(type_of(7) == ValueType::Number);
+    // Переменной a в одной из веток присвоена строка, b в обеих ветках - строки
+    ASSERT(type_of(9) == ValueType::Unknown);
+    ASSERT(type_of(11) == ValueType::String);
+}
+
+void TestSpecializeOperations() {
+    const string source = R"(
+class Acc:
+  def __init__():
+    self.v = 0
+  def run(n):
+    i = 0
+    s = 'a'
+    if n > 0:
+      i = i + 1
+      s = s + 'b'
+    else:
+      i = 2
+    t = i * 2 + 1
+    if t > 3 or s == 'ab':
+      print s + str(t), t <= i, s < 'b'
+    return self.v + t
+
+a = Acc()
+x = 3
+y = x - 4
+print a.run(1), a.run(0), y > x, y / (x - 3)
+)"s;
+    Program plain(source);
+    Program specialized(source);
+    ResolveLocals(specialized.ast);
+    TypeCoverage coverage;
+    // Сложения i и s, i * 2 + 1, сравнения t и s, сложение и два сравнения в print,
+    // а на верхнем уровне x - 4, сравнение, деление и x - 3
+    ASSERT_EQUAL(SpecializeOperations(specialized.ast, 0, &coverage), 13u);
+    // Не доказаны типы аргументов n > 0 и self.v + t. Условия обеих условных инструкций -
+    // логические значения
+    ASSERT_EQUAL(coverage.operations, 17u);
+    ASSERT_EQUAL(coverage.typed, 15u);
+    ASSERT_EQUAL(SpecializeOperations(specialized.ast), 0u);
+
+    ostringstream tree;
+    PrintTree(specialized.ast, specialized.root, tree);
+    ASSERT(tree.str().find("Mult [Number]"s) != string::npos);
+    ASSERT(tree.str().find("Equal [String]"s) != string::npos);
+
+    // Деление на ноль, как и без специализации, выбрасывает исключение
+    string expected;
+    try {
+        plain.Run();
+    } catch (const runtime_error& error) {
+        expected = error.what();
+    }
+    try {
+        specialized.Run();
+        ASSERT(false);
+    } catch (const runtime_error& error) {
+        ASSERT_EQUAL(string(error.what()), expected);
+    }
+
+    Program fixed(source.substr(0, source.rfind(", y /")) + "\n"s);
+    ResolveLocals(fixed.ast);
+    SpecializeOperations(fixed.ast);
+    ASSERT_EQUAL(fixed.Run(), "ab3 False True\n3 a5 False True\n5 False\n"s);
+}
+
+// Определение класса присваивает класс переменной с его именем
+void TestClassDefinitionRebindsName() {
+    for (const auto& [value, operand] : {pair{"1"s, "1"s}, pair{"'a'"s, "'b'"s}}) {
+        const string source = "Foo = "s + value + "\nclass Foo:\n  def f():\n    return 0\nprint Foo + "s
+                              + operand + "\n"s;
+        Program plain(source);
+        Program specialized(source);
+        ASSERT_EQUAL(SpecializeOperations(specialized.ast), 0u);
+        ASSERT_THROWS(plain.Run(), runtime_error);
+        ASSERT_THROWS(specialized.Run(), runtime_error);
+
+        // Ошибочно доказанный тип не приводит к чтению класса как числа или строки
+        Program annotated(source);
+        for (NodeId node = 0; node < annotated.ast.NodeCount(); ++node) {
+            if (annotated.ast.Kind(node) == NodeKind::Add) {
+                Operands op = annotated.ast.GetOperands(node);
+                op.c = static_cast<uint32_t>(value == "1"s ? ValueType::Number : ValueType::String);
+                annotated.ast.SetNode(node, NodeKind::Add, op);
+            }
+        }
+        ASSERT_THROWS(annotated.Run(), runtime_error);
+    }
+}
+
+void TestUnboxLocals() {
+    const string source = R"(
+class Poly:
+  def eval(x):
+    a = x * x
+    b = a * 3 + x * 2 - 1
+    if b > 100:
+      b = b / 2
+    return a + b
+  def label(x):
+    s = x * 2
+    return 'value ' + str(s)
+
+p = Poly()
+print p.eval(3), p.eval(20), p.label(4)
+)"s;
+    Program plain(source);
+    Program optimized(source);
+    ResolveLocals(optimized.ast);
+    // Три присваивания в eval. Переменная s в label передаётся в str()
+    ASSERT_EQUAL(UnboxLocals(optimized.ast), 3u);
+    ASSERT_EQUAL(CountKind(optimized.ast, NodeKind::ScratchAssignment), 3u);
+    ASSERT_EQUAL(UnboxLocals(optimized.ast), 0u);
+
+    // Промежуточные результаты выражений объектов не создают. Без оптимизаций объект создаётся
+    // для значения каждой переменной в Closure: по три и четыре объекта в вызовах eval.
+    // С ячейками eval создаёт только возвращаемое значение, а label - значение s, которое
+    // передаётся в str(), и две строки. Ещё один объект - экземпляр Poly
+#ifndef NDEBUG
+    size_t before = runtime::ObjectHolder::OwnCount();
+    ASSERT_EQUAL(plain.Run(), "41 1019 value 8\n"s);
+    const size_t plain_count = runtime::ObjectHolder::OwnCount() - before;
+    before = runtime::ObjectHolder::OwnCount();
+    ASSERT_EQUAL(optimized.Run(), "41 1019 value 8\n"s);
+    const size_t optimized_count = runtime::ObjectHolder::OwnCount() - before;
+    ASSERT_EQUAL(plain_count, 11u);
+    ASSERT_EQUAL(optimized_count, 6u);
+#else
+    ASSERT_EQUAL(plain.Run(), "41 1019 value 8\n"s);
+    ASSERT_EQUAL(optimized.Run(), "41 1019 value 8\n"s);
+#endif
+}
+
+void TestFuseStatements() {
+    const string source = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+    self.name = 'c'
+  def add(k):
+    self.value = self.value + k
+    self.name = self.name + 'x'
+  def total(n):
+    i = 0
+    s = n
+    i = i + 1
+    s = s + i
+    s = s + self.value
+    return s
+  def get():
+    return self.value
+
+c = Counter()
+c.add(2)
+c.add(3)
+print c.total(4), c.get(), c.name
+)"s;
+    Program plain(source);
+    Program unboxed(source);
+    ResolveLocals(unboxed.ast);
+    UnboxLocals(unboxed.ast);
+    Program fused(source);
+    ResolveLocals(fused.ast);
+    UnboxLocals(fused.ast);
+    // Два сложения с полями в add, три x = x + k и два return в total и get
+    ASSERT_EQUAL(FuseStatements(fused.ast), 7u);
+    ASSERT_EQUAL(CountKind(fused.ast, NodeKind::FieldIncrement), 2u);
+    ASSERT_EQUAL(CountKind(fused.ast, NodeKind::LocalIncrement), 3u);
+    ASSERT_EQUAL(CountKind(fused.ast, NodeKind::ReturnLocal), 2u);
+    ASSERT_EQUAL(FuseStatements(fused.ast), 0u);
+    ASSERT_EQUAL(plain.Run(), "10 5 cxx\n"s);
+
+    // Переменная i и после увеличения хранит число в ячейке без объекта
+#ifndef NDEBUG
+    size_t before = runtime::ObjectHolder::OwnCount();
+    ASSERT_EQUAL(unboxed.Run(), "10 5 cxx\n"s);
+    const size_t unboxed_count = runtime::ObjectHolder::OwnCount() - before;
+    before = runtime::ObjectHolder::OwnCount();
+    ASSERT_EQUAL(fused.Run(), "10 5 cxx\n"s);
+    ASSERT_EQUAL(runtime::ObjectHolder::OwnCount() - before, unboxed_count);
+#else
+    ASSERT_EQUAL(unboxed.Run(), "10 5 cxx\n"s);
+    ASSERT_EQUAL(fused.Run(), "10 5 cxx\n"s);
+#endif
+
+    // Поле и переменная читаются до вычисления слагаемого, поэтому ошибки не меняются
+    const auto error_of = [](Program& program) {
+        try {
+            program.Run();
+        } catch (const runtime_error& error) {
+            return string(error.what());
+        }
+        return string();
+    };
+    for (const string& statement :
+         {"self.missing = self.missing + z"s, "u = u + z"s, "self.value = self.value + None"s,
+          "v = 'a'\n    v = v + 1"s, "o.f = o.f + z"s}) {
+        const string failing = R"(
+class Broken:
+  def __init__():
+    self.value = 0
+  def run(o):
+    )"s + statement + "\n\nb = Broken()\nb.run(5)\n"s;
+        Program plain_failing(failing);
+        Program fused_failing(failing);
+        ResolveLocals(fused_failing.ast);
+        ASSERT_EQUAL(FuseStatements(fused_failing.ast), 1u);
+        const string expected = error_of(plain_failing);
+        ASSERT(!expected.empty());
+        ASSERT_EQUAL(error_of(fused_failing), expected);
+    }
+}
+
+}  // namespace
+
+void RunPassesTests(TestRunner& tr) {
+    RUN_TEST(tr, flat::TestFoldArithmetic);
+    RUN_TEST(tr, flat::TestFoldLogic);
+    RUN_TEST(tr, flat::TestKeepsRuntimeErrors);
+    RUN_TEST(tr, flat::TestFoldedProgramOutput);
+    RUN_TEST(tr, flat::TestEliminateBranches);
+    RUN_TEST(tr, flat::TestPruneAfterReturn);
+    RUN_TEST(tr, flat::TestDeadCodeKeepsUnknownConditions);
+    RUN_TEST(tr, flat::TestResolveLocals);
+    RUN_TEST(tr, flat::TestResolvedLocalsErrors);
+    RUN_TEST(tr, flat::TestResolveSkipsNestedClasses);
+    RUN_TEST(tr, flat::TestPassManager);
+    RUN_TEST(tr, flat::TestPrintTree);
+    RUN_TEST(tr, flat::TestDevirtualizeCalls);
+    RUN_TEST(tr, flat::TestDevirtualizedCallGuard);
+    RUN_TEST(tr, flat::TestInlineCalls);
+    RUN_TEST(tr, flat::TestInlinedCallErrors);
+    RUN_TEST(tr, flat::TestEliminateCommonLoads);
+    RUN_TEST(tr, flat::TestCommonLoadsInInlinedArguments);
+    RUN_TEST(tr, flat::TestCommonLoadsBarriers);
+    RUN_TEST(tr, flat::TestInferTypes);
+    RUN_TEST(tr, flat::TestSpecializeOperations);
+    RUN_TEST(tr, flat::TestClassDefinitionRebindsName);
+    RUN_TEST(tr, flat::TestUnboxLocals);
+    RUN_TEST(tr, flat::TestFuseStatements);
+}
+
+}  // namespace flat
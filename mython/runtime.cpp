@@ -91,6 +91,10 @@ bool ClassInstance::HasMethod(const std::string& method, size_t argument_count)
     return false;
 }
 
+const Class& ClassInstance::GetClass() const {
+    return _cls;
+}
+
 Closure& ClassInstance::Fields() {
     return _field;   
 }
@@ -132,6 +136,10 @@ Class::Class(std::string name, std::vector<Method> methods, const Class* parent)
 
 }
 
+void Class::SetMethods(std::vector<Method> methods) {
+    _methods = std::move(methods);
+}
+
 const Method* Class::GetMethod(const std::string& name) const {
     for(const Method& method: _methods){
         if(method.name == name){
@@ -147,17 +155,29 @@ const Method* Class::GetMethod(const std::string& name) const {
     return nullptr;
 }
 
+const std::vector<Method>& Class::GetMethods() const {
+    return _methods;
+}
+
 [[nodiscard]] const std::string& Class::GetName() const {
     assert(this->_name_class.size() != 0);
     return this->_name_class;
 }
 
+const Class* Class::GetParent() const {
+    return _parent_class;
+}
+
 void Class::Print(ostream& os, Context& /*context*/) {
     assert(_name_class.size() != 0);
     os << "Class "
        << _name_class ;
 }
 
+void String::Print(std::ostream& os, [[maybe_unused]] Context& context) {
+    os << GetValue();
+}
+
 void Bool::Print(std::ostream& os, [[maybe_unused]] Context& context) {
     os << (GetValue() ? "True"sv : "False"sv);
 }
@@ -3,6 +3,7 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -37,9 +38,20 @@ public:
     // object копируется или перемещается в кучу
     template <typename T>
     [[nodiscard]] static ObjectHolder Own(T&& object) {
+#ifndef NDEBUG
+        ++own_count_;
+#endif
         return ObjectHolder(std::make_shared<T>(std::forward<T>(object)));
     }
 
+#ifndef NDEBUG
+    // Число объектов, размещённых в куче вызовами Own в текущем потоке.
+    // Считается только в отладочной сборке, для тестов
+    [[nodiscard]] static size_t OwnCount() {
+        return own_count_;
+    }
+#endif
+
     // Создаёт ObjectHolder, не владеющий объектом (аналог слабой ссылки)
     [[nodiscard]] static ObjectHolder Share(Object& object);
     // Создаёт пустой ObjectHolder, соответствующий значению None
@@ -68,6 +80,9 @@ private:
     void AssertIsValid() const;
 
     std::shared_ptr<Object> data_;
+#ifndef NDEBUG
+    static inline thread_local size_t own_count_ = 0;
+#endif
 };
 
 // Объект-значение, хранящий значение типа T
@@ -75,7 +90,7 @@ template <typename T>
 class ValueObject : public Object {
 public:
     ValueObject(T v)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
-        : value_(v) {
+        : value_(std::move(v)) {
     }
 
     void Print(std::ostream& os, [[maybe_unused]] Context& context) override {
@@ -106,8 +121,33 @@ public:
     virtual ObjectHolder Execute(Closure& closure, Context& context) = 0;
 };
 
-// Строковое значение
-using String = ValueObject<std::string>;
+// Строковое значение.
+// Строка либо владеет своим текстом, либо ссылается на участок общего буфера, например
+// на константу в тексте программы. Такой буфер живёт, пока на него ссылается хотя бы одна строка
+class String : public Object {
+public:
+    String(std::string value)  // NOLINT(google-explicit-constructor,hicpp-explicit-conversions)
+        : owned_(std::move(value)) {
+    }
+
+    // Создаёт строку, ссылающуюся на value внутри буфера, которым владеет storage
+    String(std::shared_ptr<const void> storage, std::string_view value)
+        : storage_(std::move(storage))
+        , view_(value) {
+    }
+
+    void Print(std::ostream& os, Context& context) override;
+
+    [[nodiscard]] std::string_view GetValue() const {
+        return storage_ ? view_ : std::string_view(owned_);
+    }
+
+private:
+    std::string owned_;
+    std::shared_ptr<const void> storage_;
+    std::string_view view_;
+};
+
 // Числовое значение
 using Number = ValueObject<int>;
 
@@ -139,9 +179,19 @@ public:
     // Возвращает указатель на метод name или nullptr, если метод с таким именем отсутствует
     [[nodiscard]] const Method* GetMethod(const std::string& name) const;
 
+    // Задаёт методы класса, объявленного заранее без методов.
+    // Применяется синтаксическим анализатором до того, как класс начнёт использоваться
+    void SetMethods(std::vector<Method> methods);
+
+    // Возвращает собственные методы класса, без унаследованных
+    [[nodiscard]] const std::vector<Method>& GetMethods() const;
+
     // Возвращает имя класса
     [[nodiscard]] const std::string& GetName() const;
 
+    // Возвращает родительский класс либо nullptr
+    [[nodiscard]] const Class* GetParent() const;
+
     // Выводит в os строку "Class <имя класса>", например "Class cat"
     void Print(std::ostream& os, Context& /*context*/) override;
 
@@ -175,6 +225,9 @@ public:
     // Возвращает true, если объект имеет метод method, принимающий argument_count параметров
     [[nodiscard]] bool HasMethod(const std::string& method, size_t argument_count) const;
 
+    // Возвращает класс объекта
+    [[nodiscard]] const Class& GetClass() const;
+
     // Возвращает ссылку на Closure, содержащий поля объекта
     [[nodiscard]] Closure& Fields();
     // Возвращает константную ссылку на Closure, содержащую поля объекта
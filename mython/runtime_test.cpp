@@ -71,6 +71,24 @@ void TestString() {
     ASSERT_EQUAL(word.GetValue(), "hello!"s);
 }
 
+void TestStringSharesStorage() {
+    auto storage = make_shared<const string>("print 'hello'"s);
+    const weak_ptr<const string> weak = storage;
+    {
+        String word(storage, string_view(*storage).substr(7, 5));
+        storage.reset();
+
+        // Строка удерживает буфер и не копирует текст
+        ASSERT(!weak.expired());
+        ASSERT_EQUAL(word.GetValue(), "hello"s);
+        ASSERT(word.GetValue().data() == weak.lock()->data() + 7);
+
+        const String copy = word;
+        ASSERT(copy.GetValue().data() == word.GetValue().data());
+    }
+    ASSERT(weak.expired());
+}
+
 void TestBool() {
     Bool t(true);
     ASSERT_EQUAL(t.GetValue(), true);
@@ -534,6 +552,7 @@ void TestClassInstance() {
 void RunObjectsTests(TestRunner& tr) {
     RUN_TEST(tr, runtime::TestNumber);
     RUN_TEST(tr, runtime::TestString);
+    RUN_TEST(tr, runtime::TestStringSharesStorage);
     RUN_TEST(tr, runtime::TestBool);
     RUN_TEST(tr, runtime::TestMethodInvocation);
     RUN_TEST(tr, runtime::TestIsTrue);
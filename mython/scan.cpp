@@ -0,0 +1,247 @@
+#include "scan.h"
+
+#if defined(__SSE2__)
+#define MYTHON_SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(MYTHON_SCAN_SSE2) && defined(__GNUC__) && defined(__x86_64__)
+// AVX2-вариант компилируется всегда, а выбирается во время выполнения по возможностям процессора
+#define MYTHON_SCAN_AVX2
+#include <immintrin.h>
+#endif
+
+namespace parse::scan {
+
+namespace {
+
+// Побайтовые варианты поиска, обрабатывают остаток буфера короче одного блока
+const char* FindStringSpecialScalar(const char* pos, const char* end, char quote) {
+    while (pos != end && *pos != quote && *pos != '\\' && *pos != '\n' && *pos != '\r') {
+        ++pos;
+    }
+    return pos;
+}
+
+const char* FindNewlineScalar(const char* pos, const char* end) {
+    while (pos != end && *pos != '\n') {
+        ++pos;
+    }
+    return pos;
+}
+
+const char* SkipSpacesScalar(const char* pos, const char* end) {
+    while (pos != end && *pos == ' ') {
+        ++pos;
+    }
+    return pos;
+}
+
+const char* SkipAsciiScalar(const char* pos, const char* end) {
+    while (pos != end && (static_cast<unsigned char>(*pos) & 0x80u) == 0) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Возвращает длину корректной последовательности UTF-8, начинающейся в pos, либо 0.
+// Допустимые диапазоны второго байта исключают избыточные записи, суррогаты и коды больше U+10FFFF
+size_t Utf8SequenceLength(const char* pos, const char* end) {
+    const auto byte = [pos](size_t i) {
+        return static_cast<unsigned char>(pos[i]);
+    };
+    const unsigned char lead = byte(0);
+    size_t length = 0;
+    unsigned char min_second = 0x80;
+    unsigned char max_second = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead == 0xE0) {
+        length = 3;
+        min_second = 0xA0;
+    } else if (lead == 0xED) {
+        length = 3;
+        max_second = 0x9F;
+    } else if (lead >= 0xE1 && lead <= 0xEF) {
+        length = 3;
+    } else if (lead == 0xF0) {
+        length = 4;
+        min_second = 0x90;
+    } else if (lead >= 0xF1 && lead <= 0xF3) {
+        length = 4;
+    } else if (lead == 0xF4) {
+        length = 4;
+        max_second = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (static_cast<size_t>(end - pos) < length || byte(1) < min_second || byte(1) > max_second) {
+        return 0;
+    }
+    for (size_t i = 2; i < length; ++i) {
+        if ((byte(i) & 0xC0u) != 0x80u) {
+            return 0;
+        }
+    }
+    return length;
+}
+
+#ifdef MYTHON_SCAN_SSE2
+
+// Маска совпадений: бит i установлен, если i-й байт блока равен одному из искомых символов
+template <typename... Chars>
+unsigned MatchSse2(__m128i block, Chars... chars) {
+    __m128i matches = _mm_setzero_si128();
+    ((matches = _mm_or_si128(matches, _mm_cmpeq_epi8(block, _mm_set1_epi8(chars)))), ...);
+    return static_cast<unsigned>(_mm_movemask_epi8(matches));
+}
+
+template <typename... Chars>
+const char* FindAnySse2(const char* pos, const char* end, Chars... chars) {
+    while (end - pos >= 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        if (const unsigned mask = MatchSse2(block, chars...); mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+    return pos;
+}
+
+const char* SkipSpacesSse2(const char* pos, const char* end) {
+    while (end - pos >= 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        if (const unsigned mask = ~MatchSse2(block, ' ') & 0xFFFFu; mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+    return pos;
+}
+
+const char* SkipAsciiSse2(const char* pos, const char* end) {
+    while (end - pos >= 16) {
+        const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+        // Старший бит установлен только у байтов многобайтовых последовательностей
+        if (const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(block)); mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+    return pos;
+}
+
+#endif
+
+#ifdef MYTHON_SCAN_AVX2
+
+template <typename... Chars>
+__attribute__((target("avx2"))) unsigned MatchAvx2(__m256i block, Chars... chars) {
+    __m256i matches = _mm256_setzero_si256();
+    ((matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(block, _mm256_set1_epi8(chars)))),
+     ...);
+    return static_cast<unsigned>(_mm256_movemask_epi8(matches));
+}
+
+template <typename... Chars>
+__attribute__((target("avx2"))) const char* FindAnyAvx2(const char* pos, const char* end,
+                                                        Chars... chars) {
+    while (end - pos >= 32) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+        if (const unsigned mask = MatchAvx2(block, chars...); mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+    return pos;
+}
+
+__attribute__((target("avx2"))) const char* SkipSpacesAvx2(const char* pos, const char* end) {
+    while (end - pos >= 32) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+        if (const unsigned mask = ~MatchAvx2(block, ' '); mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+    return pos;
+}
+
+__attribute__((target("avx2"))) const char* SkipAsciiAvx2(const char* pos, const char* end) {
+    while (end - pos >= 32) {
+        const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pos));
+        if (const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(block)); mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+    return pos;
+}
+
+const bool HAS_AVX2 = __builtin_cpu_supports("avx2");
+
+#endif
+
+// Проходит по буферу блоками, пока не найдёт совпадение, и дочитывает остаток побайтово
+template <typename... Chars>
+const char* FindAny(const char* pos, const char* end, Chars... chars) {
+#ifdef MYTHON_SCAN_AVX2
+    if (HAS_AVX2) {
+        pos = FindAnyAvx2(pos, end, chars...);
+    }
+#endif
+#ifdef MYTHON_SCAN_SSE2
+    pos = FindAnySse2(pos, end, chars...);
+#endif
+    return pos;
+}
+
+}  // namespace
+
+const char* FindStringSpecial(const char* pos, const char* end, char quote) {
+    pos = FindAny(pos, end, quote, '\\', '\n', '\r');
+    return FindStringSpecialScalar(pos, end, quote);
+}
+
+const char* FindNewline(const char* pos, const char* end) {
+    pos = FindAny(pos, end, '\n');
+    return FindNewlineScalar(pos, end);
+}
+
+size_t CountSpaces(const char* pos, const char* end) {
+    const char* begin = pos;
+#ifdef MYTHON_SCAN_AVX2
+    if (HAS_AVX2) {
+        pos = SkipSpacesAvx2(pos, end);
+    }
+#endif
+#ifdef MYTHON_SCAN_SSE2
+    pos = SkipSpacesSse2(pos, end);
+#endif
+    return SkipSpacesScalar(pos, end) - begin;
+}
+
+const char* FindInvalidUtf8(const char* pos, const char* end) {
+    while (true) {
+#ifdef MYTHON_SCAN_AVX2
+        if (HAS_AVX2) {
+            pos = SkipAsciiAvx2(pos, end);
+        }
+#endif
+#ifdef MYTHON_SCAN_SSE2
+        pos = SkipAsciiSse2(pos, end);
+#endif
+        pos = SkipAsciiScalar(pos, end);
+        if (pos == end) {
+            return end;
+        }
+        const size_t length = Utf8SequenceLength(pos, end);
+        if (length == 0) {
+            return pos;
+        }
+        pos += length;
+    }
+}
+
+}  // namespace parse::scan
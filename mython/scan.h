@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+
+// Поиск символов в исходном тексте блоками по 16 (SSE2) или 32 (AVX2) байта.
+// На платформах без SSE2 используется побайтовый поиск
+namespace parse::scan {
+
+// Возвращает указатель на первый символ quote, '\\', '\n' или '\r' в [pos, end) либо end.
+// Применяется для поиска конца тела строковой константы
+const char* FindStringSpecial(const char* pos, const char* end, char quote);
+
+// Возвращает указатель на первый символ '\n' в [pos, end) либо end.
+// Применяется для пропуска комментариев
+const char* FindNewline(const char* pos, const char* end);
+
+// Возвращает количество идущих подряд пробелов, начиная с pos
+size_t CountSpaces(const char* pos, const char* end);
+
+// Возвращает указатель на начало первой некорректной последовательности UTF-8 в [pos, end)
+// либо end. Некорректны лишние байты продолжения, избыточные (overlong) записи, суррогаты
+// и коды больше U+10FFFF. Участки из символов ASCII пропускаются блоками
+const char* FindInvalidUtf8(const char* pos, const char* end);
+
+}  // namespace parse::scan
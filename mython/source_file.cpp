@@ -0,0 +1,69 @@
+#include "source_file.h"
+
+#ifdef _WIN32
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace parse {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& path) {
+    ifstream file(path, ios::binary);
+    if (!file) {
+        throw SourceFileError("Cannot open file "s + path);
+    }
+    buffer_.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() = default;
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw SourceFileError("Cannot open file "s + path);
+    }
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw SourceFileError("Cannot get size of file "s + path);
+    }
+
+    // Пустой файл отобразить нельзя, для него остаётся пустой буфер
+    if (st.st_size > 0) {
+        size_ = static_cast<size_t>(st.st_size);
+        mapping_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping_ == MAP_FAILED) {
+            mapping_ = nullptr;
+            close(fd);
+            throw SourceFileError("Cannot map file "s + path);
+        }
+        // Лексер читает файл строго последовательно
+        madvise(mapping_, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(mapping_);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (mapping_ != nullptr) {
+        munmap(mapping_, size_);
+    }
+}
+
+#endif
+
+}  // namespace parse
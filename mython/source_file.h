@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace parse {
+
+class SourceFileError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Файл с исходным кодом программы, отображённый в память только для чтения.
+// Содержимое доступно, пока существует объект
+class MappedFile {
+public:
+    // Выбрасывает SourceFileError, если файл не удалось открыть или отобразить в память
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Возвращает содержимое файла
+    [[nodiscard]] std::string_view Data() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = "";
+    size_t size_ = 0;
+#ifdef _WIN32
+    // На Windows файл читается в память целиком
+    std::string buffer_;
+#else
+    void* mapping_ = nullptr;
+#endif
+};
+
+}  // namespace parse
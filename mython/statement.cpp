@@ -160,8 +160,10 @@ ObjectHolder Add::Execute(Closure& closure, Context& context) {
     }else if(!n_lhs && s_lhs && !class_inst_lhs){
         runtime::String* s_rhs = rhs.TryAs<runtime::String>();
         if(s_rhs){
-            std::string str_result_add = s_lhs->GetValue() + s_rhs->GetValue();
-            return std::move(ObjectHolder::Own(runtime::String(str_result_add)));
+            std::string str_result_add;
+            str_result_add.reserve(s_lhs->GetValue().size() + s_rhs->GetValue().size());
+            str_result_add.append(s_lhs->GetValue()).append(s_rhs->GetValue());
+            return std::move(ObjectHolder::Own(runtime::String(std::move(str_result_add))));
         }
     }else if(!n_lhs && !s_lhs && class_inst_lhs){
         if(class_inst_lhs && class_inst_lhs->HasMethod("__add__"s, 1) ){
@@ -239,7 +241,7 @@ ClassDefinition::ClassDefinition(ObjectHolder cls)
 }
 
 ObjectHolder ClassDefinition::Execute(Closure& closure, Context& /*context*/) {
-    closure[_cls.TryAs<runtime::Class>()->GetName()] = std::move(_cls);
+    closure[_cls.TryAs<runtime::Class>()->GetName()] = _cls;
     return {};
 }
 